@@ -0,0 +1,8 @@
+(def {fun} (\ {args body} {def (head args) (\ (tail args) body)}))
+
+(fun {sum n acc} {if (<= n 0) {acc} {sum (- n 1) (% (+ acc (* n 3) (/ n 2) 1) 1000003)}})
+(fun {cmp n c} {if (== n 0) {c} {cmp (- n 1) (+ c (> n 5) (!= n 7) (<= n 3))}})
+(fun {checked n acc} {if (<= n 0) {acc} {checked (-! n 1) (% (+! acc (*! n 3) 1) 1000003)}})
+(fun {apply f n acc} {if (== n 0) {acc} {apply f (- n 1) (f acc n)}})
+
+(+ (sum 100000 0) (cmp 100000 0) (checked 100000 0) (apply + 100000 0) (apply < 100000 0))
@@ -0,0 +1,10 @@
+(def {fun} (\ {args body} {def (head args) (\ (tail args) body)}))
+
+(fun {cons n l} {if (== n 0) {l} {cons (- n 1) (list n l)}})
+(fun {pairs n l} {if (== n 0) {l} {pairs (- n 1) (list l n n)}})
+(fun {size n l} {if (== l {}) {n} {size (+ n 1) (eval (head (tail l)))}})
+(fun {total n l} {if (== l {}) {n} {total (+ n (eval (head l))) (eval (head (tail l)))}})
+
+(def {xs} (cons 100000 {}))
+(def {ys} (pairs 100000 {}))
+(+ (size 0 xs) (total 0 xs))
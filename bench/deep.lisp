@@ -0,0 +1,13 @@
+(def {fun} (\ {args body} {def (head args) (\ (tail args) body)}))
+
+(fun {count n} {if (== n 0) {0} {+ 1 (count (- n 1))}})
+(fun {nest n l} {if (== n 0) {l} {nest (- n 1) (list l n n n)}})
+(fun {small n l} {if (== n 0) {l} {small (- n 1) (list l)}})
+(fun {dig n l} {if (== n 0) {0} {+ (dig (- n 1) (eval (head l))) 1}})
+
+(def {xs} (nest 100000 {}))
+(def {ys} (nest 100000 {}))
+(def {zs} (small 2000 {}))
+(def {zs} (dig 2000 zs))
+(def {xs} (== xs ys))
+(+ xs zs (count 5000))
@@ -0,0 +1,10 @@
+(def {fun} (\ {args body} {def (head args) (\ (tail args) body)}))
+
+(defmacro {twice x} {(\ {t} {+ t t}) x})
+(defmacro {with x} {(\ {t} {x}) 5})
+(defmacro {outer x} {(\ {t} {with t}) x})
+(defmacro {down n} {if (== n 0) {0} {+ 1 (down (- n 1))}})
+
+(fun {run n acc} {if (== n 0) {acc} {run (- n 1) (+ acc (eval {twice (outer n)}))}})
+
+(+ (run 200000 0) (down 200))
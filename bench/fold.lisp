@@ -0,0 +1,7 @@
+(def {fun} (\ {args body} {def (head args) (\ (tail args) body)}))
+
+(fun {secs n acc} {if (== n 0) {acc} {secs (- n 1) (% (+ acc (* n 60 60 24) (* 7 (+ 1 2 3)) 1) 1000003)}})
+(fun {pick n acc} {if (== n 0) {acc} {pick (- n 1) (+ acc (if (> 2 1) {n} {0}) (== (head {1 2 3}) {1}) (- n 1 1))}})
+(fun {tab n acc} {if (== n 0) {acc} {tab (- n 1) (+ acc (== (tail (join {1 2} (list 3 4))) {2 3 4}))}})
+
+(+ (secs 200000 0) (pick 200000 0) (tab 200000 0))
@@ -0,0 +1,10 @@
+(def {fun} (\ {args body} {def (head args) (\ (tail args) body)}))
+
+(fun {inc x} {+ x 1})
+(fun {sq x} {* x x})
+(fun {clamp x lo hi} {if (< x lo) {lo} {if (> x hi) {hi} {x}}})
+(fun {mix a b} {% (+ (sq a) (* 3 b) (inc b)) 1000003})
+
+(fun {run n acc} {if (== n 0) {acc} {run (- n 1) (mix (clamp (inc acc) 0 999999) (sq (% n 1000)))}})
+
+(run 200000 0)
@@ -0,0 +1,15 @@
+(def {fun} (\ {args body} {def (head args) (\ (tail args) body)}))
+
+(fun {append n l} {if (== n 0) {l} {append (- n 1) (join l (list n))}})
+(fun {prepend n l} {if (== n 0) {l} {prepend (- n 1) (join (list n) l)}})
+(fun {double n l} {if (== n 0) {l} {double (- n 1) (join l l)}})
+(fun {drop n l} {if (== n 0) {l} {drop (- n 1) (tail l)}})
+(fun {chop n l} {if (== n 0) {l} {chop (- n 1) (join (tail l) (head l))}})
+(fun {sum l} {eval (join {+} l)})
+
+(def {xs} (append 2000 {}))
+(def {ys} (prepend 2000 {}))
+(def {big} (double 8 (join xs ys)))
+(def {mid} (chop 2000 (drop 2000 big)))
+
+(sum (join mid big mid xs ys))
@@ -0,0 +1,10 @@
+(def {fun} (\ {args body} {def (head args) (\ (tail args) body)}))
+
+(defmacro {unless c a b} {if c b a})
+(defmacro {sq x} {* x x})
+(defmacro {clamp x lo hi} {if (< x lo) {lo} {if (> x hi) {hi} {x}}})
+(defmacro {swap-sub a b} {(\ {t} {- b t}) a})
+
+(fun {run n acc} {unless (== n 0) {run (- n 1) (% (+ acc (sq (clamp (% n 1500) 0 999)) (swap-sub n 7)) 1000003)} {acc}})
+
+(run 300000 0)
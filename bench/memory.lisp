@@ -0,0 +1,12 @@
+(def {fun} (\ {args body} {def (head args) (\ (tail args) body)}))
+(fun {map f l} {if (== l {}) {{}} {join (list (f (eval (head l)))) (map f (tail l))}})
+(fun {range a b} {if (> a b) {{}} {join (list a) (range (+ a 1) b)}})
+(fun {sum l} {if (== l {}) {0} {+ (eval (head l)) (sum (tail l))}})
+(fun {add a b} {+ a b})
+(fun {record n} {list n (* n n) {point}})
+(fun {records n} {map record (range 1 n)})
+(def {points} (records 2000))
+(def {adders} (map add (range 1 2000)))
+(def {squares} (map (\ {p} {eval (head (tail p))}) points))
+(def {names} (map (\ {p} {list (eval (head (tail (tail p))))}) points))
+(+ (sum squares) (sum (map (\ {f} {f 1}) adders)))
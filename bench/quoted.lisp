@@ -0,0 +1,7 @@
+(def {z} 100)
+
+(def {pair} (\ {y} {tail {y z}}))
+(def {use} (\ {z} {eval (pair z)}))
+(def {run} (\ {n acc} {if (== n 0) {acc} {run (- n 1) (+ acc (use n))}}))
+
+(run 200000 0)
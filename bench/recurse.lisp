@@ -0,0 +1,6 @@
+(defmacro {down n} {if (== n 0) {0} {+ 1 (down (- n 1))}})
+(defmacro {again x} {again x})
+
+(def {spin} (\ {x} {again x}))
+
+(+ (down 3) (spin 0))
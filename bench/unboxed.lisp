@@ -0,0 +1,9 @@
+(def {fun} (\ {args body} {def (head args) (\ (tail args) body)}))
+
+(fun {poly x} {% (+ (* 3 x x x) (* -7 x x) (* 11 x) 5) 1000003})
+(fun {dist x y} {+ (* (- x 50) (- x 50)) (* (- y 25) (- y 25))})
+(fun {near x y} {if (< (dist x y) 900) {1} {0}})
+
+(fun {run n acc} {if (== n 0) {acc} {run (- n 1) (+ acc (poly (% n 1000)) (near (% n 101) (% (* n 7) 53)))}})
+
+(run 200000 0)
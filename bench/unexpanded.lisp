@@ -0,0 +1,5 @@
+(defmacro {sq x} {* x x})
+
+(def {app} (\ {f x} {f x}))
+
+(+ (sq 3) (eval {sq 4}) (app sq 3))
@@ -1,10 +1,33 @@
 #ifndef MEOWLISP_H_
 #define MEOWLISP_H_
 
+#include <stddef.h>
+#include <stdio.h>
+
 struct lval;
 struct lenv;
+struct lstore;
+struct lnode;
+struct llambda;
+struct lpartial;
+struct lcode;
+struct lexpr;
+struct lnum;
+struct ljit;
+struct lfold;
+struct lsym;
 typedef struct lval lval_t;
 typedef struct lenv lenv_t;
+typedef struct lstore lstore_t;
+typedef struct lnode lnode_t;
+typedef struct llambda llambda_t;
+typedef struct lpartial lpartial_t;
+typedef struct lcode lcode_t;
+typedef struct lexpr lexpr_t;
+typedef struct lnum lnum_t;
+typedef struct ljit ljit_t;
+typedef struct lfold lfold_t;
+typedef struct lsym lsym_t;
 
 enum {
 	LVAL_ERR,
@@ -17,33 +40,281 @@ enum {
 
 typedef lval_t *(*lbuiltin_t)(lenv_t *, lval_t *);
 
+/*
+ * What lists and environments hold to refer to an lval. Normally that's just
+ * a pointer, but built with LVAL_HANDLES every lval lives in one big region,
+ * lheap, and a reference is its offset in there in 16 byte units. That halves
+ * the size of cell arrays and still reaches 64GB worth of lvals. Handle 0 is
+ * never given out, so it can stand in for NULL.
+ */
+#ifdef LVAL_HANDLES
+#include <stdint.h>
+
+typedef uint32_t lref_t;
+extern char *lheap;
+
+#define LREF_SHIFT 4
+#define LREF(p)    ((lref_t)(((char *)(p) - lheap) >> LREF_SHIFT))
+#define LPTR(r)    ((lval_t *)(lheap + ((size_t)(r) << LREF_SHIFT)))
+#define LREF_NULL  0
+#else
+typedef lval_t *lref_t;
+
+#define LREF(p)    (p)
+#define LPTR(r)    (r)
+#define LREF_NULL  NULL
+#endif
+
+/* lval flags */
+#define LVAL_INLINE  0x01 /* list cells are kept in the lval */
+#define LVAL_BUILTIN 0x02 /* function is a builtin rather than a lambda */
+#define LVAL_BOUND   0x04 /* symbol has been resolved to a frame and slot */
+#define LVAL_GLOBAL  0x08 /* symbol can only ever be a global */
+#define LVAL_CACHED  0x10 /* symbol has a cache of where it was last found */
+#define LVAL_BORROWS 0x20 /* builtin keeps nothing of its list, so can be lent one */
+#define LVAL_PARTIAL 0x40 /* function is a lambda with some arguments given */
+#define LVAL_LENT    0x80 /* list was lent to a builtin, and isn't from a pool */
+
+#define LVAL_SMALL 3
+
+/*
+ * Every lval starts with a 16 byte core of type, flags, count and one word of
+ * payload, which is all numbers, functions and symbols need. Only lists
+ * get the full struct, either holding up to LVAL_SMALL cells themselves or
+ * saying where their cells live.
+ */
 struct lval {
-	int type;
+	unsigned char type;
+	unsigned char flags;
+	unsigned short depth; /* frames up a bound symbol's slot is */
+	int count;            /* cells in a list, a bound symbol's slot or a cached one's cache */
 	union {
 		long num;
 		char *err;
-		char *sym;
+		lsym_t *sym;
+		lbuiltin_t builtin;
+		llambda_t *lambda;
+		lpartial_t *partial;
+		/*
+		 * a list is a view of count cells somewhere inside store, or
+		 * once it grows large enough, a tree of such views
+		 */
+		struct {
+			lref_t *cell;
+			lstore_t *store;
+			lnode_t *tree;
+		};
+		lref_t small[LVAL_SMALL];
+	};
+};
+
+#define LVAL_CORE  (offsetof(lval_t, num) + sizeof(long))
+
+#define LSYM(v)     ((v)->sym->name)
+#define LREFS(v)    ((v)->flags & LVAL_INLINE ? (v)->small : (v)->cell)
+#define LCELL(v, i) LPTR(LREFS(v)[i])
+
+/*
+ * Symbols are interned, so there's exactly one of these for each name and
+ * symbols can be told apart by pointer, and each has an id of its own, which
+ * is where the global of that name is in the globals of an environment.
+ * version counts the bindings def and = have made for it, anywhere, and folds
+ * the folded lambda bodies that count on it staying the builtin it is.
+ */
+struct lsym {
+	int id;
+	unsigned hash;
+	unsigned version;
+	unsigned folds;
+	char name[];
+};
+
+/*
+ * lambdas never change once made, other than being compiled again when a
+ * fold is undone, or a macro making more fresh names, so copies share them
+ */
+/* llambda flags */
+#define LLAMBDA_VARARGS 0x01 /* takes the rest of its arguments with '&' */
+#define LLAMBDA_MACRO   0x02 /* is a macro, given its arguments as written */
+
+struct llambda {
+	int refs;
+	int flags;
+	lenv_t *env;
+	lval_t *formals;
+	lval_t *body;
+	lcode_t *code; /* body compiled to bytecode, if it has been */
+	lexpr_t *expr; /* or to closures */
+	int calls;     /* until it gets hot enough to JIT, -1 once we won't */
+	ljit_t *jit;
+	lfold_t *fold; /* body with its constants folded, if it had any */
+	lval_t *fresh; /* a macro's names for what it binds, a list per generation */
+};
+
+/* native code for a lambda, taking its arity arguments as an array of longs */
+struct ljit {
+	void *code;
+	size_t size;  /* bytes it takes up, to be handed on once it's freed */
+	int arity;
+	int bails;
+};
+
+/*
+ * A lambda body with the calls to pure builtins on constants worked out
+ * when it was made, which is what gets compiled and run. It only holds while
+ * each of sym is still that builtin; binding one of them again undoes it,
+ * and the lambda goes back to its body as written. The code compiled from
+ * the folded body is kept until the lambda goes, as calls still running
+ * might be using it.
+ *
+ * If macros were expanded in it there's no going back, so it's folded
+ * again instead, with the new fold keeping hold of this one in was. So
+ * is a lambda when one of calls, the globals it calls, is made a macro;
+ * a fold that's only there for that has no body of its own.
+ */
+struct lfold {
+	lval_t *body;
+	llambda_t *lambda;
+	lsym_t **sym;
+	int count;
+	lsym_t **calls;
+	int ncalls;
+	int undone;
+	int macros;
+	lcode_t *code;
+	lexpr_t *expr;
+	lfold_t *was;
+	lenv_t *root;  /* the globals it was folded against */
+	lfold_t *prev;
+	lfold_t *next;
+};
+
+/*
+ * Bytecode for a lambda body or a top level form: a stream of opcodes each
+ * followed by their operands, and the constants they refer to. stack is the
+ * most values it ever has on the stack at once, depth how many it has at the
+ * end of what's been compiled so far.
+ */
+struct lcode {
+	int count;
+	int cap;
+	int *op;
+	int nconst;
+	lval_t **consts;
+	int stack;
+	int depth;
+};
+
+/*
+ * An expression compiled to a closure: run does whatever this kind of
+ * expression needs, using val (a constant, a symbol, or the expression itself)
+ * and the compiled expressions in arg. num is the same expression worked out
+ * on longs, if it's only arithmetic.
+ */
+struct lexpr {
+	lval_t *(*run)(lexpr_t *x, lenv_t *e);
+	lval_t *val;
+	int count;
+	lexpr_t **arg;
+	lnum_t *num;
+};
+
+/*
+ * Arithmetic on longs: a number, a symbol that should hold one, or an if or
+ * arithmetic builtin named by sym applied to the count expressions in arg.
+ */
+struct lnum {
+	int op;
+	long num;
+	lval_t *sym;
+	int count;
+	lnum_t **arg;
+};
+
+/*
+ * A lambda, or another partial application, given count more arguments. have
+ * is how many there are all told down the chain.
+ */
+struct lpartial {
+	int refs;
+	int count;
+	int have;
+	lval_t *fun;
+	lref_t arg[];
+};
+
+/*
+ * Backing array for lists. Several lists may share one store, in which case
+ * it must not be written to; see lval_unshare(). Cells no longer visible
+ * through any list are LREF_NULL or still owned here and freed with the store.
+ */
+struct lstore {
+	int refs;
+	int count;
+	int cap;
+	lref_t cell[];
+};
+
+#define LNODE_BITS 5
+#define LNODE_MAX  (1 << LNODE_BITS)
+
+/*
+ * Node of a relaxed radix balanced tree. Leaves are a view into a store just
+ * like a flat list, branches record the running total of cells under each of
+ * their children. Nodes are shared between trees and never changed once built.
+ */
+struct lnode {
+	int refs;
+	int height;
+	int count;
+	union {
 		struct {
-			int count;
-			struct lval **cell;
+			lref_t *cell;
+			lstore_t *store;
 		};
 		struct {
-			lenv_t *env;
-			lval_t *formals;
-			lval_t *body;
-			lbuiltin_t builtin;
+			int *size;
+			lnode_t **child;
 		};
 	};
 };
 
+#define LENV_FLAT 8
+
+/*
+ * Bindings of a frame are kept in syms/vals. Up to LENV_FLAT of them are
+ * simply packed in at the front, past that cap is a power of two and they're
+ * a hash table with linear probing; empty slots have a NULL sym. Bindings are
+ * never removed. The globals don't use any of this; they're kept in global
+ * instead, a cell for each symbol indexed by its id, LREF_NULL for as long
+ * as nothing is bound to it, with nglobal how many cells there's room for.
+ */
+/* lenv flags */
+#define LENV_DYNAMIC 0x01 /* on the globals: lambdas see their caller's frame */
+#define LENV_CLOSURE 0x02 /* par is the frame a lambda was made in, and ours */
+#define LENV_GLOBAL  0x04 /* this is the globals rather than a frame */
+#define LENV_TREE    0x08 /* on the globals: walk the tree rather than compiling */
+#define LENV_CLOSURES 0x10 /* on the globals: compile to closures, not bytecode */
+#define LENV_NOJIT   0x20 /* on the globals: never compile hot lambdas to native code */
+#define LENV_PERFMAP 0x40 /* on the globals: tell perf where native code is */
+#define LENV_HELD    0x80 /* par is the frame of the lambda that tail called us, and ours */
+
 struct lenv {
 	lenv_t *par;
+	int refs;
+	int flags;
 	int count;
-	char **syms;
-	lval_t **vals;
+	int cap;
+	lsym_t **syms;
+	lref_t *vals;
+	lref_t *global;
+	int nglobal;
 };
 
 lval_t *lval_read(const char *input);
+lval_t *lval_load(lenv_t *e, const char *path);
+lval_t *lval_run(lenv_t *e, const char *input);
+lval_t *lval_emit_c(const char *path, FILE *out);
 lval_t *lval_eval(lenv_t *e, lval_t *v);
 void lval_println(const lval_t *v);
 void lval_del(lval_t *v);
@@ -51,5 +322,16 @@ void lenv_add_builtin(lenv_t *e, char *name, lbuiltin_t func);
 void lenv_add_builtins(lenv_t *e);
 lenv_t *lenv_new(void);
 void lenv_del(lenv_t *e);
+lsym_t *lsym_intern(const char *name);
+lval_t *lenv_global(lenv_t *e, lsym_t *sym);
+void lstats_print(void);
+
+/* how deep calls can nest before it's an error */
+extern int lval_max_depth;
+
+/* for programs compiled by lval_emit_c() */
+lval_t *lval_num(long num);
+lval_t *lval_call(lenv_t *e, lval_t *f, lval_t *a);
+int lval_nums(lval_t *a, long *x, int n);
 
 #endif /* MEOWLISP_H_ */
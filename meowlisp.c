@@ -1,30 +1,300 @@
+/* for vasprintf() and MAP_ANONYMOUS */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <limits.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
 #include "meowlisp.h"
 #include "mpc.h"
 
+/* formals and local names of the lambdas around a body being resolved */
+struct lscope {
+	lval_t *formals;
+	lval_t *locals;
+	struct lscope *up;
+};
+
+/*
+ * What a lambda being made takes from the frames around it, env being the
+ * innermost. frame gets a copy of each of their bindings the body uses, and
+ * whole is set if it needs to hang on to env itself as well.
+ */
+struct lcapture {
+	lenv_t *env;
+	lenv_t *frame;
+	int whole;
+};
+
+/*
+ * A lambda body being folded: env is where the lambda's being made and scope
+ * its formals and locals, sym the globals what's been folded so far counts on,
+ * and changed whether anything has been. depth is how many inlined bodies
+ * deep it is, grown how many cells inlining has added, and macros how many
+ * calls to macros have been expanded in it. calls are the globals it calls
+ * that would be expanded if they were macros.
+ */
+struct lfolding {
+	lenv_t *env;
+	struct lscope *scope;
+	lsym_t **sym;
+	int count;
+	int cap;
+	int changed;
+	int depth;
+	int grown;
+	int macros;
+	lsym_t **calls;
+	int ncalls;
+	int calls_cap;
+};
+
+#define LINLINE_CELLS 24  /* biggest body that gets inlined */
+#define LINLINE_ARGS  8
+#define LINLINE_DEPTH 4   /* inlined into what was itself inlined, at most */
+#define LINLINE_GROWN 256 /* cells inlining can add to any one body */
+
+/*
+ * A call to the lambda l being inlined, with its arguments in call from 1
+ * on. Going through the body in the order it's run, uses counts the times
+ * each formal turns up, called says whether any call has finished yet, and
+ * next is the first formal that might not have been used.
+ */
+struct linline {
+	struct lfolding *f;
+	llambda_t *l;
+	lsym_t *self;
+	lval_t *call;
+	int uses[LINLINE_ARGS];
+	int called;
+	int next;
+	int ok;
+};
+
+#define LMACRO_MAX 256 /* calls to macros expanded in any one body or form, or one in another as they run */
+
+/*
+ * A call to the macro with formals being expanded, with the forms it was
+ * given in call from 1 on. The names its template binds, with '\' or '=',
+ * are in binds, and the fresh ones they're renamed to in fresh.
+ */
+struct lexpand {
+	lval_t *formals;
+	lval_t *call;
+	lval_t *binds;
+	lval_t *fresh;
+};
+
+/* remembers the leaf of the last lval_at() so walking a tree is cheap */
+struct lcursor {
+	lref_t *cell;
+	int lo;
+	int hi;
+};
+
+/*
+ * Where a symbol left to be looked up by name was found last time: the frame
+ * depth up, or -1 if never, and its slot there or -1 for the globals. Unless
+ * that's the innermost frame, a new binding on the way there could hide it,
+ * so it's only good while version matches the symbol's, which def and = bump
+ * whenever they add a binding for it.
+ */
+struct lcache {
+	unsigned version;
+	int depth;
+	int slot;   /* or the next unused site, once it's on the free list */
+	int refs;   /* symbols pointing at it; copies of one share its site */
+};
+
+#define LPOOL_BLOCK 65536
+
+/*
+ * lvals only come in two sizes, so each size gets a pool which carves them out
+ * of big blocks and keeps a free list of the ones given back; malloc would
+ * round a 16 byte atom up to 32. Build with -DNO_LPOOL to go through malloc
+ * anyway, so ASan and valgrind can keep track of every lval.
+ */
+struct lpool {
+	size_t size;
+	void *free;
+	char *next;
+	char *end;
+	void *blocks;
+};
+
+static struct lpool lpools[] = {
+	{ LVAL_CORE, NULL, NULL, NULL, NULL },
+	{ sizeof(lval_t), NULL, NULL, NULL, NULL },
+};
+
+#ifdef LVAL_HANDLES
+#ifdef NO_LPOOL
+#error "LVAL_HANDLES needs the lval pools, drop NO_LPOOL"
+#endif
+
+/* enough for every lval a handle can reach, reserved up front so it never moves */
+#ifndef LHEAP_SIZE
+#define LHEAP_SIZE ((size_t)1 << (32 + LREF_SHIFT))
+#endif
+
+char *lheap;
+static size_t lheap_used;
+#endif
+
+/*
+ * running totals of the memory behind lvals, for lstats_print(), of how
+ * many lvals were made and how many argument lists were lent instead, and of
+ * the calls to macros expanded ahead of time or only once they were run
+ */
+static struct {
+	long cells;
+	long peak_cells;
+	long bytes;
+	long peak_bytes;
+	long made;
+	long lent;
+	long expanded;
+	long expanded_late;
+} lstats;
+
+#define LLENT_MAX 1024
+
+/*
+ * Argument lists lent to builtins. Nothing keeps hold of them past the call,
+ * so they're given back in the order they were lent, and the lists nested
+ * calls lend sit on top of those of the calls they're in. Past LLENT_MAX
+ * deep calls just get lists of their own.
+ */
+static struct {
+	lval_t v[LLENT_MAX];
+	int count;
+} llent;
+
+/*
+ * Caches for the symbols in lambda bodies, indexed by the symbol's count.
+ * Copies of a body share them, so they outlive any one call, and they're only
+ * given back to be handed out again once the last symbol using one is freed.
+ */
+static struct {
+	int count;
+	int cap;
+	int live;
+	int free;   /* first unused site, plus one, or 0 if there are none */
+	long hits;
+	long misses;
+	struct lcache *site;
+} lcaches;
+
+/*
+ * Frames with room for LENV_FLAT bindings that are done with, linked through
+ * par, for lenv_call_frame() to hand out again.
+ */
+static lenv_t *lframes;
+
+/* every symbol there is, hashed on name; see lsym_intern() */
+static struct {
+	int count;
+	int cap;
+	lsym_t **sym;
+} lsyms;
+
+/*
+ * The globals of the environment whatever's running was handed to, by
+ * lval_run() or one of the others an embedder calls, as bodies name globals
+ * by symbol alone. See lroot_enter().
+ */
+static lenv_t *lroot;
+
+static void lstats_add(long bytes);
 static int meowlisp_parse(mpc_result_t *r, const char *input);
+static char *lfile_read(const char *path);
 static lval_t *lval_read_tag(mpc_ast_t *t);
-static lval_t *lval_num(long num);
+static struct lpool *lval_pool(int type);
+static lval_t *lval_new(int type);
+static void *lpool_alloc(struct lpool *p);
+static void lpool_free(struct lpool *p, void *x);
+#ifdef LVAL_HANDLES
+static char *lheap_block(void);
+#endif
 static lval_t *lval_err(char *fmt, ...)
 	__attribute__ ((format (printf, 1, 2)));
 static lval_t *lval_sym(char *m);
 static lval_t *lval_sexpr(void);
 static lval_t *lval_qexpr(void);
+static lval_t *lval_args(lval_t *f);
 static lval_t *lval_fun(lbuiltin_t func);
 static lval_t *lval_lambda(lval_t *formals, lval_t *body);
 static lval_t *lval_add(lval_t *v, lval_t *x);
+static void lval_reserve(lval_t *v, int n);
+static lval_t *lval_fill(lval_t *v, lstore_t *s);
+static void lval_spill(lval_t *v, int cap);
 static lval_t *lval_read_num(mpc_ast_t *t);
 static lval_t *lval_copy(lval_t *v);
-static lval_t *lval_call(lenv_t *e, lval_t *f, lval_t *a);
+static lval_t *lval_copy_one(lval_t *v);
+static int lval_nests(lval_t *v);
+static void lval_free(lval_t *v);
+static void lval_drop(lval_t *v);
+static void lenv_add_fun(lenv_t *e, char *name, lbuiltin_t func, int flags);
+static lval_t *lval_partial(lval_t *f, lval_t *a);
+static lval_t *lval_lambda_of(lval_t *f);
+static lval_t *lval_partial_args(lval_t *f, lval_t *x);
+static void lenv_bind(lenv_t *e, lval_t *k, lval_t *v);
 static int lval_eq(lval_t *l, lval_t *r);
+struct leq;
+static int lval_eq_one(struct leq *q, lval_t *l, lval_t *r);
 static lval_t *lenv_get(lenv_t *e, lval_t *v);
+static lval_t *lenv_peek(lenv_t *e, lval_t *v);
 static void lenv_put(lenv_t *e, lval_t *k, lval_t *v);
+static int lenv_slots(lenv_t *e);
+static int lenv_find(lenv_t *e, lsym_t *sym);
+static void lenv_insert(lenv_t *e, lsym_t *sym, lref_t v);
+static void lenv_grow(lenv_t *e);
+static lenv_t *lroot_enter(lenv_t *e);
+static lval_t *lglobal(lsym_t *sym);
+static lref_t *lenv_cell(lenv_t *e, lsym_t *sym);
+static unsigned lsym_hash(const char *name);
 static void lenv_def(lenv_t *e, lval_t *k, lval_t *v);
-static lenv_t *lenv_copy(lenv_t *e);
-static void lval_expr_print(lval_t *v, char open, char close);
+static lenv_t *lenv_root(lenv_t *e);
+static lenv_t *lenv_frame(void);
+static lenv_t *lenv_call_frame(void);
+struct lprint;
+static void lval_expr_print(struct lprint *p, const lval_t *v, const char *open, const char *close);
 static void lval_print(const lval_t *v);
+static void lval_print_one(struct lprint *p, const lval_t *v);
 static lval_t *lval_pop(lval_t *v, int i);
+static lval_t *lval_slice(lval_t *v, int start, int count);
+static lval_t *lval_at(lval_t *v, int i, struct lcursor *c);
+static void lval_unshare(lval_t *v);
+static void lval_flatten(lval_t *v);
+static lval_t *lval_untree(lval_t *v);
+static lstore_t *lstore_new(int cap);
+static lstore_t *lstore_push(lstore_t *s, lval_t *x);
+static void lstore_release(lstore_t *s);
+static lnode_t *lnode_leaf(lstore_t *s, lref_t *cell, int count);
+static lnode_t *lnode_branch(int height);
+static int lnode_len(lnode_t *n);
+static void lnode_push(lnode_t *n, lnode_t *c);
+static void lnode_release(lnode_t *n);
+static lnode_t *lnode_from(lval_t *v);
+static lnode_t *lnode_leaf_at(lnode_t *n, int i, int *first);
+static lnode_t *lnode_slice(lnode_t *n, int start, int count);
+static lnode_t *lnode_concat(lnode_t *l, lnode_t *r);
+static lnode_t *lnode_trim(lnode_t *n);
+static lnode_t *lnode_concat_sub(lnode_t *l, lnode_t *r, int top);
+static lnode_t *lnode_rebalance(lnode_t *l, lnode_t *c, lnode_t *r, int top);
+static int lnode_plan(lnode_t **all, int n, int *plan);
+static lnode_t *lnode_gather(lnode_t **all, int *j, int *off, int count);
 /* static lval_t *builtin(lval_t *a, char *func); */
-static lval_t *builtin_op(lenv_t *e, lval_t *a, char *op);
+static int larith_add(long x, long y, long *r);
+static int larith_sub(long x, long y, long *r);
+static int larith_mul(long x, long y, long *r);
+static int larith_div(long x, long y, long *r);
+static int larith_mod(long x, long y, long *r);
+static lval_t *larith_err(lval_t *a, int i, const char *why);
 static lval_t *builtin_head(lenv_t *e, lval_t *v);
 static lval_t *builtin_tail(lenv_t *e, lval_t *v);
 static lval_t *builtin_list(lenv_t *e, lval_t *v);
@@ -34,12 +304,65 @@ static lval_t *builtin_sub(lenv_t *e,lval_t *v);
 static lval_t *builtin_mul(lenv_t *e,lval_t *v);
 static lval_t *builtin_div(lenv_t *e,lval_t *v);
 static lval_t *builtin_mod(lenv_t *e,lval_t *v);
+static lval_t *builtin_add_checked(lenv_t *e, lval_t *a);
+static lval_t *builtin_sub_checked(lenv_t *e, lval_t *a);
+static lval_t *builtin_mul_checked(lenv_t *e, lval_t *a);
+static lval_t *builtin_div_checked(lenv_t *e, lval_t *a);
 static lval_t *builtin_join(lenv_t *e, lval_t *a);
 static lval_t *builtin_def(lenv_t *e, lval_t *a);
 static lval_t *builtin_put(lenv_t *e, lval_t *a);
 static lval_t *builtin_lambda(lenv_t *e, lval_t *a);
-static lval_t *builtin_ord(lenv_t *e, lval_t *a, char *op);
-static lval_t *builtin_eqneq(lenv_t *e, lval_t *a, char *op);
+static lval_t *builtin_defmacro(lenv_t *e, lval_t *a);
+static void lval_resolve(lval_t *v, struct lscope *s, struct lcapture *c);
+static void lval_quoted(lval_t *v, struct lscope *s, struct lcapture *c);
+static void lval_bind(lval_t *v, struct lscope *s, struct lcapture *c);
+static void lval_capture(lval_t *v, int level, struct lcapture *c);
+static void lval_bound(lval_t *v, int depth, int slot);
+static void lval_cache(lval_t *v);
+static void lval_uncache(lval_t *v);
+static int lscope_slot(struct lscope *s, lsym_t *sym);
+static lval_t *lval_locals(lval_t *v, lval_t *locals);
+static int lval_is_lambda(lval_t *v);
+static int lval_is_macro(lval_t *f);
+static int lval_is_if(lval_t *v);
+static lfold_t *lfold_new(lenv_t *e, llambda_t *l, struct lscope *s, lfold_t *was);
+static void lfold_del(lfold_t *x);
+static void lfold_undo(lenv_t *e, lsym_t *sym);
+static int lfold_counts(lfold_t *x, lsym_t *sym);
+static int lfold_calls(lfold_t *x, lsym_t *sym);
+static lval_t *lfold_body(struct lfolding *f, lval_t *v);
+static lval_t *lfold_cells(struct lfolding *f, lval_t *v);
+static lval_t *lfold_expr(struct lfolding *f, lval_t *v);
+static lval_t *lfold_partial(struct lfolding *f, lval_t *v, lbuiltin_t op);
+static lval_t *lfold_global(struct lfolding *f, lval_t *k);
+static lsym_t *lfold_name(struct lfolding *f, lval_t *k);
+static void lfold_watch(struct lfolding *f, lval_t *k);
+static lbuiltin_t lfold_builtin(struct lfolding *f, lval_t *k);
+static lval_t *lfold_inline(struct lfolding *f, lval_t *v);
+static int linline_size(lval_t *v, int max);
+static int linline_plain(lval_t *v);
+static lval_t *linline_form(struct linline *in, lval_t *v, int how);
+static lval_t *linline_sym(struct linline *in, lval_t *v, int how);
+static int lfold_pure(lbuiltin_t op);
+static void lfold_assume(struct lfolding *f, lsym_t *sym);
+static lval_t *lfold_macro(struct lfolding *f, lval_t *v);
+static lval_t *lmacro_global(lval_t *k);
+static int lmacro_fits(lval_t *m, lval_t *v);
+static lval_t *lmacro_expand(lval_t *m, lval_t *v, int *gen);
+static void lmacro_binds(struct lexpand *x, lval_t *v);
+static void lmacro_bind(struct lexpand *x, lval_t *k);
+static lval_t *lmacro_fresh(llambda_t *l, lval_t *binds, lval_t *v, int *gen);
+static int lmacro_uses(lval_t *v, lval_t *names);
+static void lmacro_enter(llambda_t *l, int gen);
+static void lmacro_leave(void);
+static lval_t *lmacro_named(lval_t *k, lval_t *f);
+static lval_t *lmacro_form(struct lexpand *x, lval_t *v, int level, int code);
+static void lmacro_shift(lval_t *v, int by, int level);
+static lval_t *lmacro_top(lval_t *v, int *n);
+static int lmacro_find(lval_t *l, lsym_t *sym);
+static lval_t *lmacro_eval(lenv_t *e, lval_t *m, lval_t *v, int tail);
+static lval_t *llambda_body(llambda_t *l);
+static void llambda_compile(llambda_t *l, int flags);
 static lval_t *builtin_eq(lenv_t *e, lval_t *a);
 static lval_t *builtin_ne(lenv_t *e, lval_t *a);
 static lval_t *builtin_gt(lenv_t *e, lval_t *a);
@@ -50,7 +373,65 @@ static lval_t *builtin_if(lenv_t *e, lval_t *a);
 static lval_t *builtin_var(lenv_t *e, lval_t *a, char *func);
 static lval_t *lval_join(lval_t *x, lval_t *y);
 static lval_t *lval_take(lval_t *v, int i);
+static lval_t *lval_eval_one(lenv_t *e, lval_t *v);
 static lval_t *lval_eval_sexpr(lenv_t *e, lval_t *v);
+static lval_t *lval_eval_tree(lenv_t *e, lval_t *v);
+static lval_t *lval_eval_cells(lenv_t *e, lval_t *v, int tail);
+static lval_t *lval_apply(lenv_t *e, lval_t *v);
+static lval_t *lval_apply_tail(lenv_t *e, lval_t *v);
+static int lval_tailcall(lval_t *a);
+static lval_t *lval_invoke(lenv_t *e, lval_t *f, lval_t *a, int tail);
+static void ldepth_init(void);
+static int ldepth_room(size_t n);
+static lval_t *ldepth_stack(void);
+static lval_t *ldepth_enter(void);
+static lval_t *ltail_run(lenv_t *e);
+static lcode_t *lcode_new(void);
+static void lcode_del(lcode_t *c);
+static lcode_t *lcode_body(lval_t *body);
+static int lcode_emit(lcode_t *c, int x);
+static int lcode_const(lcode_t *c, lval_t *v);
+static void lcode_push(lcode_t *c, int n);
+static void lcode_expr(lcode_t *c, lval_t *v, int tail);
+static void lcode_sexpr(lcode_t *c, lval_t *v, int tail);
+static void lcode_if(lcode_t *c, lval_t *v, int tail);
+static void lcode_arg(lcode_t *c, lval_t *v, int *arg);
+static lenv_t *lenv_enter(lenv_t *e, llambda_t *l);
+static void lenv_take(lenv_t *frame, lenv_t *e);
+static lval_t *lvm_apply(lenv_t *e, lval_t *f, lval_t *a);
+static lval_t *lvm_list(lval_t *a, int n);
+static int lvm_direct(lval_t *f, int n);
+static void lvm_push(lcode_t *code, lenv_t *env, lval_t *fun);
+static lenv_t *lvm_bind(lenv_t *e, lval_t *f, int n);
+static lval_t *lvm_run(lenv_t *e, lcode_t *code, int tail);
+static void lvm_reserve(int n);
+static lval_t *lvm_arg(lenv_t *e, lcode_t *c, const int *arg, int *own);
+static int lvm_arith(int op, long a, long b, long *r);
+static lbuiltin_t lenv_builtin(lenv_t *e, lval_t *k);
+static lexpr_t *lexpr_new(lval_t *(*run)(lexpr_t *, lenv_t *), lval_t *val, int count);
+static void lexpr_del(lexpr_t *x);
+static lexpr_t *lexpr_compile(lval_t *v);
+static lexpr_t *lexpr_cells(lval_t *v, int tail);
+static lexpr_t *lexpr_form(lval_t *v, int tail);
+static lval_t *lexpr_const(lexpr_t *x, lenv_t *e);
+static lval_t *lexpr_local(lexpr_t *x, lenv_t *e);
+static lval_t *lexpr_global(lexpr_t *x, lenv_t *e);
+static lval_t *lexpr_lookup(lexpr_t *x, lenv_t *e);
+static lval_t *lexpr_if(lexpr_t *x, lenv_t *e);
+static lval_t *lexpr_call(lexpr_t *x, lenv_t *e);
+static lval_t *lexpr_call_global(lexpr_t *x, lenv_t *e);
+static lval_t *lexpr_tailcall(lexpr_t *x, lenv_t *e);
+static lval_t *lexpr_apply(lenv_t *e, lval_t *f, lexpr_t **arg, int n);
+static lval_t *lexpr_num(lexpr_t *x, lenv_t *e);
+static lnum_t *lnum_cells(lval_t *v, lexpr_t *x);
+static int lnum_can(lexpr_t *x);
+static lnum_t *lnum_take(lexpr_t **x);
+static void lnum_del(lnum_t *n);
+static int lnum_run(lnum_t *n, lenv_t *e, long *r);
+static int ljit_try(lenv_t *e, llambda_t *l, lval_t **v, int n, long *r);
+static void ljit_stats(void);
+static void ljit_free(ljit_t *j);
+static lval_t *lval_eval_top(lenv_t *e, lval_t *v);
 static char *ltype_name(int t);
 
 #define LASSERT(args, cond, fmt, ...)                       \
@@ -82,7 +463,72 @@ lval_t *lval_read(const char *input)
 	return v;
 }
 
+/*
+ * Evaluate the expressions in a file one after the other, stopping at the
+ * first error. Returns the value of the last one.
+ */
+lval_t *lval_load(lenv_t *e, const char *path)
+{
+	char *input = lfile_read(path);
+	if (input == NULL) {
+		return lval_err("Could not load file '%s'", path);
+	}
+
+	lval_t *v = lval_run(e, input);
+	free(input);
+
+	return v;
+}
+
+/* the same for expressions in a string */
+lval_t *lval_run(lenv_t *e, const char *input)
+{
+	lval_t *exprs = lval_read(input);
+	if (exprs->type == LVAL_ERR) {
+		return exprs;
+	}
+
+	lenv_t *was = lroot_enter(e);
+	lval_t *x = lval_sexpr();
+	while (exprs->count && x->type != LVAL_ERR) {
+		lval_del(x);
+		x = lval_eval_top(e, lval_pop(exprs, 0));
+	}
+	lval_del(exprs);
+	lroot = was;
+
+	return x;
+}
+
+/* are the cells of a just n numbers? if so they're copied into x */
+int lval_nums(lval_t *a, long *x, int n)
+{
+	if (a->count != n) {
+		return 0;
+	}
+
+	struct lcursor c = { NULL, 0, 0 };
+	for (int i = 0; i < n; i++) {
+		lval_t *v = lval_at(a, i, &c);
+		if (v->type != LVAL_NUM) {
+			return 0;
+		}
+		x[i] = v->num;
+	}
+
+	return 1;
+}
+
 lval_t *lval_eval(lenv_t *e, lval_t *v)
+{
+	lenv_t *was = lroot_enter(e);
+	lval_t *x = lval_eval_one(e, v);
+	lroot = was;
+
+	return x;
+}
+
+static lval_t *lval_eval_one(lenv_t *e, lval_t *v)
 {
 	if (v->type == LVAL_SYM) {
 		lval_t *x = lenv_get(e, v);
@@ -102,7 +548,42 @@ void lval_println(const lval_t *v)
 	putchar('\n');
 }
 
+/*
+ * Anything v holds that needs freeing as well is queued up and freed by the
+ * outermost lval_del() in a loop, so there's no limit to how deeply nested
+ * what's freed can be.
+ */
+static struct {
+	lval_t **v;
+	int count;
+	int cap;
+	int busy;
+} ldel;
+
 void lval_del(lval_t *v)
+{
+	if (ldel.busy) {
+		if (ldel.count == ldel.cap) {
+			ldel.cap = ldel.cap ? 2 * ldel.cap : 64;
+			ldel.v = realloc(ldel.v, sizeof(*ldel.v) * ldel.cap);
+		}
+		ldel.v[ldel.count++] = v;
+		return;
+	}
+
+	ldel.busy = 1;
+	for (;;) {
+		lval_free(v);
+		if (!ldel.count) {
+			break;
+		}
+		v = ldel.v[--ldel.count];
+	}
+	ldel.busy = 0;
+}
+
+/* free v itself, leaving what it holds to lval_del() */
+static void lval_free(lval_t *v)
 {
 	switch (v->type) {
 		case LVAL_NUM:
@@ -111,31 +592,86 @@ void lval_del(lval_t *v)
 		free(v->err);
 		break;
 		case LVAL_SYM:
-		free(v->sym);
+		lval_uncache(v);
 		break;
 		case LVAL_SEXPR:
 		case LVAL_QEXPR:
-		for (int i = 0; i < v->count; i++) {
-			lval_del(v->cell[i]);
+		if (v->flags & LVAL_INLINE) {
+			for (int i = 0; i < v->count; i++) {
+				/* numbers and most symbols hold nothing, so needn't wait */
+				lval_t *x = LPTR(v->small[i]);
+				if (x->type == LVAL_NUM || (x->type == LVAL_SYM && !(x->flags & LVAL_CACHED))) {
+					lval_drop(x);
+				} else {
+					lval_del(x);
+				}
+			}
+		} else if (v->tree) {
+			lnode_release(v->tree);
+		} else {
+			lstore_release(v->store);
 		}
-		free(v->cell);
 		break;
 		case LVAL_FUN:
-		if (!v->builtin) {
-			lenv_del(v->env);
-			lval_del(v->formals);
-			lval_del(v->body);
+		if ((v->flags & LVAL_PARTIAL) && --v->partial->refs == 0) {
+			lval_del(v->partial->fun);
+			for (int i = 0; i < v->partial->count; i++) {
+				lval_del(LPTR(v->partial->arg[i]));
+			}
+			lstats_add(-(long)(sizeof(*v->partial) + sizeof(lref_t) * v->partial->count));
+			free(v->partial);
+		} else if (!(v->flags & (LVAL_BUILTIN | LVAL_PARTIAL)) && --v->lambda->refs == 0) {
+			lenv_del(v->lambda->env);
+			lval_del(v->lambda->formals);
+			lval_del(v->lambda->body);
+			if (v->lambda->code) {
+				lcode_del(v->lambda->code);
+			}
+			if (v->lambda->expr) {
+				lexpr_del(v->lambda->expr);
+			}
+			if (v->lambda->fold) {
+				lfold_del(v->lambda->fold);
+			}
+			if (v->lambda->fresh) {
+				lval_del(v->lambda->fresh);
+			}
+			/* nothing can be running its native code, so that can go too */
+			ljit_free(v->lambda->jit);
+			lstats_add(-(long)sizeof(*v->lambda));
+			free(v->lambda);
 		}
 		break;
 	}
 
-	free(v);
+	lval_drop(v);
+}
+
+/* give v back to its pool, unless it's a list that was lent off llent */
+static void lval_drop(lval_t *v)
+{
+	if ((v->flags & LVAL_LENT) && (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR)) {
+		return;
+	}
+
+	struct lpool *p = lval_pool(v->type);
+	lstats.cells--;
+	lstats_add(-(long)p->size);
+	lpool_free(p, v);
 }
 
 void lenv_add_builtin(lenv_t *e, char *name, lbuiltin_t func)
+{
+	lenv_t *was = lroot_enter(e);
+	lenv_add_fun(e, name, func, 0);
+	lroot = was;
+}
+
+static void lenv_add_fun(lenv_t *e, char *name, lbuiltin_t func, int flags)
 {
 	lval_t *k = lval_sym(name);
 	lval_t *f = lval_fun(func);
+	f->flags |= flags;
 
 	lenv_put(e, k, f);
 	lval_del(k);
@@ -144,57 +680,98 @@ void lenv_add_builtin(lenv_t *e, char *name, lbuiltin_t func)
 
 void lenv_add_builtins(lenv_t *e)
 {
+	lenv_t *was = lroot_enter(e);
+
+	/*
+	 * None of these but list hang on to the list of arguments they're
+	 * given, they just take cells out of it and free the rest.
+	 */
+
 	/* List Functions */
-	lenv_add_builtin(e, "list", builtin_list);
-	lenv_add_builtin(e, "head", builtin_head);
-	lenv_add_builtin(e, "tail", builtin_tail);
-	lenv_add_builtin(e, "eval", builtin_eval);
-	lenv_add_builtin(e, "join", builtin_join);
+	lenv_add_fun(e, "list", builtin_list, 0);
+	lenv_add_fun(e, "head", builtin_head, LVAL_BORROWS);
+	lenv_add_fun(e, "tail", builtin_tail, LVAL_BORROWS);
+	lenv_add_fun(e, "eval", builtin_eval, LVAL_BORROWS);
+	lenv_add_fun(e, "join", builtin_join, LVAL_BORROWS);
 
 	/* Mathematical Functions */
-	lenv_add_builtin(e, "+", builtin_add);
-	lenv_add_builtin(e, "-", builtin_sub);
-	lenv_add_builtin(e, "*", builtin_mul);
-	lenv_add_builtin(e, "/", builtin_div);
-	lenv_add_builtin(e, "%", builtin_mod);
+	lenv_add_fun(e, "+", builtin_add, LVAL_BORROWS);
+	lenv_add_fun(e, "-", builtin_sub, LVAL_BORROWS);
+	lenv_add_fun(e, "*", builtin_mul, LVAL_BORROWS);
+	lenv_add_fun(e, "/", builtin_div, LVAL_BORROWS);
+	lenv_add_fun(e, "%", builtin_mod, LVAL_BORROWS);
+	lenv_add_fun(e, "+!", builtin_add_checked, LVAL_BORROWS);
+	lenv_add_fun(e, "-!", builtin_sub_checked, LVAL_BORROWS);
+	lenv_add_fun(e, "*!", builtin_mul_checked, LVAL_BORROWS);
+	lenv_add_fun(e, "/!", builtin_div_checked, LVAL_BORROWS);
 
 	/* Variable Definitions */
-	lenv_add_builtin(e, "def", builtin_def);
-	lenv_add_builtin(e, "=", builtin_put);
+	lenv_add_fun(e, "def", builtin_def, LVAL_BORROWS);
+	lenv_add_fun(e, "=", builtin_put, LVAL_BORROWS);
 
 	/* Lambdas */
-	lenv_add_builtin(e, "\\", builtin_lambda);
+	lenv_add_fun(e, "\\", builtin_lambda, LVAL_BORROWS);
+	lenv_add_fun(e, "defmacro", builtin_defmacro, LVAL_BORROWS);
 
 	/* Comparison */
-	lenv_add_builtin(e, "==", builtin_eq);
-	lenv_add_builtin(e, "!=", builtin_ne);
-	lenv_add_builtin(e, ">",  builtin_gt);
-	lenv_add_builtin(e, "<",  builtin_lt);
-	lenv_add_builtin(e, ">=", builtin_ge);
-	lenv_add_builtin(e, "<=", builtin_le);
+	lenv_add_fun(e, "==", builtin_eq, LVAL_BORROWS);
+	lenv_add_fun(e, "!=", builtin_ne, LVAL_BORROWS);
+	lenv_add_fun(e, ">", builtin_gt, LVAL_BORROWS);
+	lenv_add_fun(e, "<", builtin_lt, LVAL_BORROWS);
+	lenv_add_fun(e, ">=", builtin_ge, LVAL_BORROWS);
+	lenv_add_fun(e, "<=", builtin_le, LVAL_BORROWS);
 
 	/* Conditional */
-	lenv_add_builtin(e, "if", builtin_if);
+	lenv_add_fun(e, "if", builtin_if, LVAL_BORROWS);
+
+	lroot = was;
 }
 
+/*
+ * The globals, each set with cells of its own, so separate interpreters can
+ * be made and freed independently.
+ */
 lenv_t *lenv_new(void)
 {
-	lenv_t *e = malloc(sizeof(*e));
-	e->par = NULL;
-	e->count = 0;
-	e->syms = NULL;
-	e->vals = NULL;
+	ldepth_init();
+
+	lenv_t *e = lenv_frame();
+	e->flags |= LENV_GLOBAL;
 
 	return e;
 }
-
 void lenv_del(lenv_t *e)
 {
-	for (int i = 0; i < e->count; i++) {
-		/* free the strings */
-		free(e->syms[i]);
-		/* delete the values */
-		lval_del(e->vals[i]);
+	if (--e->refs > 0) {
+		return;
+	}
+
+	if (e->flags & (LENV_CLOSURE | LENV_HELD)) {
+		lenv_del(e->par);
+	}
+
+	if (e->flags & LENV_GLOBAL) {
+		for (int i = 0; i < e->nglobal; i++) {
+			if (e->global[i] != LREF_NULL) {
+				lval_del(LPTR(e->global[i]));
+			}
+		}
+		free(e->global);
+		if (lroot == e) {
+			lroot = NULL;
+		}
+	}
+
+	for (int i = 0; i < lenv_slots(e); i++) {
+		if (e->syms[i]) {
+			lval_del(LPTR(e->vals[i]));
+		}
+	}
+
+	if (e->cap == LENV_FLAT && !(e->flags & LENV_GLOBAL)) {
+		e->par = lframes;
+		lframes = e;
+		return;
 	}
 
 	free(e->syms);
@@ -202,9 +779,45 @@ void lenv_del(lenv_t *e)
 
 	free(e);
 }
+void lstats_print(void)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+
+#ifdef __APPLE__
+	long rss = ru.ru_maxrss / 1024;
+#else
+	long rss = ru.ru_maxrss;
+#endif
+
+	fflush(stdout);
+	fprintf(stderr, "lval cells: %li live, %li peak (%zu bytes for atoms, %zu for lists)\n",
+		lstats.cells, lstats.peak_cells, (size_t)LVAL_CORE, sizeof(lval_t));
+	fprintf(stderr, "lval bytes: %li live, %li peak\n", lstats.bytes, lstats.peak_bytes);
+	fprintf(stderr, "lvals made: %li, and %li argument lists lent instead (%.1f%% fewer)\n",
+		lstats.made, lstats.lent,
+		lstats.lent ? 100.0 * lstats.lent / (lstats.made + lstats.lent) : 0.0);
+	fprintf(stderr, "symbol caches: %i sites, %li hits, %li misses\n",
+		lcaches.live, lcaches.hits, lcaches.misses);
+	fprintf(stderr, "macro calls: %li expanded ahead of time, %li as they ran\n",
+		lstats.expanded, lstats.expanded_late);
+	ljit_stats();
+	fprintf(stderr, "max rss: %li KiB\n", rss);
+}
 
 /* static functions */
 
+static void lstats_add(long bytes)
+{
+	lstats.bytes += bytes;
+	if (lstats.bytes > lstats.peak_bytes) {
+		lstats.peak_bytes = lstats.bytes;
+	}
+	if (lstats.cells > lstats.peak_cells) {
+		lstats.peak_cells = lstats.cells;
+	}
+}
+
 static int meowlisp_parse(mpc_result_t *r, const char *input)
 {
 	/* Create some parsers, yo! */
@@ -231,6 +844,28 @@ static int meowlisp_parse(mpc_result_t *r, const char *input)
 	return ret;
 }
 
+/* the whole of a file, or NULL if it can't be read */
+static char *lfile_read(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		return NULL;
+	}
+
+	char *input = NULL;
+	size_t len = 0;
+	size_t n;
+	do {
+		input = realloc(input, len + BUFSIZ + 1);
+		n = fread(input + len, 1, BUFSIZ, f);
+		len += n;
+	} while (n == BUFSIZ);
+	input[len] = '\0';
+	fclose(f);
+
+	return input;
+}
+
 static lval_t *lval_read_tag(mpc_ast_t *t)
 {
 	if (strstr(t->tag, "number")) {
@@ -248,6 +883,7 @@ static lval_t *lval_read_tag(mpc_ast_t *t)
 		x = lval_qexpr();
 	}
 
+	lstore_t *s = NULL;
 	for (int i = 0; i < t->children_num; i++) {
 		if (strcmp(t->children[i]->contents, "(") == 0 ||
 		    strcmp(t->children[i]->contents, ")") == 0 ||
@@ -257,16 +893,108 @@ static lval_t *lval_read_tag(mpc_ast_t *t)
 			continue;
 		}
 
-		x = lval_add(x, lval_read_tag(t->children[i]));
+		s = lstore_push(s, lval_read_tag(t->children[i]));
+	}
+
+	return lval_fill(x, s);
+}
+
+/* just the core for atoms, the whole struct for lists */
+static struct lpool *lval_pool(int type)
+{
+	if (type == LVAL_SEXPR || type == LVAL_QEXPR) {
+		return &lpools[1];
+	}
+
+	return &lpools[0];
+}
+
+static lval_t *lval_new(int type)
+{
+	struct lpool *p = lval_pool(type);
+	lval_t *v = lpool_alloc(p);
+	v->type = type;
+	v->flags = 0;
+
+	lstats.cells++;
+	lstats.made++;
+	lstats_add(p->size);
+
+	return v;
+}
+
+static void *lpool_alloc(struct lpool *p)
+{
+#ifdef NO_LPOOL
+	return malloc(p->size);
+#else
+	if (p->free) {
+		void *x = p->free;
+		p->free = *(void **)x;
+		return x;
+	}
+
+	if (p->end - p->next < (ptrdiff_t)p->size) {
+		/* the first slot of each block links it to the one before */
+#ifdef LVAL_HANDLES
+		char *b = lheap_block();
+#else
+		char *b = malloc(LPOOL_BLOCK);
+#endif
+		*(void **)b = p->blocks;
+		p->blocks = b;
+		p->next = b + p->size;
+		p->end = b + LPOOL_BLOCK;
 	}
 
+	void *x = p->next;
+	p->next += p->size;
+
 	return x;
+#endif
+}
+
+static void lpool_free(struct lpool *p, void *x)
+{
+#ifdef NO_LPOOL
+	free(x);
+#else
+	*(void **)x = p->free;
+	p->free = x;
+#endif
+}
+
+#ifdef LVAL_HANDLES
+/*
+ * hand out the next LPOOL_BLOCK bytes of lheap. The very first block starts
+ * with a link slot, which is what keeps handle 0 free to mean NULL.
+ */
+static char *lheap_block(void)
+{
+	if (!lheap) {
+		lheap = mmap(NULL, LHEAP_SIZE, PROT_READ | PROT_WRITE,
+			     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (lheap == MAP_FAILED) {
+			perror("mmap");
+			abort();
+		}
+	}
+
+	if (LHEAP_SIZE - lheap_used < LPOOL_BLOCK) {
+		fputs("out of room for lvals\n", stderr);
+		abort();
+	}
+
+	char *b = lheap + lheap_used;
+	lheap_used += LPOOL_BLOCK;
+
+	return b;
 }
+#endif
 
-static lval_t *lval_num(long num)
+lval_t *lval_num(long num)
 {
-	lval_t *v = malloc(sizeof(*v));
-	v->type   = LVAL_NUM;
+	lval_t *v = lval_new(LVAL_NUM);
 	v->num = num;
 
 	return v;
@@ -274,8 +1002,7 @@ static lval_t *lval_num(long num)
 
 static lval_t *lval_err(char *fmt, ...)
 {
-	lval_t *v = malloc(sizeof(*v));
-	v->type  = LVAL_ERR;
+	lval_t *v = lval_new(LVAL_ERR);
 
 	va_list va;
 	va_start(va, fmt);
@@ -287,38 +1014,55 @@ static lval_t *lval_err(char *fmt, ...)
 
 static lval_t *lval_sym(char *m)
 {
-	lval_t *v = malloc(sizeof(*v));
-	v->type = LVAL_SYM;
-	v->sym = malloc(strlen(m) + 1);
-	strcpy(v->sym, m);
+	lval_t *v = lval_new(LVAL_SYM);
+	v->sym = lsym_intern(m);
 
 	return v;
 }
 
+/* lists start out empty and inline */
 static lval_t *lval_sexpr(void)
 {
-	lval_t *v = malloc(sizeof(*v));
-	v->type = LVAL_SEXPR;
+	lval_t *v = lval_new(LVAL_SEXPR);
+	v->flags |= LVAL_INLINE;
 	v->count = 0;
-	v->cell = NULL;
 
 	return v;
 }
 
 static lval_t *lval_qexpr(void)
 {
-	lval_t *v = malloc(sizeof(*v));
-	v->type = LVAL_QEXPR;
+	lval_t *v = lval_new(LVAL_QEXPR);
+	v->flags |= LVAL_INLINE;
+	v->count = 0;
+
+	return v;
+}
+
+/*
+ * A new list for the arguments to f. Builtins that only borrow them are
+ * lent one off llent instead, which whoever called this gives back once the
+ * call's over by putting llent.count back to what it was.
+ */
+static lval_t *lval_args(lval_t *f)
+{
+	if (f->type != LVAL_FUN || !(f->flags & LVAL_BORROWS) || llent.count == LLENT_MAX) {
+		return lval_sexpr();
+	}
+
+	lval_t *v = &llent.v[llent.count++];
+	v->type = LVAL_SEXPR;
+	v->flags = LVAL_INLINE | LVAL_LENT;
 	v->count = 0;
-	v->cell = NULL;
+	lstats.lent++;
 
 	return v;
 }
 
 static lval_t *lval_fun(lbuiltin_t func)
 {
-	lval_t *v = malloc(sizeof(*v));
-	v->type = LVAL_FUN;
+	lval_t *v = lval_new(LVAL_FUN);
+	v->flags |= LVAL_BUILTIN;
 	v->builtin = func;
 
 	return v;
@@ -326,28 +1070,153 @@ static lval_t *lval_fun(lbuiltin_t func)
 
 static lval_t *lval_lambda(lval_t *formals, lval_t *body)
 {
-	lval_t *v = malloc(sizeof(*v));
-	v->type = LVAL_FUN;
+	lval_t *v = lval_new(LVAL_FUN);
+
+	v->lambda = malloc(sizeof(*v->lambda));
+	lstats_add(sizeof(*v->lambda));
+
+	v->lambda->refs = 1;
+	v->lambda->flags = 0;
+	v->lambda->env = lenv_frame();
+	v->lambda->code = NULL;
+	v->lambda->expr = NULL;
+	v->lambda->calls = 0;
+	v->lambda->jit = NULL;
+	v->lambda->fold = NULL;
+	v->lambda->fresh = NULL;
+
+	v->lambda->formals = formals;
+	v->lambda->body = body;
+
+	/* calls to these have to go the long way round */
+	for (int i = 0; i < formals->count; i++) {
+		if (strcmp(LSYM(LCELL(formals, i)), "&") == 0) {
+			v->lambda->flags |= LLAMBDA_VARARGS;
+		}
+	}
 
-	v->builtin = NULL;
+	return v;
+}
 
-	v->env = lenv_new();
+static lval_t *lval_add(lval_t *v, lval_t *x)
+{
+	lval_reserve(v, v->count + 1);
 
-	v->formals = formals;
-	v->body = body;
+	LREFS(v)[v->count++] = LREF(x);
+	if (!(v->flags & LVAL_INLINE)) {
+		v->store->count++;
+	}
 
 	return v;
 }
 
-static lval_t *lval_add(lval_t *v, lval_t *x)
+/*
+ * Get v ready to have cells added onto the end until it holds n of them: flat,
+ * unshared, its view running up to the end of the store and room to grow.
+ */
+static void lval_reserve(lval_t *v, int n)
+{
+	if (v->flags & LVAL_INLINE) {
+		if (n <= LVAL_SMALL) {
+			return;
+		}
+
+		int cap = 4;
+		while (cap < n) {
+			cap *= 2;
+		}
+		lval_spill(v, cap);
+		return;
+	}
+
+	lval_unshare(v);
+
+	lstore_t *s = v->store;
+	int off = 0;
+
+	if (s) {
+		off = v->cell - s->cell;
+
+		/* anything past the end of our view is ours alone, drop it */
+		for (int i = off + v->count; i < s->count; i++) {
+			if (s->cell[i]) {
+				lval_del(LPTR(s->cell[i]));
+			}
+		}
+		s->count = off + v->count;
+
+		if (off + n <= s->cap) {
+			return;
+		}
+
+		/* same goes for what's before it, so move up before growing */
+		for (int i = 0; i < off; i++) {
+			if (s->cell[i]) {
+				lval_del(LPTR(s->cell[i]));
+			}
+		}
+		memmove(s->cell, v->cell, sizeof(*s->cell) * v->count);
+		s->count = v->count;
+		off = 0;
+	}
+
+	int cap = s ? s->cap : 0;
+	while (cap < n) {
+		cap = cap ? 2 * cap : 4;
+	}
+
+	if (!s) {
+		s = lstore_new(cap);
+	} else if (cap != s->cap) {
+		s = realloc(s, sizeof(*s) + sizeof(*s->cell) * cap);
+		lstats_add(sizeof(*s->cell) * (cap - s->cap));
+		s->cap = cap;
+	}
+
+	v->store = s;
+	v->cell = s->cell + off;
+}
+
+/*
+ * make the empty list v a view of all of s, handing it our reference to s. If
+ * there are few enough cells v just takes them and s goes away.
+ */
+static lval_t *lval_fill(lval_t *v, lstore_t *s)
 {
-	v->count++;
-	v->cell = realloc(v->cell, v->count * sizeof(*v->cell));
-	v->cell[v->count - 1] = x;
+	if (!s) {
+		return v;
+	}
+
+	if (s->count <= LVAL_SMALL) {
+		memcpy(v->small, s->cell, sizeof(*s->cell) * s->count);
+		v->count = s->count;
+		s->count = 0;
+		lstore_release(s);
+		return v;
+	}
+
+	v->flags &= ~LVAL_INLINE;
+	v->store = s;
+	v->cell = s->cell;
+	v->tree = NULL;
+	v->count = s->count;
 
 	return v;
 }
 
+/* move the cells of an inline list out into a store with room for cap */
+static void lval_spill(lval_t *v, int cap)
+{
+	lstore_t *s = lstore_new(cap);
+	memcpy(s->cell, v->small, sizeof(*s->cell) * v->count);
+	s->count = v->count;
+
+	v->flags &= ~LVAL_INLINE;
+	v->store = s;
+	v->cell = s->cell;
+	v->tree = NULL;
+}
+
 static lval_t *lval_read_num(mpc_ast_t *t)
 {
 	long x = strtol(t->contents, NULL, 10);
@@ -355,21 +1224,79 @@ static lval_t *lval_read_num(mpc_ast_t *t)
 	return errno != ERANGE ? lval_num(x) : lval_err("'%s' is an invalid number", t->contents);
 }
 
+/*
+ * Inline lists of atoms are copied cell by cell. One holding a list is moved
+ * out into a store the first time it's copied and shared from then on, as
+ * copying it cell by cell would copy everything nested in it too, which for
+ * something like a cons list built up of pairs makes each copy as slow as the
+ * list is long. Lists lent to a builtin go away with the call, so are still
+ * copied, and as they can be nested however deep, the ones still to fill in
+ * are kept on a stack of our own rather than recursing.
+ */
+static struct {
+	struct {
+		lval_t *v;  /* to be copied */
+		lref_t *to; /* into this cell */
+	} *item;
+	int count;
+	int cap;
+} lcopies;
+
 static lval_t *lval_copy(lval_t *v)
 {
-	lval_t *x = malloc(sizeof(*x));
-	x->type = v->type;
+	int base = lcopies.count;
+	lval_t *x = NULL;
+	lref_t *to = NULL;
+
+	for (;;) {
+		lval_t *c = lval_copy_one(v);
+		if (to) {
+			*to = LREF(c);
+		} else {
+			x = c;
+		}
+
+		if ((c->flags & LVAL_INLINE) && c->count) {
+			if (lcopies.count + c->count > lcopies.cap) {
+				lcopies.cap = lcopies.cap ? 2 * lcopies.cap : 64;
+				lcopies.item = realloc(lcopies.item, sizeof(*lcopies.item) * lcopies.cap);
+			}
+			for (int i = c->count - 1; i >= 0; i--) {
+				lcopies.item[lcopies.count].v = LPTR(v->small[i]);
+				lcopies.item[lcopies.count++].to = &c->small[i];
+			}
+		}
+
+		if (lcopies.count == base) {
+			return x;
+		}
+		lcopies.count--;
+		v = lcopies.item[lcopies.count].v;
+		to = lcopies.item[lcopies.count].to;
+	}
+}
+
+/* a copy of v, but with an inline list's cells left to fill in */
+static lval_t *lval_copy_one(lval_t *v)
+{
+	if ((v->flags & (LVAL_INLINE | LVAL_LENT)) == LVAL_INLINE && lval_nests(v)) {
+		lval_spill(v, v->count);
+	}
+
+	lval_t *x = lval_new(v->type);
+	x->flags = v->flags;
 
 	switch(v->type) {
 		/* copy functions and numbers directly */
 		case LVAL_FUN:
-		if (v->builtin) {
+		if (v->flags & LVAL_BUILTIN) {
 			x->builtin = v->builtin;
+		} else if (v->flags & LVAL_PARTIAL) {
+			x->partial = v->partial;
+			x->partial->refs++;
 		} else {
-			x->builtin = NULL;
-			x->env = lenv_copy(v->env);
-			x->formals = lval_copy(v->formals);
-			x->body = lval_copy(v->body);
+			x->lambda = v->lambda;
+			x->lambda->refs++;
 		}
 		break;
 
@@ -384,17 +1311,32 @@ static lval_t *lval_copy(lval_t *v)
 		break;
 
 		case LVAL_SYM:
-		x->sym = malloc(strlen(v->sym) + 1);
-		strcpy(x->sym, v->sym);
+		x->sym = v->sym;
+		x->depth = v->depth;
+		x->count = v->count;
+		if (v->flags & LVAL_CACHED) {
+			lcaches.site[v->count].refs++;
+		}
 		break;
 
-		/* copy lists by copying each sub expression */
+		/*
+		 * lists just take another reference to the same cells, bar
+		 * inline ones of atoms which are small enough to copy
+		 */
 		case LVAL_SEXPR:
 		case LVAL_QEXPR:
+		x->flags &= ~LVAL_LENT;
 		x->count = v->count;
-		x->cell = malloc(sizeof(*x->cell) * x->count);
-		for (int i = 0; i < v->count; i++) {
-			x->cell[i] = lval_copy(v->cell[i]);
+		if (v->flags & LVAL_INLINE) {
+			break;
+		}
+		x->cell = v->cell;
+		x->store = v->store;
+		x->tree = v->tree;
+		if (x->tree) {
+			x->tree->refs++;
+		} else if (x->store) {
+			x->store->refs++;
 		}
 		break;
 	}
@@ -402,91 +1344,353 @@ static lval_t *lval_copy(lval_t *v)
 	return x;
 }
 
-static lval_t *lval_call(lenv_t *e, lval_t *f, lval_t *a)
+/* whether any of the cells of the inline list v are lists themselves */
+static int lval_nests(lval_t *v)
 {
-	/* if this is a builtin just do that! */
-	if (f->builtin) {
-		return f->builtin(e, a);
-	}
-
-	int given = a->count;
-	int total = f->formals->count;
-
-	/* while we still have arguments to bind */
-	while (a->count) {
-		/* if we've run out of formals to bind.. oh noes! */
-		if (f->formals->count == 0) {
-			lval_del(a);
-			return lval_err("Function passed too many arguments. Got %i, Expected %i.", given, total);
+	for (int i = 0; i < v->count; i++) {
+		int type = LPTR(v->small[i])->type;
+		if (type == LVAL_SEXPR || type == LVAL_QEXPR) {
+			return 1;
 		}
+	}
 
-		/* Pop the first symbol from the formals */
-		lval_t *sym = lval_pop(f->formals, 0);
-
-		if (strcmp(sym->sym, "&") == 0) {
-			if (f->formals->count != 1) {
-				lval_del(a);
-				return lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
-			}
+	return 0;
+}
 
-			/* next formal should be bound to remaining arguments */
-			lval_t *nsym = lval_pop(f->formals, 0);
-			lenv_put(f->env, nsym, builtin_list(e, a));
-			lval_del(sym);
-			lval_del(nsym);
-			break;
-		}
+/* f with the arguments a bound, but still waiting on the rest */
+static lval_t *lval_partial(lval_t *f, lval_t *a)
+{
+	lval_t *v = lval_new(LVAL_FUN);
+	size_t size = sizeof(*v->partial) + sizeof(lref_t) * a->count;
 
-		/* Pop the next argument from the list */
-		lval_t *val = lval_pop(a, 0);
+	v->flags |= LVAL_PARTIAL;
+	v->partial = malloc(size);
+	lstats_add(size);
 
-		/* Bind a copy into the function's environment */
-		lenv_put(f->env, sym, val);
+	lpartial_t *p = v->partial;
+	p->refs = 1;
+	p->fun = lval_copy(f);
+	p->count = a->count;
+	p->have = a->count + (f->flags & LVAL_PARTIAL ? f->partial->have : 0);
 
-		/* Delete the symbol and the value */
-		lval_del(sym);
-		lval_del(val);
+	for (int i = 0; i < p->count; i++) {
+		p->arg[i] = LREF(lval_pop(a, 0));
 	}
-
-	/* we've completely bound the argument list, so we can clean it up */
 	lval_del(a);
 
-	/*
-	 * check to see if only a varargs remains. If so, consider the function
-	 * resolved and don't do any currying. Just call it with an empty list
-	 */
-	if (f->formals->count > 0 &&
-	    strcmp(f->formals->cell[0]->sym, "&") == 0) {
-	    	if (f->formals->count != 2) {
-	    		return lval_err("Function format invalid. Symbol '&' not followed by a single symbol.");
-	    	}
-	    	/* Pop and delete '&' symbol */
-	    	lval_del(lval_pop(f->formals, 0));
-
-	    	/* Pop next symbol and create empty list */
-	    	lval_t *sym = lval_pop(f->formals, 0);
-	    	lval_t *val = lval_qexpr();
+	return v;
+}
 
-	    	/* Bind to environment and delete */
-	    	lenv_put(f->env, sym, val);
-	    	lval_del(sym);
-	    	lval_del(val);
+/* the lambda underneath any partial applications of f */
+static lval_t *lval_lambda_of(lval_t *f)
+{
+	while (f->flags & LVAL_PARTIAL) {
+		f = f->partial->fun;
 	}
 
-	/* If all formals have been evaluated */
-	if (f->formals->count == 0) {
-		/* Set Function Environment parent to current evaluation Environment */
-		f->env->par = e;
+	return f;
+}
+
+/* is f a macro, rather than a builtin or a lambda or one partly applied */
+static int lval_is_macro(lval_t *f)
+{
+	return f->type == LVAL_FUN && !(f->flags & (LVAL_BUILTIN | LVAL_PARTIAL)) &&
+		(f->lambda->flags & LLAMBDA_MACRO);
+}
+
+/* add copies of the arguments partial applications of f have been given to x */
+static lval_t *lval_partial_args(lval_t *f, lval_t *x)
+{
+	if (!(f->flags & LVAL_PARTIAL)) {
+		return x;
+	}
+
+	x = lval_partial_args(f->partial->fun, x);
+	for (int i = 0; i < f->partial->count; i++) {
+		x = lval_add(x, lval_copy(LPTR(f->partial->arg[i])));
+	}
+
+	return x;
+}
+
+/* bind sym to v in a frame that's being filled in, taking v */
+static void lenv_bind(lenv_t *e, lval_t *k, lval_t *v)
+{
+	int i = lenv_find(e, k->sym);
+	if (i >= 0) {
+		lval_del(LPTR(e->vals[i]));
+		e->vals[i] = LREF(v);
+		return;
+	}
+
+	lenv_grow(e);
+	lenv_insert(e, k->sym, LREF(v));
+}
+
+/*
+ * How deep calls are nested, so that going too deep is an error rather than
+ * a crash. Lambdas run by the VM keep their frames on the heap and are only
+ * held to lval_max_depth, but the tree and closure walkers recurse in C, so
+ * they also stop short of running out of C stack.
+ */
+int lval_max_depth = 100000;
+
+static struct {
+	int calls;
+	uintptr_t base; /* where the C stack was when we started */
+	size_t size;    /* how much of it we'll use */
+} ldepth;
+
+static void ldepth_init(void)
+{
+	char here;
+	struct rlimit rl;
+
+	if (ldepth.base) {
+		return;
+	}
+
+	/* leave some for builtins and the like: a quarter, up to 512KB */
+	ldepth.base = (uintptr_t)&here;
+	ldepth.size = 64 << 20;
+	if (getrlimit(RLIMIT_STACK, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+		ldepth.size = rl.rlim_cur - (rl.rlim_cur / 4 < (512 << 10) ? rl.rlim_cur / 4 : (512 << 10));
+	}
+}
+
+/* is there still n bytes of C stack to go? */
+static int ldepth_room(size_t n)
+{
+	char here;
+	uintptr_t sp = (uintptr_t)&here;
+
+	if (!ldepth.base) {
+		ldepth_init();
+	}
+
+	return (sp < ldepth.base ? ldepth.base - sp : sp - ldepth.base) + n <= ldepth.size;
+}
+
+static lval_t *ldepth_stack(void)
+{
+	return ldepth_room(0) ? NULL : lval_err("Calls nested too deep. Ran out of stack.");
+}
+
+/* one more call deep, unless that's too deep */
+static lval_t *ldepth_enter(void)
+{
+	if (ldepth.calls >= lval_max_depth) {
+		return lval_err("Calls nested too deep. Got past the maximum depth of %i.", lval_max_depth);
+	}
+	if (!ldepth_room(0)) {
+		return ldepth_stack();
+	}
+
+	ldepth.calls++;
+	return NULL;
+}
+
+/*
+ * A call to be made once the lambda making it has returned. env is the frame
+ * of that lambda if it's dynamically scoped, for the call to be made from.
+ */
+static struct {
+	lval_t *f;
+	lval_t *a;
+	lenv_t *env;
+} ltail;
+
+/*
+ * Calls in tail position don't nest, they come back here to be made, so a
+ * loop written as a tail call runs in constant C stack.
+ */
+lval_t *lval_call(lenv_t *e, lval_t *f, lval_t *a)
+{
+	lenv_t *was = lroot_enter(e);
+	lval_t *r = lval_invoke(e, f, a, 1);
+	r = r ? r : ltail_run(e);
+	lroot = was;
+
+	return r;
+}
+
+/* call f, but if tail is set the call it ends with is left in ltail */
+static lval_t *lval_invoke(lenv_t *e, lval_t *f, lval_t *a, int tail)
+{
+	/* if this is a builtin just do that! */
+	if (f->flags & LVAL_BUILTIN) {
+		return f->builtin(e, a);
+	}
+
+	/* macros that couldn't be expanded where they're used end up here */
+	if (lval_is_macro(f)) {
+		int given = a->count;
+		int want = f->lambda->formals->count;
+		lval_del(a);
+		if (given != want) {
+			return lval_err("Macro passed wrong number of arguments. Got %i, Expected %i.", given, want);
+		}
+		return lval_err("Macro called where it couldn't be expanded!");
+	}
+
+	lval_t *fn = lval_lambda_of(f);
+	llambda_t *l = fn->lambda;
+	int varargs = l->flags & LLAMBDA_VARARGS;
+	int have = f->flags & LVAL_PARTIAL ? f->partial->have : 0;
+	int given = a->count;
+
+	/* formals that have to be given before any '&' */
+	int fixed = l->formals->count;
+	if (varargs) {
+		for (fixed = 0; strcmp(LSYM(LCELL(l->formals, fixed)), "&") != 0; fixed++) {
+		}
+	}
+
+	if (!varargs && have + given > fixed) {
+		lval_del(a);
+		return lval_err("Function passed too many arguments. Got %i, Expected %i.", given, fixed - have);
+	}
+
+	/* not everything's here yet, so hang on to what is */
+	if (have + given < fixed) {
+		return given ? lval_partial(f, a) : (lval_del(a), lval_copy(f));
+	}
+
+	if (varargs && l->formals->count != fixed + 2) {
+		lval_del(a);
+		return lval_err(have + given > fixed ?
+			"Function format invalid. Symbol '&' not followed by single symbol." :
+			"Function format invalid. Symbol '&' not followed by a single symbol.");
+	}
+
+	/* earlier arguments from partial applications go first */
+	if (have) {
+		lval_t *x = lval_sexpr();
+		lval_reserve(x, have + given);
+		a = lval_join(lval_partial_args(f, x), a);
+	}
+
+	lval_t *err = ldepth_enter();
+	if (err) {
+		lval_del(a);
+		return err;
+	}
+
+	lenv_t *frame = lenv_enter(e, l);
+
+	/* the arguments are ours, so move them into the frame */
+	for (int i = 0; i < fixed; i++) {
+		lenv_bind(frame, LCELL(l->formals, i), lval_pop(a, 0));
+	}
+
+	if (varargs) {
+		lenv_bind(frame, LCELL(l->formals, fixed + 1), builtin_list(e, a));
+	} else {
+		lval_del(a);
+	}
+
+	if (frame->par == e && (e->flags & LENV_HELD)) {
+		lenv_take(frame, e);
+	}
 
-		/* Evaluate and return */
-		return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
+	lval_t *r;
+	if (l->code) {
+		r = lvm_run(frame, l->code, tail);
+	} else if (l->expr) {
+		r = l->expr->run(l->expr, frame);
+	} else {
+		r = lval_eval_cells(frame, llambda_body(l), tail);
+	}
+
+	/*
+	 * What a dynamically scoped lambda tail calls sees this frame, so it's
+	 * left for ltail_run() to call it from, holding on to the frame we were
+	 * called from in turn.
+	 */
+	if (!r && (l->env->flags & LENV_DYNAMIC)) {
+		if (!(frame->flags & LENV_HELD)) {
+			frame->flags |= LENV_HELD;
+			frame->par->refs++;
+		}
+		ltail.env = frame;
+	} else {
+		lenv_del(frame);
+	}
+	ldepth.calls--;
+
+	return r;
+}
+
+/*
+ * frame was called from e, the finished frame of a lambda that tail called
+ * it, so instead of keeping e around, copy in what frame can still see of it
+ * and skip over it. Then a loop that's a tail call keeps to one frame.
+ */
+static void lenv_take(lenv_t *frame, lenv_t *e)
+{
+	for (int i = 0; i < lenv_slots(e); i++) {
+		if (e->syms[i] && lenv_find(frame, e->syms[i]) < 0) {
+			lenv_grow(frame);
+			lenv_insert(frame, e->syms[i], LREF(lval_copy(LPTR(e->vals[i]))));
+		}
 	}
 
-	/* Otherwise return partially evaluated function */
-	return lval_copy(f);
+	frame->par = e->par;
+	frame->flags |= LENV_HELD;
+	frame->par->refs++;
+}
+
+/*
+ * Pairs of lvals still to compare, so lists nested however deep can be
+ * compared without recursing.
+ */
+struct leq {
+	lval_t **v;
+	int count;
+	int cap;
+	lval_t *first[32]; /* v to begin with */
+};
+
+static void leq_push(struct leq *q, lval_t *l, lval_t *r)
+{
+	if (q->count + 2 > q->cap) {
+		q->cap *= 2;
+		if (q->v == q->first) {
+			q->v = malloc(sizeof(*q->v) * q->cap);
+			memcpy(q->v, q->first, sizeof(q->first));
+		} else {
+			q->v = realloc(q->v, sizeof(*q->v) * q->cap);
+		}
+	}
+	q->v[q->count++] = l;
+	q->v[q->count++] = r;
 }
 
 static int lval_eq(lval_t *l, lval_t *r)
+{
+	struct leq q;
+	int eq = 1;
+
+	q.v = q.first;
+	q.count = 0;
+	q.cap = sizeof(q.first) / sizeof(*q.first);
+
+	leq_push(&q, l, r);
+	while (eq && q.count) {
+		r = q.v[--q.count];
+		l = q.v[--q.count];
+		eq = lval_eq_one(&q, l, r);
+	}
+
+	if (q.v != q.first) {
+		free(q.v);
+	}
+
+	return eq;
+}
+
+/* compare l and r themselves, leaving anything they hold to compare to q */
+static int lval_eq_one(struct leq *q, lval_t *l, lval_t *r)
 {
 	/* different types are not equal */
 	if (l->type != r->type) {
@@ -499,22 +1703,36 @@ static int lval_eq(lval_t *l, lval_t *r)
 	case LVAL_NUM:
 		return l->num == r->num;
 	case LVAL_SYM:
-		return strcmp(l->sym, r->sym) == 0;
+		return l->sym == r->sym;
 		break;
 	case LVAL_FUN:
-		if (l->builtin || r->builtin) {
-			return l->builtin == r->builtin;
+		if ((l->flags | r->flags) & LVAL_BUILTIN) {
+			return (l->flags & r->flags & LVAL_BUILTIN) && l->builtin == r->builtin;
+		}
+		if ((l->flags | r->flags) & LVAL_PARTIAL) {
+			if (!(l->flags & r->flags & LVAL_PARTIAL) ||
+			    l->partial->count != r->partial->count) {
+				return 0;
+			}
+			leq_push(q, l->partial->fun, r->partial->fun);
+			for (int i = 0; i < l->partial->count; i++) {
+				leq_push(q, LPTR(l->partial->arg[i]), LPTR(r->partial->arg[i]));
+			}
+			return 1;
 		}
-		return lval_eq(l->formals, r->formals) && lval_eq(l->body, r->body);
+		leq_push(q, l->lambda->formals, r->lambda->formals);
+		leq_push(q, l->lambda->body, r->lambda->body);
+		return 1;
 	case LVAL_SEXPR:
 	case LVAL_QEXPR:
 		if (l->count != r->count) {
 			return 0;
 		}
+
+		struct lcursor lc = { NULL, 0, 0 };
+		struct lcursor rc = { NULL, 0, 0 };
 		for (int i = 0; i < l->count; i++) {
-			if (!lval_eq(l->cell[i], r->cell[i])) {
-				return 0;
-			}
+			leq_push(q, lval_at(l, i, &lc), lval_at(r, i, &rc));
 		}
 
 		return 1;
@@ -525,514 +1743,5815 @@ static int lval_eq(lval_t *l, lval_t *r)
 
 static lval_t *lenv_get(lenv_t *e, lval_t *v)
 {
-	for (int i = 0; i < e->count; i++) {
-		if (strcmp(v->sym, e->syms[i]) == 0) {
-			return lval_copy(e->vals[i]);
-		}
+	lval_t *x = lenv_peek(e, v);
+
+	return x ? lval_copy(x) : lval_err("unbound symbol '%s'", v->sym->name);
+}
+
+/* what the symbol v is bound to in e, without copying it, or NULL */
+static lval_t *lenv_peek(lenv_t *e, lval_t *v)
+{
+	lsym_t *sym = v->sym;
+
+	/* nothing can shadow these, so it's straight to the value cell */
+	lval_t *x;
+	if ((v->flags & LVAL_GLOBAL) && (x = lglobal(sym))) {
+		return x;
 	}
 
-	if (e->par) {
-		return lenv_get(e->par, v);
+	/*
+	 * bound symbols say where to look, but still check the name is there
+	 * in case the frame has turned into a table or this isn't the env the
+	 * symbol was resolved against
+	 */
+	if (v->flags & LVAL_BOUND) {
+		lenv_t *f = e;
+		for (int d = v->depth; d && f; d--) {
+			f = f->par;
+		}
+
+		if (f && f->cap <= LENV_FLAT && v->count < f->count &&
+		    f->syms[v->count] == sym) {
+			return LPTR(f->vals[v->count]);
+		}
 	}
 
-	return lval_err("unbound symbol '%s'", v->sym);
-}
+	struct lcache *c = NULL;
+	if (v->flags & LVAL_CACHED) {
+		c = &lcaches.site[v->count];
 
-static void lenv_put(lenv_t *e, lval_t *k, lval_t *v)
-{
-	for (int i = 0; i < e->count; i++) {
-		if (strcmp(k->sym, e->syms[i]) == 0) {
-			lval_del(e->vals[i]);
-			e->vals[i] = lval_copy(v);
-			return;
+		if (c->depth == 0 || (c->depth > 0 && c->version == sym->version)) {
+			lenv_t *f = e;
+			for (int d = c->depth; d && f; d--) {
+				f = f->par;
+			}
+
+			if (f && c->slot < 0 && (f->flags & LENV_GLOBAL) && (x = lenv_global(f, sym))) {
+				lcaches.hits++;
+				return x;
+			}
+			if (f && c->slot >= 0 && c->slot < lenv_slots(f) && f->syms[c->slot] == sym) {
+				lcaches.hits++;
+				return LPTR(f->vals[c->slot]);
+			}
 		}
+		lcaches.misses++;
 	}
 
-	e->count++;
-	e->vals = realloc(e->vals, sizeof(*e->vals) * e->count);
-	e->syms = realloc(e->syms, sizeof(*e->syms) * e->count);
+	for (int d = 0; e; e = e->par, d++) {
+		int i = -1;
 
-	e->vals[e->count - 1] = lval_copy(v);
-	e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
-	strcpy(e->syms[e->count - 1], k->sym);
-}
+		x = NULL;
+		if (e->flags & LENV_GLOBAL) {
+			if (!(x = lenv_global(e, sym))) {
+				break;
+			}
+		} else if ((i = lenv_find(e, sym)) < 0) {
+			continue;
+		}
 
-/* define in the top environment */
-static void lenv_def(lenv_t *e, lval_t *k, lval_t *v)
-{
-	while (e->par) {
-		e = e->par;
+		if (c) {
+			c->version = sym->version;
+			c->depth = d;
+			c->slot = i;
+		}
+		return x ? x : LPTR(e->vals[i]);
 	}
 
-	lenv_put(e, k, v);
+	return NULL;
 }
-
-static lenv_t *lenv_copy(lenv_t *e)
+static void lenv_put(lenv_t *e, lval_t *k, lval_t *v)
 {
-	lenv_t *n = malloc(sizeof(*n));
+	lsym_t *sym = k->sym;
+	lval_t *was = NULL;
 
-	n->par = e->par;
-	n->count = e->count;
-
-	n->syms = malloc(sizeof(*n->syms) * n->count);
-	n->vals = malloc(sizeof(*n->vals) * n->count);
+	if (e->flags & LENV_GLOBAL) {
+		lref_t *cell = lenv_cell(e, sym);
+		if (*cell != LREF_NULL) {
+			was = LPTR(*cell);
+		}
+		*cell = LREF(lval_copy(v));
+	} else {
+		int i = lenv_find(e, sym);
+		if (i >= 0) {
+			was = LPTR(e->vals[i]);
+			e->vals[i] = LREF(lval_copy(v));
+		} else {
+			lenv_grow(e);
+			lenv_insert(e, sym, LREF(lval_copy(v)));
+		}
+	}
 
-	for (int i = 0; i < n->count; i++) {
-		n->syms[i] = malloc(strlen(e->syms[i] + 1));
-		strcpy(n->syms[i], e->syms[i]);
-		n->vals[i] = lval_copy(e->vals[i]);
+	/*
+	 * Whatever it was before, the folds that counted on it can't any more.
+	 * The ones that get folded again see what it is now.
+	 */
+	if (sym->folds) {
+		lfold_undo(e, sym);
 	}
 
-	return n;
+	if (was) {
+		lval_del(was);
+	}
 }
 
-static void lval_expr_print(lval_t *v, char open, char close)
+/* number of slots to look through for bindings, empty or not */
+static int lenv_slots(lenv_t *e)
 {
-	putchar(open);
-
-	for (int i = 0; i < v->count; i++) {
-		lval_print(v->cell[i]);
+	return e->cap > LENV_FLAT ? e->cap : e->count;
+}
 
-		if (i != v->count - 1) {
-			putchar(' ');
+/* slot of sym in e alone, or -1 */
+static int lenv_find(lenv_t *e, lsym_t *sym)
+{
+	if (e->cap <= LENV_FLAT) {
+		for (int i = 0; i < e->count; i++) {
+			if (e->syms[i] == sym) {
+				return i;
+			}
 		}
+		return -1;
 	}
 
-	putchar(close);
-}
-
-static void lval_print(const lval_t *v)
-{
-	switch (v->type) {
-		case LVAL_NUM:
-		printf("%li", v->num);
-		break;
-		case LVAL_ERR:
-		printf("Error: %s", v->err);
-		break;
-		case LVAL_SYM:
-		printf("%s", v->sym);
-		break;
-		case LVAL_FUN:
-		if (v->builtin) {
-			printf("<function>");
-		} else {
-			printf("\\ ");
-			lval_print(v->formals);
-			putchar(' ');
-			lval_print(v->body);
-			putchar(')');
+	unsigned mask = e->cap - 1;
+	for (unsigned i = sym->hash & mask; e->syms[i]; i = (i + 1) & mask) {
+		if (e->syms[i] == sym) {
+			return i;
 		}
-		break;
-		case LVAL_SEXPR:
-		lval_expr_print(v, '(', ')');
-		break;
-		case LVAL_QEXPR:
-		lval_expr_print(v, '{', '}');
-		break;
 	}
+
+	return -1;
 }
 
-static lval_t *lval_pop(lval_t *v, int i)
+/* add a binding we know isn't there yet, taking ownership of v */
+static void lenv_insert(lenv_t *e, lsym_t *sym, lref_t v)
 {
-	lval_t *x = v->cell[i];
+	unsigned i = e->count;
 
-	memmove(&v->cell[i],
-		&v->cell[i + 1],
-		sizeof(*v->cell) * (v->count - i - 1));
-	v->count--;
-	v->cell = realloc(v->cell, sizeof(*v->cell) * v->count);
+	if (e->cap > LENV_FLAT) {
+		unsigned mask = e->cap - 1;
+		for (i = sym->hash & mask; e->syms[i]; i = (i + 1) & mask) {
+		}
+	}
 
-	return x;
+	e->syms[i] = sym;
+	e->vals[i] = v;
+	e->count++;
 }
 
 /*
-static lval_t *builtin(lval_t *a, char *func)
+ * Make room for one more binding. Small environments are just arrays that
+ * double as they fill up, past LENV_FLAT they turn into a hash table which is
+ * kept at most half full.
+ */
+static void lenv_grow(lenv_t *e)
 {
-	if (strcmp(func, "head") == 0) {
-		return builtin_head(a);
-	}
-	if (strcmp(func, "tail") == 0) {
-		return builtin_tail(a);
+	if (e->cap <= LENV_FLAT ? e->count < e->cap : 2 * (e->count + 1) <= e->cap) {
+		return;
 	}
-	if (strcmp(func, "list") == 0) {
-		return builtin_list(a);
-	}
-	if (strcmp(func, "eval") == 0) {
-		return builtin_eval(a);
-	}
-	if (strcmp(func, "join") == 0) {
-		return builtin_join(a);
+
+	int cap = e->cap ? 2 * e->cap : 4;
+	while (cap > LENV_FLAT && 2 * (e->count + 1) > cap) {
+		cap *= 2;
 	}
-	if (strstr("+-/*%", func)) {
-		return builtin_op(a, func);
+
+	if (cap <= LENV_FLAT) {
+		e->syms = realloc(e->syms, sizeof(*e->syms) * cap);
+		e->vals = realloc(e->vals, sizeof(*e->vals) * cap);
+		e->cap = cap;
+		return;
 	}
 
-	lval_del(a);
-	return lval_err("Unknown function!");
-}
-*/
+	int slots = lenv_slots(e);
+	lsym_t **syms = e->syms;
+	lref_t *vals = e->vals;
 
-static lval_t *builtin_op(lenv_t *e, lval_t *a, char *op)
-{
-	/* make sure all arguments are numbers */
-	for (int i = 0; i < a->count; i++) {
-		if (a->cell[i]->type != LVAL_NUM) {
-			lval_del(a);
-			return lval_err("Cannot operator on non-number! Got %s, Expected %s",
-					 ltype_name(a->cell[i]->type),
-					 ltype_name(LVAL_NUM));
+	e->count = 0;
+	e->cap = cap;
+	e->syms = calloc(cap, sizeof(*e->syms));
+	e->vals = malloc(sizeof(*e->vals) * cap);
+
+	for (int i = 0; i < slots; i++) {
+		if (syms[i]) {
+			lenv_insert(e, syms[i], vals[i]);
 		}
 	}
 
-	lval_t *x = lval_pop(a, 0);
-	/*
-	 * if there aren't any other arguments and this is subtraction
-	 * just negate the number
-	 */
-	if ((strcmp(op, "-") == 0) && a->count == 0) {
-		x->num = -x->num;
-	}
+	free(syms);
+	free(vals);
+}
 
-	while(a->count > 0) {
-		lval_t *y = lval_pop(a, 0);
+/* the one lsym called name, made the first time it's asked for */
+lsym_t *lsym_intern(const char *name)
+{
+	unsigned h = lsym_hash(name);
+	unsigned mask = lsyms.cap - 1;
+	unsigned i;
 
-		if (strcmp(op, "+") == 0) {
-			x->num = x->num + y->num;
-		}
-		if (strcmp(op, "-") == 0) {
-			x->num = x->num - y->num;
-		}
-		if (strcmp(op, "*") == 0) {
-			x->num = x->num * y->num;
-		}
-		if (strcmp(op, "/") == 0) {
-			if (y->num == 0) {
-				lval_del(x);
-				lval_del(y);
-				lval_del(a);
-				return lval_err("Division by Zero!");
-			}
-			x->num = x->num / y->num;
+	for (i = h & mask; lsyms.cap && lsyms.sym[i]; i = (i + 1) & mask) {
+		if (lsyms.sym[i]->hash == h && strcmp(lsyms.sym[i]->name, name) == 0) {
+			return lsyms.sym[i];
 		}
-		if (strcmp(op, "%") == 0) {
-			if (y->num == 0) {
-				lval_del(x);
-				lval_del(y);
-				lval_del(a);
-				return lval_err("Division (mod) by Zero!");
+	}
+
+	/* keep the table at most half full */
+	if (2 * (lsyms.count + 1) > lsyms.cap) {
+		int cap = lsyms.cap ? 2 * lsyms.cap : 256;
+		lsym_t **old = lsyms.sym;
+
+		lsyms.sym = calloc(cap, sizeof(*lsyms.sym));
+		mask = cap - 1;
+		for (int j = 0; j < lsyms.cap; j++) {
+			if (old[j]) {
+				for (i = old[j]->hash & mask; lsyms.sym[i]; i = (i + 1) & mask) {
+				}
+				lsyms.sym[i] = old[j];
 			}
-			x->num = x->num % y->num;
 		}
 
-		lval_del(y);
+		free(old);
+		lsyms.cap = cap;
+
+		for (i = h & mask; lsyms.sym[i]; i = (i + 1) & mask) {
+		}
 	}
 
-	lval_del(a);
+	lsym_t *sym = malloc(sizeof(*sym) + strlen(name) + 1);
+	sym->id = lsyms.count;
+	sym->hash = h;
+	sym->version = 0;
+	sym->folds = 0;
+	strcpy(sym->name, name);
 
-	return x;
+	lsyms.sym[i] = sym;
+	lsyms.count++;
+
+	return sym;
 }
 
-static lval_t *builtin_head(lenv_t *e, lval_t *a)
+/* FNV-1a */
+static unsigned lsym_hash(const char *name)
 {
-	LASSERT(a, (a->count == 1), "Function 'head' passed too many arguments! Got %i, Expected %i.", a->count, 1);
-	LASSERT_TYPE(a, "head", a->cell[0]->type, LVAL_QEXPR);
-	LASSERT(a, (a->cell[0]->count != 0), "Function 'head' passed {}!");
+	unsigned h = 2166136261u;
 
-	lval_t *v = lval_take(a, 0);
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+/* define in the top environment */
+static void lenv_def(lenv_t *e, lval_t *k, lval_t *v)
+{
+	lenv_put(lenv_root(e), k, v);
+}
+
+static lenv_t *lenv_root(lenv_t *e)
+{
+	while (e->par) {
+		e = e->par;
+	}
+
+	return e;
+}
+
+/*
+ * Make the globals e is in the ones names are looked up in, for a call from
+ * outside. Returns the ones that were, to put back once it's done, so that
+ * interpreters can call each other.
+ */
+static lenv_t *lroot_enter(lenv_t *e)
+{
+	lenv_t *was = lroot;
+	lroot = lenv_root(e);
+
+	return was;
+}
+
+/* what sym is bound to in the globals e is in, or NULL */
+lval_t *lenv_global(lenv_t *e, lsym_t *sym)
+{
+	e = lenv_root(e);
+
+	return sym->id < e->nglobal && e->global[sym->id] != LREF_NULL ? LPTR(e->global[sym->id]) : NULL;
+}
+
+/* the same in the globals of whatever's running */
+static lval_t *lglobal(lsym_t *sym)
+{
+	return sym->id < lroot->nglobal && lroot->global[sym->id] != LREF_NULL ?
+		LPTR(lroot->global[sym->id]) : NULL;
+}
+
+/* sym's cell in the globals e, making room for it */
+static lref_t *lenv_cell(lenv_t *e, lsym_t *sym)
+{
+	if (sym->id >= e->nglobal) {
+		int n = e->nglobal ? e->nglobal : 64;
+		while (n <= sym->id) {
+			n *= 2;
+		}
+		e->global = realloc(e->global, sizeof(*e->global) * n);
+		for (int i = e->nglobal; i < n; i++) {
+			e->global[i] = LREF_NULL;
+		}
+		e->nglobal = n;
+	}
+
+	return &e->global[sym->id];
+}
+
+/* an empty frame for a lambda to bind its formals in */
+static lenv_t *lenv_frame(void)
+{
+	lenv_t *e = malloc(sizeof(*e));
+	e->par = NULL;
+	e->refs = 1;
+	e->flags = 0;
+	e->count = 0;
+	e->cap = 0;
+	e->syms = NULL;
+	e->vals = NULL;
+	e->global = NULL;
+	e->nglobal = 0;
+
+	return e;
+}
+
+/* a frame from the pool, with room for LENV_FLAT bindings already */
+static lenv_t *lenv_call_frame(void)
+{
+	lenv_t *e = lframes;
+
+	if (e) {
+		lframes = e->par;
+	} else {
+		e = malloc(sizeof(*e));
+		e->cap = LENV_FLAT;
+		e->syms = malloc(sizeof(*e->syms) * LENV_FLAT);
+		e->vals = malloc(sizeof(*e->vals) * LENV_FLAT);
+		e->global = NULL;
+		e->nglobal = 0;
+	}
+
+	e->par = NULL;
+	e->refs = 1;
+	e->flags = 0;
+	e->count = 0;
+
+	return e;
+}
+
+/*
+ * What's still to print: an lval, or failing that a bit of text. These are
+ * kept on a stack rather than recursing, so lists can be nested however deep.
+ */
+struct lprint {
+	struct {
+		const lval_t *v;
+		const char *s;
+	} *item, first[32];
+	int count;
+	int cap;
+};
+
+static void lprint_push(struct lprint *p, const lval_t *v, const char *s)
+{
+	if (p->count == p->cap) {
+		p->cap *= 2;
+		if (p->item == p->first) {
+			p->item = malloc(sizeof(*p->item) * p->cap);
+			memcpy(p->item, p->first, sizeof(p->first));
+		} else {
+			p->item = realloc(p->item, sizeof(*p->item) * p->cap);
+		}
+	}
+	p->item[p->count].v = v;
+	p->item[p->count++].s = s;
+}
+
+/* print v's cells between open and close, or rather leave them to lval_print() */
+static void lval_expr_print(struct lprint *p, const lval_t *v, const char *open, const char *close)
+{
+	struct lcursor c = { NULL, 0, 0 };
+
+	fputs(open, stdout);
+
+	lprint_push(p, NULL, close);
+	for (int i = v->count - 1; i >= 0; i--) {
+		lprint_push(p, lval_at((lval_t *)v, i, &c), NULL);
+		if (i) {
+			lprint_push(p, NULL, " ");
+		}
+	}
+}
+
+static void lval_print(const lval_t *v)
+{
+	struct lprint p;
+
+	p.item = p.first;
+	p.count = 0;
+	p.cap = sizeof(p.first) / sizeof(*p.first);
+
+	lprint_push(&p, v, NULL);
+	while (p.count) {
+		p.count--;
+		if (p.item[p.count].s) {
+			fputs(p.item[p.count].s, stdout);
+		} else {
+			lval_print_one(&p, p.item[p.count].v);
+		}
+	}
+
+	if (p.item != p.first) {
+		free(p.item);
+	}
+}
+
+static void lval_print_one(struct lprint *p, const lval_t *v)
+{
+	switch (v->type) {
+		case LVAL_NUM:
+		printf("%li", v->num);
+		break;
+		case LVAL_ERR:
+		printf("Error: %s", v->err);
+		break;
+		case LVAL_SYM:
+		printf("%s", LSYM(v));
+		break;
+		case LVAL_FUN:
+		if (v->flags & LVAL_BUILTIN) {
+			printf("<function>");
+		} else {
+			/* partial applications show the formals still to come */
+			const lval_t *fn = v;
+			int have = 0;
+			if (v->flags & LVAL_PARTIAL) {
+				have = v->partial->have;
+				fn = lval_lambda_of(v->partial->fun);
+			}
+
+			struct lcursor c = { NULL, 0, 0 };
+			printf(fn->lambda->flags & LLAMBDA_MACRO ? "macro {" : "\\ {");
+			for (int i = have; i < fn->lambda->formals->count; i++) {
+				printf("%s", LSYM(lval_at(fn->lambda->formals, i, &c)));
+				if (i != fn->lambda->formals->count - 1) {
+					putchar(' ');
+				}
+			}
+			printf("} ");
+			lprint_push(p, NULL, ")");
+			lprint_push(p, fn->lambda->body, NULL);
+		}
+		break;
+		case LVAL_SEXPR:
+		lval_expr_print(p, v, "(", ")");
+		break;
+		case LVAL_QEXPR:
+		lval_expr_print(p, v, "{", "}");
+		break;
+	}
+}
+
+static lval_t *lval_pop(lval_t *v, int i)
+{
+	if (v->flags & LVAL_INLINE) {
+		lval_t *x = LPTR(v->small[i]);
+		memmove(&v->small[i],
+			&v->small[i + 1],
+			sizeof(*v->small) * (v->count - i - 1));
+		v->count--;
+		return x;
+	}
+
+	/* trees can only give up their first cell cheaply */
+	if (v->tree && i == 0) {
+		struct lcursor c = { NULL, 0, 0 };
+		lval_t *x = lval_copy(lval_at(v, 0, &c));
+		lval_slice(v, 1, v->count - 1);
+		return x;
+	}
+
+	/* only popping from either end can be done by moving the view */
+	if (v->tree || (i != 0 && i != v->count - 1)) {
+		lval_unshare(v);
+	}
+
+	lval_t *x = LPTR(v->cell[i]);
+
+	if (v->store->refs > 1) {
+		/* somebody else can still see x, so hand back a copy */
+		x = lval_copy(x);
+	} else if (i == 0) {
+		v->cell[0] = LREF_NULL;
+	} else {
+		memmove(&v->cell[i],
+			&v->cell[i + 1],
+			sizeof(*v->cell) * (v->count - i - 1));
+		v->cell[v->count - 1] = LREF_NULL;
+	}
+
+	if (i == 0) {
+		v->cell++;
+	}
+	v->count--;
+
+	return x;
+}
+
+/*
+ * Narrow the view of v down to count cells starting at start. The cells that
+ * fall outside stay in the store and go away along with it.
+ */
+static lval_t *lval_slice(lval_t *v, int start, int count)
+{
+	/* inline cells belong to v alone, so drop the ones we no longer need */
+	if (v->flags & LVAL_INLINE) {
+		for (int i = 0; i < v->count; i++) {
+			if (i < start || i >= start + count) {
+				lval_del(LPTR(v->small[i]));
+			}
+		}
+		memmove(v->small, &v->small[start], sizeof(*v->small) * count);
+		v->count = count;
+
+		return v;
+	}
+
+	if (v->tree) {
+		lnode_t *n = lnode_trim(lnode_slice(v->tree, start, count));
+		lnode_release(v->tree);
+		v->tree = n;
+		v->count = count;
+
+		return lval_untree(v);
+	}
+
+	v->cell += start;
+	v->count = count;
+
+	return v;
+}
+
+/* cell i of v, whether it is flat or a tree */
+static lval_t *lval_at(lval_t *v, int i, struct lcursor *c)
+{
+	if ((v->flags & LVAL_INLINE) || !v->tree) {
+		return LCELL(v, i);
+	}
+
+	if (i < c->lo || i >= c->hi) {
+		lnode_t *leaf = lnode_leaf_at(v->tree, i, &c->lo);
+		c->cell = leaf->cell;
+		c->hi = c->lo + leaf->count;
+	}
+
+	return LPTR(c->cell[i - c->lo]);
+}
+
+/*
+ * make v a flat list which is the only one looking at its store, so that we
+ * may write to it
+ */
+static void lval_unshare(lval_t *v)
+{
+	if (v->flags & LVAL_INLINE) {
+		return;
+	}
+
+	if (v->tree) {
+		lval_flatten(v);
+		return;
+	}
+
+	if (!v->store || v->store->refs == 1) {
+		return;
+	}
+
+	lstore_t *s = lstore_new(v->count);
+	for (int i = 0; i < v->count; i++) {
+		s->cell[s->count++] = LREF(lval_copy(LPTR(v->cell[i])));
+	}
+
+	v->store->refs--;
+	v->store = s;
+	v->cell = s->cell;
+}
+
+/* copy the cells of a tree out into a store of their own */
+static void lval_flatten(lval_t *v)
+{
+	struct lcursor c = { NULL, 0, 0 };
+	lstore_t *s = lstore_new(v->count);
+
+	for (int i = 0; i < v->count; i++) {
+		s->cell[s->count++] = LREF(lval_copy(lval_at(v, i, &c)));
+	}
+
+	lnode_release(v->tree);
+	v->tree = NULL;
+	v->store = s;
+	v->cell = s->cell;
+}
+
+/* trees that have shrunk down to fit in a leaf go back to being flat */
+static lval_t *lval_untree(lval_t *v)
+{
+	lnode_t *n = v->tree;
+
+	if (!n || v->count > LNODE_MAX) {
+		return v;
+	}
+
+	if (n->height) {
+		lval_flatten(v);
+		return v;
+	}
+
+	v->tree = NULL;
+	v->cell = n->cell;
+	v->store = n->store;
+	v->store->refs++;
+	lnode_release(n);
+
+	return v;
+}
+
+static lstore_t *lstore_new(int cap)
+{
+	lstore_t *s = malloc(sizeof(*s) + sizeof(*s->cell) * cap);
+	lstats_add(sizeof(*s) + sizeof(*s->cell) * cap);
+	s->refs = 1;
+	s->count = 0;
+	s->cap = cap;
+
+	return s;
+}
+
+/*
+ * Add x on the end of a store that is still being filled in, doubling it
+ * whenever it runs out of room. Start off with a NULL store.
+ */
+static lstore_t *lstore_push(lstore_t *s, lval_t *x)
+{
+	if (!s) {
+		s = lstore_new(4);
+	} else if (s->count == s->cap) {
+		lstats_add(sizeof(*s->cell) * s->cap);
+		s->cap *= 2;
+		s = realloc(s, sizeof(*s) + sizeof(*s->cell) * s->cap);
+	}
+
+	s->cell[s->count++] = LREF(x);
+
+	return s;
+}
+
+static void lstore_release(lstore_t *s)
+{
+	if (!s || --s->refs > 0) {
+		return;
+	}
+
+	for (int i = 0; i < s->count; i++) {
+		if (s->cell[i]) {
+			lval_del(LPTR(s->cell[i]));
+		}
+	}
+
+	lstats_add(-(long)(sizeof(*s) + sizeof(*s->cell) * s->cap));
+	free(s);
+}
+
+static lnode_t *lnode_leaf(lstore_t *s, lref_t *cell, int count)
+{
+	lnode_t *n = malloc(sizeof(*n));
+	lstats_add(sizeof(*n));
+	n->refs = 1;
+	n->height = 0;
+	n->count = count;
+	n->cell = cell;
+	n->store = s;
+	s->refs++;
+
+	return n;
+}
+
+static lnode_t *lnode_branch(int height)
+{
+	lnode_t *n = malloc(sizeof(*n) + LNODE_MAX * (sizeof(*n->child) + sizeof(*n->size)));
+	lstats_add(sizeof(*n) + LNODE_MAX * (sizeof(*n->child) + sizeof(*n->size)));
+	n->refs = 1;
+	n->height = height;
+	n->count = 0;
+	n->child = (lnode_t **)(n + 1);
+	n->size = (int *)(n->child + LNODE_MAX);
+
+	return n;
+}
+
+/* number of cells under n */
+static int lnode_len(lnode_t *n)
+{
+	return n->height ? n->size[n->count - 1] : n->count;
+}
+
+/* add c as the last child of n, handing over our reference to it */
+static void lnode_push(lnode_t *n, lnode_t *c)
+{
+	n->size[n->count] = lnode_len(c) + (n->count ? n->size[n->count - 1] : 0);
+	n->child[n->count++] = c;
+}
+
+static void lnode_release(lnode_t *n)
+{
+	if (--n->refs > 0) {
+		return;
+	}
+
+	if (n->height) {
+		for (int i = 0; i < n->count; i++) {
+			lnode_release(n->child[i]);
+		}
+		lstats_add(-(long)(LNODE_MAX * (sizeof(*n->child) + sizeof(*n->size))));
+	} else {
+		lstore_release(n->store);
+	}
+
+	lstats_add(-(long)sizeof(*n));
+	free(n);
+}
+
+/*
+ * the cells of the non-empty list v as a tree. Flat lists are cut up into
+ * leaves which all look at the one store, so no cells get copied.
+ */
+static lnode_t *lnode_from(lval_t *v)
+{
+	if (v->flags & LVAL_INLINE) {
+		lval_spill(v, v->count);
+	}
+
+	if (v->tree) {
+		v->tree->refs++;
+		return v->tree;
+	}
+
+	int n = (v->count + LNODE_MAX - 1) / LNODE_MAX;
+	lnode_t **nodes = malloc(sizeof(*nodes) * n);
+
+	for (int i = 0; i < n; i++) {
+		int count = v->count - i * LNODE_MAX;
+		if (count > LNODE_MAX) {
+			count = LNODE_MAX;
+		}
+		nodes[i] = lnode_leaf(v->store, v->cell + i * LNODE_MAX, count);
+	}
+
+	/* then stack branches on top until only the root is left */
+	while (n > 1) {
+		int m = (n + LNODE_MAX - 1) / LNODE_MAX;
+
+		for (int i = 0; i < m; i++) {
+			lnode_t *x = lnode_branch(nodes[i * LNODE_MAX]->height + 1);
+			for (int k = i * LNODE_MAX; k < n && k < (i + 1) * LNODE_MAX; k++) {
+				lnode_push(x, nodes[k]);
+			}
+			nodes[i] = x;
+		}
+		n = m;
+	}
+
+	lnode_t *root = nodes[0];
+	free(nodes);
+
+	return root;
+}
+
+/* find the leaf holding cell i, and the index of the first cell in it */
+static lnode_t *lnode_leaf_at(lnode_t *n, int i, int *first)
+{
+	*first = 0;
+
+	while (n->height) {
+		/*
+		 * no child can hold more than a full one would, so the radix
+		 * guess is never past the slot we want
+		 */
+		int slot = i >> (n->height * LNODE_BITS);
+		while (n->size[slot] <= i) {
+			slot++;
+		}
+
+		if (slot) {
+			i -= n->size[slot - 1];
+			*first += n->size[slot - 1];
+		}
+		n = n->child[slot];
+	}
+
+	return n;
+}
+
+/* a tree of the count cells of n starting at start, sharing what it can */
+static lnode_t *lnode_slice(lnode_t *n, int start, int count)
+{
+	if (start == 0 && count == lnode_len(n)) {
+		n->refs++;
+		return n;
+	}
+
+	if (!n->height) {
+		return lnode_leaf(n->store, n->cell + start, count);
+	}
+
+	int end = start + count;
+	int a = 0;
+	while (n->size[a] <= start) {
+		a++;
+	}
+	int b = a;
+	while (n->size[b] < end) {
+		b++;
+	}
+
+	int first = a ? n->size[a - 1] : 0;
+	lnode_t *x = lnode_branch(n->height);
+
+	if (a == b) {
+		lnode_push(x, lnode_slice(n->child[a], start - first, count));
+		return x;
+	}
+
+	lnode_push(x, lnode_slice(n->child[a], start - first, n->size[a] - start));
+	for (int i = a + 1; i < b; i++) {
+		n->child[i]->refs++;
+		lnode_push(x, n->child[i]);
+	}
+	lnode_push(x, lnode_slice(n->child[b], 0, end - n->size[b - 1]));
+
+	return x;
+}
+
+static lnode_t *lnode_concat(lnode_t *l, lnode_t *r)
+{
+	return lnode_trim(lnode_concat_sub(l, r, 1));
+}
+
+/* a root with just the one child can make way for that child */
+static lnode_t *lnode_trim(lnode_t *n)
+{
+	while (n->height && n->count == 1) {
+		lnode_t *c = n->child[0];
+		c->refs++;
+		lnode_release(n);
+		n = c;
+	}
+
+	return n;
+}
+
+/*
+ * Join l and r by zipping up their facing edges. Below the top this returns a
+ * branch one level above the taller of the two, holding one or two children.
+ */
+static lnode_t *lnode_concat_sub(lnode_t *l, lnode_t *r, int top)
+{
+	if (l->height > r->height) {
+		lnode_t *c = lnode_concat_sub(l->child[l->count - 1], r, 0);
+		return lnode_rebalance(l, c, NULL, top);
+	}
+
+	if (l->height < r->height) {
+		lnode_t *c = lnode_concat_sub(l, r->child[0], 0);
+		return lnode_rebalance(NULL, c, r, top);
+	}
+
+	if (l->height == 0) {
+		lnode_t *all[2] = { l, r };
+
+		if (top && l->count + r->count <= LNODE_MAX) {
+			int j = 0;
+			int off = 0;
+			return lnode_gather(all, &j, &off, l->count + r->count);
+		}
+
+		lnode_t *x = lnode_branch(1);
+		l->refs++;
+		r->refs++;
+		lnode_push(x, l);
+		lnode_push(x, r);
+
+		return x;
+	}
+
+	lnode_t *c = lnode_concat_sub(l->child[l->count - 1], r->child[0], 0);
+	return lnode_rebalance(l, c, r, top);
+}
+
+/*
+ * Lay the children of l (but its last), c and r (but its first) side by side
+ * and redistribute them so the level doesn't fill up with half empty nodes.
+ */
+static lnode_t *lnode_rebalance(lnode_t *l, lnode_t *c, lnode_t *r, int top)
+{
+	lnode_t *all[2 * LNODE_MAX];
+	lnode_t *out[2 * LNODE_MAX];
+	int plan[2 * LNODE_MAX];
+	int height = c->height;
+	int n = 0;
+
+	if (l) {
+		for (int i = 0; i < l->count - 1; i++) {
+			all[n++] = l->child[i];
+		}
+	}
+	for (int i = 0; i < c->count; i++) {
+		all[n++] = c->child[i];
+	}
+	if (r) {
+		for (int i = 1; i < r->count; i++) {
+			all[n++] = r->child[i];
+		}
+	}
+
+	int len = lnode_plan(all, n, plan);
+
+	for (int i = 0, j = 0, off = 0; i < len; i++) {
+		/* nodes which come out the same are shared rather than rebuilt */
+		if (off == 0 && all[j]->count == plan[i]) {
+			all[j]->refs++;
+			out[i] = all[j++];
+		} else {
+			out[i] = lnode_gather(all, &j, &off, plan[i]);
+		}
+	}
+
+	lnode_release(c);
+
+	lnode_t *x = lnode_branch(height);
+	for (int i = 0; i < len && i < LNODE_MAX; i++) {
+		lnode_push(x, out[i]);
+	}
+
+	if (len <= LNODE_MAX && top) {
+		return x;
+	}
+
+	lnode_t *w = lnode_branch(height + 1);
+	lnode_push(w, x);
+
+	if (len > LNODE_MAX) {
+		lnode_t *y = lnode_branch(height);
+		for (int i = LNODE_MAX; i < len; i++) {
+			lnode_push(y, out[i]);
+		}
+		lnode_push(w, y);
+	}
+
+	return w;
+}
+
+/*
+ * Work out how many slots each of the n nodes in all should end up with. Nodes
+ * are merged into their neighbours until we're within a couple of nodes of the
+ * fewest the slots could possibly fit in. Returns the new number of nodes.
+ */
+static int lnode_plan(lnode_t **all, int n, int *plan)
+{
+	int total = 0;
+
+	for (int i = 0; i < n; i++) {
+		plan[i] = all[i]->count;
+		total += plan[i];
+	}
+
+	int optimal = (total + LNODE_MAX - 1) / LNODE_MAX;
+	int i = 0;
+
+	while (optimal + 2 < n) {
+		/* nearly full nodes can stay as they are */
+		while (plan[i] > LNODE_MAX - 1) {
+			i++;
+		}
+
+		/* spread this one out over the nodes that follow it */
+		int left = plan[i];
+		do {
+			int size = left + plan[i + 1];
+			if (size > LNODE_MAX) {
+				size = LNODE_MAX;
+			}
+			left = left + plan[i + 1] - size;
+			plan[i] = size;
+			i++;
+		} while (left > 0);
+
+		for (int j = i; j < n - 1; j++) {
+			plan[j] = plan[j + 1];
+		}
+		n--;
+		i--;
+	}
+
+	return n;
+}
+
+/* build a node from the next count slots of all, starting at all[*j] + *off */
+static lnode_t *lnode_gather(lnode_t **all, int *j, int *off, int count)
+{
+	lnode_t *x = NULL;
+	lstore_t *s = NULL;
+
+	if (all[*j]->height) {
+		x = lnode_branch(all[*j]->height);
+	} else {
+		s = lstore_new(count);
+	}
+
+	for (int k = 0; k < count;) {
+		lnode_t *src = all[*j];
+		int take = src->count - *off;
+		if (take > count - k) {
+			take = count - k;
+		}
+
+		for (int i = *off; i < *off + take; i++) {
+			if (s) {
+				s->cell[s->count++] = LREF(lval_copy(LPTR(src->cell[i])));
+				k++;
+			} else {
+				src->child[i]->refs++;
+				lnode_push(x, src->child[i]);
+				k++;
+			}
+		}
+
+		*off += take;
+		if (*off == src->count) {
+			(*j)++;
+			*off = 0;
+		}
+	}
+
+	if (s) {
+		x = lnode_leaf(s, s->cell, count);
+		lstore_release(s);
+	}
+
+	return x;
+}
+
+/*
+static lval_t *builtin(lval_t *a, char *func)
+{
+	if (strcmp(func, "head") == 0) {
+		return builtin_head(a);
+	}
+	if (strcmp(func, "tail") == 0) {
+		return builtin_tail(a);
+	}
+	if (strcmp(func, "list") == 0) {
+		return builtin_list(a);
+	}
+	if (strcmp(func, "eval") == 0) {
+		return builtin_eval(a);
+	}
+	if (strcmp(func, "join") == 0) {
+		return builtin_join(a);
+	}
+	if (strstr("+-/*%", func)) {
+		return builtin_op(a, func);
+	}
+
+	lval_del(a);
+	return lval_err("Unknown function!");
+}
+*/
+
+/*
+ * x op y in *r. If it overflows, *r is what it comes to wrapped around and
+ * these return 0. Division by zero is for the caller to catch.
+ */
+static int larith_add(long x, long y, long *r)
+{
+	return !__builtin_add_overflow(x, y, r);
+}
+
+static int larith_sub(long x, long y, long *r)
+{
+	return !__builtin_sub_overflow(x, y, r);
+}
+
+static int larith_mul(long x, long y, long *r)
+{
+	return !__builtin_mul_overflow(x, y, r);
+}
+
+static int larith_div(long x, long y, long *r)
+{
+	/* the one division that overflows, which would trap */
+	if (x == LONG_MIN && y == -1) {
+		*r = LONG_MIN;
+		return 0;
+	}
+
+	*r = x / y;
+	return 1;
+}
+
+static int larith_mod(long x, long y, long *r)
+{
+	*r = y == -1 ? 0 : x % y;
+	return 1;
+}
+
+/*
+ * Arithmetic went wrong at argument i for reason why, but a non-number in
+ * what's left of a takes precedence, as all of them used to be checked first.
+ */
+static lval_t *larith_err(lval_t *a, int i, const char *why)
+{
+	lval_t *err = NULL;
+
+	for (; i < a->count && !err; i++) {
+		if (LCELL(a, i)->type != LVAL_NUM) {
+			err = lval_err("Cannot operator on non-number! Got %s, Expected %s",
+				       ltype_name(LCELL(a, i)->type), ltype_name(LVAL_NUM));
+		}
+	}
+	lval_del(a);
+
+	return err ? err : lval_err("%s", why);
+}
+
+/*
+ * Each arithmetic builtin is its own function, made from this. fn does the
+ * arithmetic, negate says whether one argument on its own is taken from 0,
+ * zero is the error for dividing by zero if that can happen, and checked
+ * makes overflow an error rather than wrapping around. Two numbers, the
+ * usual case, are done straight away; anything else is checked and folded
+ * in the one pass over the cells.
+ */
+#define LARITH(name, sym, fn, negate, zero, checked)                              \
+	static lval_t *name(lenv_t *e, lval_t *a)                                 \
+	{                                                                         \
+		lref_t *cell = LREFS(a);                                          \
+		lval_t *x, *y;                                                    \
+		long r;                                                           \
+                                                                                  \
+		if (a->count == 2 && (x = LPTR(cell[0]))->type == LVAL_NUM &&     \
+		    (y = LPTR(cell[1]))->type == LVAL_NUM &&                      \
+		    (!(zero) || y->num != 0) &&                                   \
+		    (fn(x->num, y->num, &r) || !(checked))) {                     \
+			lval_del(a);                                              \
+			return lval_num(r);                                       \
+		}                                                                 \
+                                                                                  \
+		if (a->count == 0) {                                              \
+			lval_del(a);                                              \
+			return lval_err("Function '%s' passed no arguments!", sym); \
+		}                                                                 \
+		if ((x = LPTR(cell[0]))->type != LVAL_NUM) {                      \
+			return larith_err(a, 0, NULL);                            \
+		}                                                                 \
+                                                                                  \
+		r = x->num;                                                       \
+		if ((negate) && a->count == 1 && !fn(0, r, &r) && (checked)) {    \
+			return larith_err(a, 1, "Integer overflow!");             \
+		}                                                                 \
+		for (int i = 1; i < a->count; i++) {                              \
+			y = LPTR(cell[i]);                                        \
+			if (y->type != LVAL_NUM) {                                \
+				return larith_err(a, i, NULL);                    \
+			}                                                         \
+			if ((zero) && y->num == 0) {                              \
+				return larith_err(a, i, zero);                    \
+			}                                                         \
+			if (!fn(r, y->num, &r) && (checked)) {                    \
+				return larith_err(a, i, "Integer overflow!");     \
+			}                                                         \
+		}                                                                 \
+                                                                                  \
+		lval_del(a);                                                      \
+		return lval_num(r);                                               \
+	}
+
+static lval_t *builtin_head(lenv_t *e, lval_t *a)
+{
+	LASSERT(a, (a->count == 1), "Function 'head' passed too many arguments! Got %i, Expected %i.", a->count, 1);
+	LASSERT_TYPE(a, "head", LCELL(a, 0)->type, LVAL_QEXPR);
+	LASSERT(a, (LCELL(a, 0)->count != 0), "Function 'head' passed {}!");
+
+	lval_t *v = lval_take(a, 0);
+
+	return lval_slice(v, 0, 1);
+}
+
+static lval_t *builtin_tail(lenv_t *e, lval_t *a)
+{
+	LASSERT(a, (a->count == 1), "Function 'tail' passed too many arguments! Got %i, Expected %i", a->count, 1);
+	LASSERT_TYPE(a, "tail", LCELL(a, 0)->type, LVAL_QEXPR);
+	LASSERT(a, (LCELL(a, 0)->count != 0), "Function 'tail' passed {}!");
+
+	lval_t *v = lval_take(a, 0);
+
+	return lval_slice(v, 1, v->count - 1);
+}
+
+static lval_t *builtin_list(lenv_t *e, lval_t *a)
+{
+	a->type = LVAL_QEXPR;
+
+	return a;
+}
+
+static lval_t *builtin_eval(lenv_t *e, lval_t *a)
+{
+	LASSERT(a, (a->count == 1), "Function 'eval' passed too many arguments! Got %i, Expected %i", a->count, 1);
+	LASSERT_TYPE(a, "eval", LCELL(a, 0)->type, LVAL_QEXPR);
+
+	lval_t *x = lval_eval_cells(e, LCELL(a, 0), 0);
+	lval_del(a);
+
+	return x;
+}
+
+LARITH(builtin_add, "+", larith_add, 0, NULL, 0)
+LARITH(builtin_sub, "-", larith_sub, 1, NULL, 0)
+LARITH(builtin_mul, "*", larith_mul, 0, NULL, 0)
+LARITH(builtin_div, "/", larith_div, 0, "Division by Zero!", 0)
+LARITH(builtin_mod, "%", larith_mod, 0, "Division (mod) by Zero!", 0)
+LARITH(builtin_add_checked, "+!", larith_add, 0, NULL, 1)
+LARITH(builtin_sub_checked, "-!", larith_sub, 1, NULL, 1)
+LARITH(builtin_mul_checked, "*!", larith_mul, 0, NULL, 1)
+LARITH(builtin_div_checked, "/!", larith_div, 0, "Division by Zero!", 1)
+
+static lval_t *builtin_join(lenv_t *e, lval_t *a)
+{
+	for (int i = 0; i < a->count; i++) {
+		LASSERT_TYPE(a, "join", LCELL(a, i)->type, LVAL_QEXPR);
+	}
+
+	lval_t *x = lval_pop(a, 0);
+
+	while (a->count) {
+		x = lval_join(x, lval_pop(a, 0));
+	}
+
+	lval_del(a);
+	return x;
+}
+
+static lval_t *builtin_def(lenv_t *e, lval_t *a)
+{
+	return builtin_var(e, a, "def");
+}
+
+static lval_t *builtin_put(lenv_t *e, lval_t *a)
+{
+	return builtin_var(e, a, "=");
+}
+
+static lval_t *builtin_var(lenv_t *e, lval_t *a, char *func)
+{
+	LASSERT_TYPE(a, "def", LCELL(a, 0)->type, LVAL_QEXPR);
+	lval_t *syms = LCELL(a, 0);
+	lval_unshare(syms);
+
+	for (int i = 0; i < syms->count; i++) {
+		LASSERT_TYPE(a, "def arg0", LCELL(syms, i)->type, LVAL_SYM);
+	}
+
+	LASSERT(a, (syms->count == a->count - 1), "Function 'def' cannot define number of values to symbols");
+
+	lenv_t *to = strcmp(func, "def") == 0 ? lenv_root(e) : e;
+
+	for (int i = 0; i < syms->count; i++) {
+		/* a new binding might hide whatever a symbol cache points at */
+		lsym_t *sym = LCELL(syms, i)->sym;
+		if (to->flags & LENV_GLOBAL ? !lenv_global(to, sym) : lenv_find(to, sym) < 0) {
+			sym->version++;
+		}
+
+		if (strcmp(func, "def") == 0) {
+			lenv_def(e, LCELL(syms, i), LCELL(a, i + 1));
+		}
+		if (strcmp(func, "=") == 0) {
+			lenv_put(e, LCELL(syms, i), LCELL(a, i + 1));
+		}
+	}
+
+	lval_del(a);
+
+	return lval_sexpr();
+}
+
+static lval_t *builtin_lambda(lenv_t *e, lval_t *a)
+{
+	LASSERT(a, (a->count == 2), "Function '\\' passed invalid number of arguments. Got %i, Expected 2", a->count);
+	LASSERT_TYPE(a, "\\", LCELL(a, 0)->type, LVAL_QEXPR);
+	LASSERT_TYPE(a, "\\", LCELL(a, 1)->type, LVAL_QEXPR);
+
+	lval_unshare(LCELL(a, 0));
+	lval_unshare(LCELL(a, 1));
+
+	for (int i = 0; i < LCELL(a, 0)->count; i++) {
+		LASSERT(a, (LCELL(LCELL(a, 0), i)->type == LVAL_SYM),
+			"Cannot define non-symbol. Got %s Expected %s.",
+			ltype_name(LCELL(LCELL(a, 0), i)->type),
+			ltype_name(LVAL_SYM));
+	}
+
+	lval_t *formals = lval_pop(a, 0);
+	lval_t *body = lval_pop(a, 0);
+
+	lval_del(a);
+
+	lval_t *f = lval_lambda(formals, body);
+	lenv_t *env = f->lambda->env;
+
+	if (lenv_root(e)->flags & LENV_DYNAMIC) {
+		env->flags |= LENV_DYNAMIC;
+		return f;
+	}
+
+	struct lscope scope = { formals, lval_locals(body, lval_qexpr()), NULL };
+	struct lcapture c = { e, NULL, 0 };
+
+	lval_resolve(body, &scope, &c);
+	f->lambda->fold = lfold_new(e, f->lambda, &scope, NULL);
+	lval_del(scope.locals);
+
+	/*
+	 * Close over just the values we took from the frames around us, or
+	 * failing that the frame we're being made in, unless that's the
+	 * globals. The captured values go in a frame of their own, sat in
+	 * between if we need both.
+	 */
+	lenv_t *par = NULL;
+	if (c.whole) {
+		par = e;
+		e->refs++;
+	}
+
+	if (c.frame) {
+		c.frame->par = par ? par : lenv_root(e);
+		if (par) {
+			c.frame->flags |= LENV_CLOSURE;
+		}
+		par = c.frame;
+	}
+
+	if (par) {
+		env->par = par;
+		env->flags |= LENV_CLOSURE;
+	}
+
+	llambda_compile(f->lambda, lenv_root(e)->flags);
+
+	return f;
+}
+
+/*
+ * (defmacro {name formals...} {template}) makes a global macro. A call to it
+ * is replaced by the template, with the forms it was given put in for the
+ * formals as they're written, and it's what that comes to that's run. Lambda
+ * bodies have it done once, when they're made or the macro is if that's
+ * later, and again only if the macro is defined as something else.
+ */
+static lval_t *builtin_defmacro(lenv_t *e, lval_t *a)
+{
+	LASSERT(a, (a->count == 2), "Function 'defmacro' passed invalid number of arguments. Got %i, Expected 2", a->count);
+	LASSERT_TYPE(a, "defmacro", LCELL(a, 0)->type, LVAL_QEXPR);
+	LASSERT_TYPE(a, "defmacro", LCELL(a, 1)->type, LVAL_QEXPR);
+	LASSERT(a, (LCELL(a, 0)->count >= 2), "Function 'defmacro' needs a name and at least one formal!");
+
+	lval_unshare(LCELL(a, 0));
+	lval_unshare(LCELL(a, 1));
+
+	for (int i = 0; i < LCELL(a, 0)->count; i++) {
+		lval_t *k = LCELL(LCELL(a, 0), i);
+		LASSERT(a, (k->type == LVAL_SYM),
+			"Cannot define non-symbol. Got %s Expected %s.",
+			ltype_name(k->type),
+			ltype_name(LVAL_SYM));
+		LASSERT(a, (strcmp(LSYM(k), "&") != 0), "Function 'defmacro' can't take '&'!");
+	}
+
+	/* lambdas aren't made ready for what they call as builtins to become macros */
+	lsym_t *name = LCELL(LCELL(a, 0), 0)->sym;
+	lval_t *was = lenv_global(e, name);
+	LASSERT(a, (!was || was->type != LVAL_FUN || !(was->flags & LVAL_BUILTIN)),
+		"Function 'defmacro' can't replace builtin '%s'!", name->name);
+
+	lval_t *formals = lval_pop(a, 0);
+	lval_t *k = lval_pop(formals, 0);
+	lval_t *m = lval_lambda(formals, lval_pop(a, 0));
+	m->lambda->flags |= LLAMBDA_MACRO;
+
+	lval_del(a);
+
+	/* a new binding might hide whatever a symbol cache points at */
+	if (!lenv_global(e, k->sym)) {
+		k->sym->version++;
+	}
+	lenv_def(e, k, m);
+
+	lval_del(k);
+	lval_del(m);
+
+	return lval_sexpr();
+}
+
+/* the body l runs, which is the folded one while that holds */
+static lval_t *llambda_body(llambda_t *l)
+{
+	return l->fold && !l->fold->undone && l->fold->body ? l->fold->body : l->body;
+}
+
+static void llambda_compile(llambda_t *l, int flags)
+{
+	if (flags & LENV_TREE) {
+		/* nothing to do, lval_call() walks the body */
+	} else if (flags & LENV_CLOSURES) {
+		l->expr = lexpr_cells(llambda_body(l), 1);
+	} else {
+		l->code = lcode_body(llambda_body(l));
+	}
+}
+
+/*
+ * Rewrite the symbols in the body v of a lambda that name one of its formals,
+ * or a binding in a frame it closes over, to say which frame up the chain and
+ * which slot in it to find them at. For a lambda made at the top level,
+ * anything else has to be a global and is marked as such. The rest, names
+ * given a value with '=' and ones in frames too big to have fixed slots, are
+ * looked up by name and get a cache to remember where they turned up.
+ */
+static void lval_resolve(lval_t *v, struct lscope *s, struct lcapture *c)
+{
+	if (v->type == LVAL_SYM) {
+		lval_bind(v, s, c);
+		return;
+	}
+
+	if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) {
+		return;
+	}
+
+	lval_unshare(v);
+
+	/* lambdas inside the body bring their own formals into scope */
+	if (lval_is_lambda(v)) {
+		lval_t *body = LCELL(v, 2);
+		struct lscope in = { LCELL(v, 1), lval_locals(body, lval_qexpr()), s };
+
+		lval_resolve(body, &in, c);
+		lval_del(in.locals);
+		return;
+	}
+
+	/*
+	 * The branches of an if are code, but any other quoted arguments are
+	 * data, and might be run somewhere else entirely, so they keep to
+	 * being looked up by name wherever that is. The forms given to a macro
+	 * are taken as code too, it being what it's for.
+	 */
+	int branches = lval_is_if(v);
+	int forms = 0;
+
+	for (int i = 0; i < v->count; i++) {
+		lval_t *x = LCELL(v, i);
+		if (x->type == LVAL_QEXPR && !(branches && i >= 2) && !forms) {
+			lval_quoted(x, s, c);
+		} else {
+			lval_resolve(x, s, c);
+		}
+		if (i == 0) {
+			forms = v->count > 1 && lmacro_global(x);
+		}
+	}
+}
+
+/*
+ * Names in quoted data the body might run are looked up by name in its
+ * frame, so if any is in the frames around it, it has to keep all of them.
+ */
+static void lval_quoted(lval_t *v, struct lscope *s, struct lcapture *c)
+{
+	if (c->whole || !c->env->par) {
+		return;
+	}
+
+	if (v->type == LVAL_SYM) {
+		for (; s; s = s->up) {
+			if (lscope_slot(s, v->sym) != -1) {
+				return;
+			}
+		}
+		for (lenv_t *e = c->env; e->par; e = e->par) {
+			if (lenv_find(e, v->sym) >= 0) {
+				c->whole = 1;
+				return;
+			}
+		}
+		return;
+	}
+
+	if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) {
+		return;
+	}
+
+	struct lcursor cur = { NULL, 0, 0 };
+	for (int i = 0; i < v->count; i++) {
+		lval_quoted(lval_at(v, i, &cur), s, c);
+	}
+}
+
+static void lval_bind(lval_t *v, struct lscope *s, struct lcapture *c)
+{
+	if (v->flags & LVAL_GLOBAL) {
+		return;
+	}
+
+	/* how many lambdas inside the one being made v is */
+	int level = -1;
+	for (struct lscope *t = s; t; t = t->up) {
+		level++;
+	}
+
+	/* already resolved when some lambda around us was made */
+	if (v->flags & LVAL_BOUND) {
+		if (v->depth > level) {
+			lval_capture(v, level, c);
+		}
+		return;
+	}
+	if (v->flags & LVAL_CACHED) {
+		for (; s; s = s->up) {
+			if (lscope_slot(s, v->sym) != -1) {
+				return;
+			}
+		}
+		c->whole |= c->env->par != NULL;
+		return;
+	}
+
+	lsym_t *sym = v->sym;
+	lenv_t *e = c->env;
+	int depth = 0;
+
+	for (; s; s = s->up, depth++) {
+		int slot = lscope_slot(s, sym);
+		if (slot == -2) {
+			lval_cache(v);
+			return;
+		}
+		if (slot >= 0) {
+			lval_bound(v, depth, slot);
+			return;
+		}
+	}
+
+	/* made at the top level, so the only place it can be is the globals */
+	if (!e->par) {
+		v->flags |= LVAL_GLOBAL;
+		return;
+	}
+
+	for (; e->par; e = e->par, depth++) {
+		int slot = lenv_find(e, sym);
+		if (slot >= 0 && e->cap <= LENV_FLAT) {
+			lval_bound(v, depth, slot);
+			lval_capture(v, level, c);
+			return;
+		}
+		if (slot >= 0) {
+			break;
+		}
+	}
+
+	lval_cache(v);
+	c->whole = 1;
+}
+
+/*
+ * v is bound to a slot in one of the frames around the lambda being made, so
+ * copy that binding into the lambda's own captured frame and point v there.
+ * If it isn't where it should be, the lambda will have to keep every frame.
+ */
+static void lval_capture(lval_t *v, int level, struct lcapture *c)
+{
+	lenv_t *f = c->env;
+	for (int d = v->depth - level - 1; d && f; d--) {
+		f = f->par;
+	}
+
+	if (!f || !f->par || f->cap > LENV_FLAT || v->count >= f->count ||
+	    f->syms[v->count] != v->sym) {
+		c->whole = 1;
+		return;
+	}
+
+	if (!c->frame) {
+		c->frame = lenv_frame();
+	}
+
+	int slot = lenv_find(c->frame, v->sym);
+	if (slot < 0) {
+		slot = c->frame->count;
+		lenv_grow(c->frame);
+		lenv_insert(c->frame, v->sym, LREF(lval_copy(LPTR(f->vals[v->count]))));
+	}
+
+	/* past LENV_FLAT it's a table, and has to be looked up by name */
+	if (c->frame->cap > LENV_FLAT) {
+		v->flags &= ~LVAL_BOUND;
+		lval_cache(v);
+		return;
+	}
+
+	v->depth = level + 1;
+	v->count = slot;
+}
+
+/* make v say it lives in slot of the frame depth up */
+static void lval_bound(lval_t *v, int depth, int slot)
+{
+	v->flags |= LVAL_BOUND;
+	v->depth = depth;
+	v->count = slot;
+}
+
+/* give v a cache of its own to remember where it was found */
+static void lval_cache(lval_t *v)
+{
+	lval_uncache(v);
+
+	int i = lcaches.free - 1;
+	if (i >= 0) {
+		lcaches.free = lcaches.site[i].slot;
+	} else {
+		if (lcaches.count == lcaches.cap) {
+			lcaches.cap = lcaches.cap ? 2 * lcaches.cap : 64;
+			lcaches.site = realloc(lcaches.site, sizeof(*lcaches.site) * lcaches.cap);
+		}
+		i = lcaches.count++;
+	}
+
+	struct lcache *c = &lcaches.site[i];
+	c->version = 0;
+	c->depth = -1;
+	c->slot = 0;
+	c->refs = 1;
+	lcaches.live++;
+
+	v->flags |= LVAL_CACHED;
+	v->count = i;
+}
+
+/* let go of v's cache, if it has one, freeing it if nothing else uses it */
+static void lval_uncache(lval_t *v)
+{
+	if (!(v->flags & LVAL_CACHED)) {
+		return;
+	}
+
+	struct lcache *c = &lcaches.site[v->count];
+	if (--c->refs == 0) {
+		c->slot = lcaches.free;
+		lcaches.free = v->count + 1;
+		lcaches.live--;
+	}
+	v->flags &= ~LVAL_CACHED;
+}
+
+/*
+ * Which slot of the frame for s sym will be bound in: formals are bound in
+ * order, skipping '&'. -1 if it isn't bound there at all, -2 if it is but we
+ * can't say where or it may be given a new value with '='.
+ */
+static int lscope_slot(struct lscope *s, lsym_t *sym)
+{
+	int slot = 0;
+	int found = -1;
+
+	for (int i = 0; i < s->formals->count; i++) {
+		lsym_t *f = LCELL(s->formals, i)->sym;
+		if (strcmp(f->name, "&") == 0) {
+			continue;
+		}
+		if (found < 0 && f == sym) {
+			found = slot;
+		}
+		slot++;
+	}
+
+	for (int i = 0; i < s->locals->count; i++) {
+		if (LCELL(s->locals, i)->sym == sym) {
+			return -2;
+		}
+	}
+
+	if (found >= 0) {
+		return slot <= LENV_FLAT ? found : -2;
+	}
+
+	return -1;
+}
+
+/* add the names the body v sets with '=' to locals, leaving out inner lambdas */
+static lval_t *lval_locals(lval_t *v, lval_t *locals)
+{
+	if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) {
+		return locals;
+	}
+
+	if (lval_is_lambda(v)) {
+		return locals;
+	}
+
+	struct lcursor c = { NULL, 0, 0 };
+	lval_t *x = v->count ? lval_at(v, 0, &c) : NULL;
+
+	if (v->count >= 2 && x->type == LVAL_SYM && strcmp(LSYM(x), "=") == 0) {
+		lval_t *syms = lval_at(v, 1, &c);
+		struct lcursor sc = { NULL, 0, 0 };
+
+		for (int i = 0; syms->type == LVAL_QEXPR && i < syms->count; i++) {
+			lval_t *sym = lval_at(syms, i, &sc);
+			if (sym->type == LVAL_SYM) {
+				locals = lval_add(locals, lval_copy(sym));
+			}
+		}
+	}
+
+	for (int i = 0; i < v->count; i++) {
+		locals = lval_locals(lval_at(v, i, &c), locals);
+	}
+
+	return locals;
+}
+
+/* is v of the form (if x {then} {else}), with branches that are code */
+static int lval_is_if(lval_t *v)
+{
+	struct lcursor c = { NULL, 0, 0 };
+
+	if (v->count != 4) {
+		return 0;
+	}
+
+	lval_t *x = lval_at(v, 0, &c);
+	return x->type == LVAL_SYM && strcmp(LSYM(x), "if") == 0 &&
+		lval_at(v, 2, &c)->type == LVAL_QEXPR && lval_at(v, 3, &c)->type == LVAL_QEXPR;
+}
+
+/* is v of the form (\ {formals} {body}) */
+static int lval_is_lambda(lval_t *v)
+{
+	struct lcursor c = { NULL, 0, 0 };
+
+	if (v->count != 3) {
+		return 0;
+	}
+
+	lval_t *x = lval_at(v, 0, &c);
+	if (x->type != LVAL_SYM || strcmp(LSYM(x), "\\") != 0) {
+		return 0;
+	}
+
+	lval_t *formals = lval_at(v, 1, &c);
+	if (formals->type != LVAL_QEXPR || lval_at(v, 2, &c)->type != LVAL_QEXPR) {
+		return 0;
+	}
+
+	struct lcursor fc = { NULL, 0, 0 };
+	for (int i = 0; i < formals->count; i++) {
+		if (lval_at(formals, i, &fc)->type != LVAL_SYM) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* all the lambdas with folded bodies still in force */
+static lfold_t *lfolds;
+
+/*
+ * Fold what can be worked out of the body of l, made in e, ahead of time:
+ * calls to pure builtins on constants, and ifs on them. NULL if nothing can.
+ * Folding again what was, which had macros expanded in it, there's always a
+ * fold, counting on what that did as well, so the macros can come back.
+ */
+static lfold_t *lfold_new(lenv_t *e, llambda_t *l, struct lscope *s, lfold_t *was)
+{
+	struct lfolding f = { e, s, NULL, 0, 0, 0, 0, 0, 0, NULL, 0, 0 };
+	for (int i = 0; was && i < was->count; i++) {
+		lfold_assume(&f, was->sym[i]);
+	}
+
+	lval_t *body = lfold_body(&f, lval_copy(l->body));
+
+	if (!f.changed && !was) {
+		lval_del(body);
+		body = NULL;
+
+		if (!f.ncalls) {
+			free(f.sym);
+			return NULL;
+		}
+	}
+
+	lfold_t *x = malloc(sizeof(*x));
+	lstats_add(sizeof(*x));
+
+	x->body = body;
+	x->lambda = l;
+	x->sym = f.sym;
+	x->count = f.count;
+	x->calls = f.calls;
+	x->ncalls = f.ncalls;
+	x->undone = 0;
+	x->macros = f.macros ? f.macros : was ? was->macros : 0;
+	x->code = NULL;
+	x->expr = NULL;
+	x->was = was;
+	x->root = lroot;
+
+	for (int i = 0; i < x->count; i++) {
+		x->sym[i]->folds++;
+	}
+	for (int i = 0; i < x->ncalls; i++) {
+		x->calls[i]->folds++;
+	}
+
+	x->prev = NULL;
+	x->next = lfolds;
+	if (lfolds) {
+		lfolds->prev = x;
+	}
+	lfolds = x;
+
+	return x;
+}
+
+/* stop x counting on its globals */
+static void lfold_unlink(lfold_t *x)
+{
+	for (int i = 0; i < x->count; i++) {
+		x->sym[i]->folds--;
+	}
+	for (int i = 0; i < x->ncalls; i++) {
+		x->calls[i]->folds--;
+	}
+
+	if (x->prev) {
+		x->prev->next = x->next;
+	} else {
+		lfolds = x->next;
+	}
+	if (x->next) {
+		x->next->prev = x->prev;
+	}
+
+	x->undone = 1;
+}
+
+static void lfold_del(lfold_t *x)
+{
+	if (!x->undone) {
+		lfold_unlink(x);
+	}
+
+	if (x->body) {
+		lval_del(x->body);
+	}
+	if (x->code) {
+		lcode_del(x->code);
+	}
+	if (x->expr) {
+		lexpr_del(x->expr);
+	}
+	if (x->was) {
+		lfold_del(x->was);
+	}
+	free(x->sym);
+	free(x->calls);
+
+	lstats_add(-(long)sizeof(*x));
+	free(x);
+}
+
+/*
+ * sym is being bound to something else, so every lambda folded on the
+ * grounds of what it was goes back to its body as written, or if it had
+ * macros expanded in it, is folded again with sym as it is now. So are the
+ * ones that call sym, if it's now a macro to expand in them. Calls to them
+ * already under way finish as they started.
+ */
+static void lfold_undo(lenv_t *e, lsym_t *sym)
+{
+	int flags = lenv_root(e)->flags;
+	lenv_t *root = lenv_root(e);
+	lval_t *m = lenv_global(root, sym);
+	int macro = m && lval_is_macro(m);
+
+	for (lfold_t *x = lfolds, *next; x; x = next) {
+		next = x->next;
+
+		/* other interpreters have globals of their own */
+		if (x->root != root) {
+			continue;
+		}
+
+		int expand = macro && lfold_calls(x, sym);
+		if (!expand && !lfold_counts(x, sym)) {
+			continue;
+		}
+
+		llambda_t *l = x->lambda;
+		lfold_unlink(x);
+
+		x->code = l->code;
+		x->expr = l->expr;
+		l->code = NULL;
+		l->expr = NULL;
+		ljit_free(l->jit);
+		l->jit = NULL;
+		l->calls = 0;
+
+		/* the frames it was made in are still around it */
+		if (x->macros || expand) {
+			struct lscope s = { l->formals, lval_locals(l->body, lval_qexpr()), NULL };
+			l->fold = lfold_new(l->env, l, &s, x);
+			lval_del(s.locals);
+		}
+
+		llambda_compile(l, flags);
+	}
+}
+
+/* does x count on sym staying what it is */
+static int lfold_counts(lfold_t *x, lsym_t *sym)
+{
+	for (int i = 0; i < x->count; i++) {
+		if (x->sym[i] == sym) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* does x call sym, which it would have expanded had it been a macro */
+static int lfold_calls(lfold_t *x, lsym_t *sym)
+{
+	for (int i = 0; i < x->ncalls; i++) {
+		if (x->calls[i] == sym) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* fold a quoted body, which stays one */
+static lval_t *lfold_body(struct lfolding *f, lval_t *v)
+{
+	lval_t *x = lfold_cells(f, v);
+
+	if (x->type == LVAL_SEXPR) {
+		x->type = LVAL_QEXPR;
+		return x;
+	}
+
+	return lval_add(lval_qexpr(), x);
+}
+
+/*
+ * Fold the cells of v, taking it, into an expression that comes to the
+ * same as lval_eval_cells() would make of them.
+ */
+static lval_t *lfold_cells(struct lfolding *f, lval_t *v)
+{
+	/* a lone cell is just its value */
+	if (v->count == 1) {
+		return lfold_expr(f, lval_take(v, 0));
+	}
+
+	v->type = LVAL_SEXPR;
+	if (v->count == 0 || lval_is_lambda(v)) {
+		return v;
+	}
+
+	lval_unshare(v);
+	lref_t *cell = LREFS(v);
+
+	cell[0] = LREF(lfold_expr(f, LPTR(cell[0])));
+
+	/* a call to a macro is what it expands to, which gets folded in turn */
+	lval_t *m = lfold_macro(f, v);
+	if (m && f->macros == LMACRO_MAX) {
+		lfold_assume(f, LPTR(cell[0])->sym);
+		lval_del(v);
+		return lval_err("Macro expanded too many times!");
+	}
+	if (m) {
+		lfold_assume(f, LPTR(cell[0])->sym);
+		f->changed = 1;
+		f->macros++;
+		lstats.expanded++;
+		int gen;
+		lval_t *x = lmacro_expand(m, v, &gen);
+		lmacro_enter(m->lambda, gen);
+		x = lfold_cells(f, x);
+		lmacro_leave();
+		return x;
+	}
+	lfold_watch(f, LPTR(cell[0]));
+
+	lbuiltin_t op = lfold_builtin(f, LPTR(cell[0]));
+
+	/* the branches of an if are code, unlike any other quoted arguments */
+	if (op == builtin_if && v->count == 4 &&
+	    LPTR(cell[2])->type == LVAL_QEXPR && LPTR(cell[3])->type == LVAL_QEXPR) {
+		lfold_assume(f, LPTR(cell[0])->sym);
+		cell[1] = LREF(lfold_expr(f, LPTR(cell[1])));
+
+		if (LPTR(cell[1])->type == LVAL_NUM) {
+			f->changed = 1;
+			return lfold_cells(f, lval_take(v, LPTR(cell[1])->num ? 2 : 3));
+		}
+
+		cell[2] = LREF(lfold_body(f, LPTR(cell[2])));
+		cell[3] = LREF(lfold_body(f, LPTR(cell[3])));
+		return v;
+	}
+
+	int known = 0;
+	for (int i = 1; i < v->count; i++) {
+		cell[i] = LREF(lfold_expr(f, LPTR(cell[i])));
+		known += LPTR(cell[i])->type == LVAL_NUM || LPTR(cell[i])->type == LVAL_QEXPR;
+	}
+
+	if (!op) {
+		return lfold_inline(f, v);
+	}
+	if (!lfold_pure(op)) {
+		return v;
+	}
+	if (known < v->count - 1) {
+		return lfold_partial(f, v, op);
+	}
+
+	lval_t *a = lval_sexpr();
+	lval_reserve(a, v->count - 1);
+	for (int i = 1; i < v->count; i++) {
+		a = lval_add(a, lval_copy(LPTR(cell[i])));
+	}
+
+	/* errors are left to happen when the body's run, as they would have */
+	lval_t *r = op(f->env, a);
+	if (r->type != LVAL_NUM && r->type != LVAL_QEXPR) {
+		lval_del(r);
+		return v;
+	}
+
+	lfold_assume(f, LPTR(cell[0])->sym);
+	f->changed = 1;
+	lval_del(v);
+
+	return r;
+}
+
+static lval_t *lfold_expr(struct lfolding *f, lval_t *v)
+{
+	return v->type == LVAL_SEXPR ? lfold_cells(f, v) : v;
+}
+
+/*
+ * Add up the numbers given to + or *, or taken away by -, when there's more
+ * than one but not everything is known. Arithmetic that wraps around comes
+ * out the same in any order, and numbers can't be what it goes wrong on.
+ */
+static lval_t *lfold_partial(struct lfolding *f, lval_t *v, lbuiltin_t op)
+{
+	if (op != builtin_add && op != builtin_sub && op != builtin_mul) {
+		return v;
+	}
+
+	int (*fn)(long, long, long *) = op == builtin_mul ? larith_mul : larith_add;
+	int first = op == builtin_sub ? 2 : 1;
+	int at = first;
+
+	while (at < v->count && LCELL(v, at)->type != LVAL_NUM) {
+		at++;
+	}
+	if (at == v->count) {
+		return v;
+	}
+
+	/* the others all go into the first of them */
+	lval_t *into = LCELL(v, at);
+	int n = 0;
+
+	for (int i = v->count - 1; i > at; i--) {
+		lval_t *x = LCELL(v, i);
+		if (x->type == LVAL_NUM) {
+			fn(into->num, x->num, &into->num);
+			lval_del(lval_pop(v, i));
+			n++;
+		}
+	}
+	if (!n) {
+		return v;
+	}
+
+	lfold_assume(f, LCELL(v, 0)->sym);
+	f->changed = 1;
+
+	return v;
+}
+
+/*
+ * What k will be when the body runs as long as the global stays put, or NULL
+ * if it isn't bound, or might be bound to something else first by the lambda
+ * or the frames it's being made in.
+ */
+static lval_t *lfold_global(struct lfolding *f, lval_t *k)
+{
+	lsym_t *sym = lfold_name(f, k);
+
+	return sym ? lglobal(sym) : NULL;
+}
+
+/*
+ * The global k names wherever the body runs, bound or not, or NULL if it
+ * could be something in the lambda or the frames it's being made in. Names
+ * that weren't resolved, having been quoted, are looked up as cached ones are.
+ */
+static lsym_t *lfold_name(struct lfolding *f, lval_t *k)
+{
+	if (k->type != LVAL_SYM || (k->flags & LVAL_BOUND)) {
+		return NULL;
+	}
+
+	lsym_t *sym = k->sym;
+	if (!(k->flags & LVAL_GLOBAL)) {
+		if (lscope_slot(f->scope, sym) != -1) {
+			return NULL;
+		}
+		for (lenv_t *e = f->env; e->par; e = e->par) {
+			if (lenv_find(e, sym) >= 0) {
+				return NULL;
+			}
+		}
+	}
+
+	return sym;
+}
+
+/*
+ * v calls k, which isn't a macro that can be expanded now, but if it's a
+ * global that becomes one, the body is folded again to expand it then, as
+ * the tree walker would. Builtins are left be, being called everywhere.
+ */
+static void lfold_watch(struct lfolding *f, lval_t *k)
+{
+	lsym_t *sym = lfold_name(f, k);
+	if (!sym) {
+		return;
+	}
+
+	lval_t *v = lglobal(sym);
+	if (v && v->type == LVAL_FUN && (v->flags & LVAL_BUILTIN)) {
+		return;
+	}
+
+	for (int i = 0; i < f->ncalls; i++) {
+		if (f->calls[i] == sym) {
+			return;
+		}
+	}
+
+	if (f->ncalls == f->calls_cap) {
+		f->calls_cap = f->calls_cap ? 2 * f->calls_cap : 4;
+		f->calls = realloc(f->calls, sizeof(*f->calls) * f->calls_cap);
+	}
+	f->calls[f->ncalls++] = sym;
+}
+
+static lbuiltin_t lfold_builtin(struct lfolding *f, lval_t *k)
+{
+	lval_t *v = lfold_global(f, k);
+	if (!v || v->type != LVAL_FUN || (v->flags & (LVAL_BUILTIN | LVAL_PARTIAL)) != LVAL_BUILTIN) {
+		return NULL;
+	}
+
+	return v->builtin;
+}
+
+/* builtins that always give the same answer for the same arguments */
+static int lfold_pure(lbuiltin_t op)
+{
+	return op == builtin_add || op == builtin_sub || op == builtin_mul ||
+		op == builtin_div || op == builtin_mod || op == builtin_eq ||
+		op == builtin_ne || op == builtin_gt || op == builtin_lt ||
+		op == builtin_ge || op == builtin_le || op == builtin_list ||
+		op == builtin_head || op == builtin_tail || op == builtin_join;
+}
+
+static void lfold_assume(struct lfolding *f, lsym_t *sym)
+{
+	for (int i = 0; i < f->count; i++) {
+		if (f->sym[i] == sym) {
+			return;
+		}
+	}
+
+	if (f->count == f->cap) {
+		f->cap = f->cap ? 2 * f->cap : 4;
+		f->sym = realloc(f->sym, sizeof(*f->sym) * f->cap);
+	}
+	f->sym[f->count++] = sym;
+}
+
+/* the macro v calls, if it's one that can be expanded in the body now */
+static lval_t *lfold_macro(struct lfolding *f, lval_t *v)
+{
+	lval_t *m = lfold_global(f, LCELL(v, 0));
+	if (!m || !lval_is_macro(m) || !lmacro_fits(m, v)) {
+		return NULL;
+	}
+
+	return m;
+}
+
+/*
+ * Put the body of the global lambda v calls in place of the call, if it's
+ * small, doesn't call itself and comes to just the same with the arguments
+ * put in for its formals: each still worked out once, in the same order,
+ * before anything else happens. Plain ones can go in anywhere.
+ */
+static lval_t *lfold_inline(struct lfolding *f, lval_t *v)
+{
+	lval_t *k = LCELL(v, 0);
+	lval_t *fn = lfold_global(f, k);
+	int n = v->count - 1;
+
+	if (!fn || fn->type != LVAL_FUN || (fn->flags & (LVAL_BUILTIN | LVAL_PARTIAL)) ||
+	    (fn->lambda->flags & LLAMBDA_VARARGS) || f->depth == LINLINE_DEPTH || n > LINLINE_ARGS) {
+		return v;
+	}
+
+	/* what goes in for one that used macros is what they expanded to */
+	llambda_t *l = fn->lambda;
+	lfold_t *used = l->fold && !l->fold->undone && l->fold->macros ? l->fold : NULL;
+	lval_t *from = used ? used->body : l->body;
+
+	int cells = linline_size(from, LINLINE_CELLS);
+	if (l->formals->count != n || l->env->count ||
+	    cells > LINLINE_CELLS || f->grown + cells > LINLINE_GROWN) {
+		return v;
+	}
+
+	struct linline in = { f, l, k->sym, v, { 0 }, 0, 0, 1 };
+	lval_t *body = linline_form(&in, lval_copy(from), 1);
+
+	for (int i = 0; i < n && in.ok; i++) {
+		in.ok = linline_plain(LCELL(v, i + 1)) || in.uses[i] == 1;
+	}
+
+	if (!in.ok) {
+		lval_del(body);
+		return v;
+	}
+
+	for (int i = 0; used && i < used->count; i++) {
+		lfold_assume(f, used->sym[i]);
+	}
+	lfold_assume(f, k->sym);
+	f->changed = 1;
+	f->grown += cells;
+	lval_del(v);
+
+	f->depth++;
+	lval_t *x = lfold_cells(f, body);
+	f->depth--;
+
+	return x;
+}
+
+/* cells in v, counting those in lists inside it, or something over max */
+static int linline_size(lval_t *v, int max)
+{
+	struct lcursor c = { NULL, 0, 0 };
+	int n = 1;
+
+	if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) {
+		return n;
+	}
+
+	for (int i = 0; i < v->count && n <= max; i++) {
+		n += linline_size(lval_at(v, i, &c), max - n);
+	}
+
+	return n;
+}
+
+/* an argument that can be worked out any number of times and never go wrong */
+static int linline_plain(lval_t *v)
+{
+	return v->type == LVAL_NUM || v->type == LVAL_QEXPR ||
+		(v->type == LVAL_SYM && (v->flags & LVAL_BOUND));
+}
+
+/*
+ * Put the arguments in for the formals in the cells of v. how is 1 if
+ * they're run there and then as a call, 2 if they're the branch of an if that
+ * might be, and 0 if they're only data, which comes out the same either way.
+ */
+static lval_t *linline_form(struct linline *in, lval_t *v, int how)
+{
+	if (!how) {
+		return v;
+	}
+
+	lval_unshare(v);
+	lref_t *cell = LREFS(v);
+	int branches = 0;
+
+	/*
+	 * Calls have to be to globals, and not to builtins that do something
+	 * with the frame they're called in, which is about to be a different one,
+	 * or to macros, which don't work out their arguments the way calls do.
+	 */
+	if (v->count > 1) {
+		lval_t *k = LPTR(cell[0]);
+		lval_t *fn = lfold_global(in->f, k);
+		lbuiltin_t op = fn && fn->type == LVAL_FUN && (fn->flags & LVAL_BUILTIN) ? fn->builtin : NULL;
+
+		branches = op == builtin_if && v->count == 4 &&
+			LPTR(cell[2])->type == LVAL_QEXPR && LPTR(cell[3])->type == LVAL_QEXPR;
+
+		if (!fn || fn->type != LVAL_FUN || lval_is_macro(fn) || op == builtin_eval ||
+		    op == builtin_put || op == builtin_lambda || (op == builtin_if && !branches)) {
+			in->ok = 0;
+			return v;
+		}
+		lfold_assume(in->f, k->sym);
+	}
+
+	for (int i = 0; i < v->count && in->ok; i++) {
+		lval_t *x = LPTR(cell[i]);
+		int h = branches && i >= 2 ? 2 : x->type == LVAL_QEXPR ? 0 : how;
+
+		if (x->type == LVAL_SEXPR || x->type == LVAL_QEXPR) {
+			cell[i] = LREF(linline_form(in, x, h));
+		} else {
+			cell[i] = LREF(linline_sym(in, x, h));
+		}
+	}
+
+	if (how == 1 && v->count > 1) {
+		in->called = 1;
+	}
+
+	return v;
+}
+
+static lval_t *linline_sym(struct linline *in, lval_t *v, int how)
+{
+	if (v->type != LVAL_SYM) {
+		return v;
+	}
+
+	/* other names have to be the same global from both places */
+	lsym_t *sym = v->sym;
+	if (v->flags & (LVAL_GLOBAL | LVAL_CACHED)) {
+		in->ok &= sym != in->self && lfold_global(in->f, v) != NULL;
+
+		if (v->flags & LVAL_CACHED) {
+			for (lenv_t *e = in->l->env->par; e && e->par; e = e->par) {
+				in->ok &= lenv_find(e, sym) < 0;
+			}
+			lfold_assume(in->f, sym);
+			lval_cache(v);
+		}
+		return v;
+	}
+
+	int i = v->count;
+	if (!(v->flags & LVAL_BOUND) || v->depth || i >= in->l->formals->count ||
+	    LCELL(in->l->formals, i)->sym != sym) {
+		in->ok = 0;
+		return v;
+	}
+
+	lval_t *a = LCELL(in->call, i + 1);
+	in->uses[i]++;
+
+	if (!linline_plain(a)) {
+		in->ok &= how == 1 && !in->called && in->uses[i] == 1;
+		for (int j = in->next; j < i; j++) {
+			in->ok &= linline_plain(LCELL(in->call, j + 1)) || in->uses[j];
+		}
+		in->next = i + 1;
+	}
+
+	lval_del(v);
+	return lval_copy(a);
+}
+
+/* the macro the global k names, if it does */
+static lval_t *lmacro_global(lval_t *k)
+{
+	lval_t *m;
+	if (k->type != LVAL_SYM || (k->flags & LVAL_BOUND) || !(m = lglobal(k->sym))) {
+		return NULL;
+	}
+
+	return lval_is_macro(m) ? m : NULL;
+}
+
+/* does the call v give the macro m as many forms as it takes */
+static int lmacro_fits(lval_t *m, lval_t *v)
+{
+	return v->count - 1 == m->lambda->formals->count;
+}
+
+/* where sym is in the list of symbols l, or -1 */
+static int lmacro_find(lval_t *l, lsym_t *sym)
+{
+	struct lcursor c = { NULL, 0, 0 };
+
+	for (int i = 0; i < l->count; i++) {
+		if (lval_at(l, i, &c)->sym == sym) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * What the call v to the macro m expands to, taking v: the template, with
+ * the forms v gives put in for the formals as they are, and fresh names in
+ * for the ones it binds so that neither can get hold of the other's. The
+ * rest of the template's names are globals, whatever's in scope where it's
+ * expanded. gen is set to the generation of fresh names it was given, for
+ * lmacro_enter() while what it expanded to is expanded or run in turn.
+ */
+static lval_t *lmacro_expand(lval_t *m, lval_t *v, int *gen)
+{
+	llambda_t *l = m->lambda;
+	struct lexpand x = { l->formals, v, lval_qexpr(), NULL };
+
+	lmacro_binds(&x, l->body);
+	x.fresh = lmacro_fresh(l, x.binds, v, gen);
+	lval_t *r = lmacro_form(&x, lval_copy(l->body), 0, 1);
+	r->type = LVAL_SEXPR;
+
+	lval_del(x.binds);
+	lval_del(v);
+
+	return r;
+}
+
+/* find the names the template v binds, with '\' or '=' */
+static void lmacro_binds(struct lexpand *x, lval_t *v)
+{
+	if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) {
+		return;
+	}
+
+	struct lcursor c = { NULL, 0, 0 };
+	lval_t *k = v->count >= 2 ? lval_at(v, 0, &c) : NULL;
+
+	if (lval_is_lambda(v) || (k && k->type == LVAL_SYM && strcmp(LSYM(k), "=") == 0)) {
+		lval_t *syms = lval_at(v, 1, &c);
+		struct lcursor sc = { NULL, 0, 0 };
+
+		for (int i = 0; syms->type == LVAL_QEXPR && i < syms->count; i++) {
+			lmacro_bind(x, lval_at(syms, i, &sc));
+		}
+	}
+
+	for (int i = 0; i < v->count; i++) {
+		lmacro_binds(x, lval_at(v, i, &c));
+	}
+}
+
+static void lmacro_bind(struct lexpand *x, lval_t *k)
+{
+	if (k->type != LVAL_SYM || strcmp(LSYM(k), "&") == 0 ||
+	    lmacro_find(x->formals, k->sym) >= 0 || lmacro_find(x->binds, k->sym) >= 0) {
+		return;
+	}
+
+	x->binds = lval_add(x->binds, lval_sym(LSYM(k)));
+}
+
+/* counts up to give each name a template binds a fresh one */
+static unsigned lmacro_names;
+
+/* the expansions under way, each with the generation of names it was given */
+static struct {
+	struct lmacro_gen {
+		llambda_t *l;
+		int gen;
+	} *at;
+	int count;
+	int cap;
+} lmacro_active;
+
+/*
+ * The fresh names for binds in the call v to the macro l, which stay l's.
+ * Symbols are never freed, so rather than new ones for every expansion
+ * each macro keeps generations of them, and v gets the first that no
+ * expansion of l it's inside of was given and that v doesn't use. Those
+ * are the only ways a name it binds could catch one it oughtn't.
+ */
+static lval_t *lmacro_fresh(llambda_t *l, lval_t *binds, lval_t *v, int *gen)
+{
+	struct lcursor c = { NULL, 0, 0 };
+
+	if (!l->fresh) {
+		l->fresh = lval_qexpr();
+	}
+
+	for (*gen = 0; *gen < l->fresh->count; (*gen)++) {
+		lval_t *names = lval_at(l->fresh, *gen, &c);
+		int taken = 0;
+		for (int i = 0; binds->count && i < lmacro_active.count; i++) {
+			taken |= lmacro_active.at[i].l == l && lmacro_active.at[i].gen == *gen;
+		}
+		if (!taken && !lmacro_uses(v, names)) {
+			return names;
+		}
+	}
+
+	/* '~' can't be read, so nothing written can name these */
+	lval_t *names = lval_qexpr();
+	for (int i = 0; i < binds->count; i++) {
+		const char *k = LSYM(lval_at(binds, i, &c));
+		char *name = malloc(strlen(k) + 16);
+		sprintf(name, "%s~%u", k, ++lmacro_names);
+		names = lval_add(names, lval_sym(name));
+		free(name);
+	}
+	l->fresh = lval_add(l->fresh, names);
+
+	return names;
+}
+
+/* does v have any of names in it */
+static int lmacro_uses(lval_t *v, lval_t *names)
+{
+	if (v->type == LVAL_SYM) {
+		return lmacro_find(names, v->sym) >= 0;
+	}
+	if (!names->count || (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR)) {
+		return 0;
+	}
+
+	struct lcursor c = { NULL, 0, 0 };
+	for (int i = 0; i < v->count; i++) {
+		if (lmacro_uses(lval_at(v, i, &c), names)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* while what an expansion of l given gen comes to is being expanded or run */
+static void lmacro_enter(llambda_t *l, int gen)
+{
+	if (lmacro_active.count == lmacro_active.cap) {
+		lmacro_active.cap = lmacro_active.cap ? 2 * lmacro_active.cap : 16;
+		lmacro_active.at = realloc(lmacro_active.at, sizeof(*lmacro_active.at) * lmacro_active.cap);
+	}
+
+	lmacro_active.at[lmacro_active.count].l = l;
+	lmacro_active.at[lmacro_active.count++].gen = gen;
+}
+
+static void lmacro_leave(void)
+{
+	lmacro_active.count--;
+}
+
+/*
+ * The macro f, if the head of a call k evaluated to it because it's the
+ * global k names. Macros are only ever expanded where they're called by
+ * name, as that's all the compilers can see; anything else going through
+ * a value is an error whichever way it's run.
+ */
+static lval_t *lmacro_named(lval_t *k, lval_t *f)
+{
+	lval_t *m = lmacro_global(k);
+
+	return m && lval_is_macro(f) && m->lambda == f->lambda ? m : NULL;
+}
+
+/*
+ * Put the forms given for the formals, and the fresh names, into v, which
+ * is some of a copy of the template. level is how many of the template's own
+ * lambdas v is inside, and code whether v is code rather than quoted data.
+ */
+static lval_t *lmacro_form(struct lexpand *x, lval_t *v, int level, int code)
+{
+	struct lcursor c = { NULL, 0, 0 };
+
+	if (v->type == LVAL_SYM) {
+		int i = lmacro_find(x->formals, v->sym);
+		if (i >= 0) {
+			lval_t *a = lval_copy(lval_at(x->call, i + 1, &c));
+			lmacro_shift(a, level, 0);
+			lval_del(v);
+			return a;
+		}
+
+		i = lmacro_find(x->binds, v->sym);
+		if (i >= 0) {
+			lval_del(v);
+			return lval_copy(lval_at(x->fresh, i, &c));
+		}
+
+		/* quoted names mean whatever they do where they're run */
+		if (code) {
+			lval_uncache(v);
+			v->flags = (v->flags & ~LVAL_BOUND) | LVAL_GLOBAL;
+		}
+		return v;
+	}
+
+	if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) {
+		return v;
+	}
+
+	/*
+	 * The body of a lambda might be one of the forms that's yet to go in.
+	 * Quoted cells are code as lval_resolve() has them: that body, the
+	 * branches of an if, and the forms given to a macro.
+	 */
+	lval_t *k = v->count ? lval_at(v, 0, &c) : NULL;
+	int inner = v->count == 3 && k->type == LVAL_SYM && strcmp(LSYM(k), "\\") == 0;
+	int branches = lval_is_if(v);
+	int forms = v->count > 1 && lmacro_global(k);
+	lval_unshare(v);
+
+	for (int i = 0; i < v->count; i++) {
+		lval_t *y = LCELL(v, i);
+		int run = code && (y->type != LVAL_QEXPR || (inner && i == 2) ||
+				   (branches && i >= 2) || (forms && i >= 1));
+		LREFS(v)[i] = LREF(lmacro_form(x, y, inner && i == 2 ? level + 1 : level, run));
+	}
+
+	return v;
+}
+
+/*
+ * v, a form given to a macro, has ended up by more lambdas deep than where
+ * it was written, so what it refers to in frames outside level is that many
+ * more frames out. Symbols looked up by name get caches of their own.
+ */
+static void lmacro_shift(lval_t *v, int by, int level)
+{
+	if (v->type == LVAL_SYM) {
+		if ((v->flags & LVAL_BOUND) && v->depth >= level) {
+			v->depth += by;
+		}
+		if (v->flags & LVAL_CACHED) {
+			lval_cache(v);
+		}
+		return;
+	}
+
+	if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) {
+		return;
+	}
+
+	int inner = lval_is_lambda(v);
+	lval_unshare(v);
+
+	for (int i = 0; i < v->count; i++) {
+		lmacro_shift(LCELL(v, i), by, inner && i == 2 ? level + 1 : level);
+	}
+}
+
+/*
+ * Expand the macros in a top level form v, taken as code, before it's run.
+ * The bodies of lambdas in it are left for lfold_new() to expand once
+ * they're made, so they can be again if need be; n counts the expansions.
+ */
+static lval_t *lmacro_top(lval_t *v, int *n)
+{
+	if (!v->count || lval_is_lambda(v)) {
+		return v;
+	}
+
+	lval_unshare(v);
+
+	lval_t *m = lmacro_global(LCELL(v, 0));
+	if (m && lmacro_fits(m, v)) {
+		/* one that keeps expanding to more is stopped the same way however it's run */
+		if (*n == LMACRO_MAX) {
+			lval_del(v);
+			return lval_err("Macro expanded too many times!");
+		}
+
+		int type = v->type;
+		int gen;
+		lval_t *x = lmacro_expand(m, v, &gen);
+		x->type = type;
+
+		(*n)++;
+		lstats.expanded++;
+		lmacro_enter(m->lambda, gen);
+		x = lmacro_top(x, n);
+		lmacro_leave();
+		return x;
+	}
+
+	/* the branches of an if are code too */
+	lval_t *k = LCELL(v, 0);
+	lval_t *f = k->type == LVAL_SYM ? lglobal(k->sym) : NULL;
+	int branches = v->count == 4 && f && f->type == LVAL_FUN && (f->flags & LVAL_BUILTIN) &&
+		f->builtin == builtin_if;
+
+	for (int i = 0; i < v->count; i++) {
+		lval_t *x = LCELL(v, i);
+		if (x->type == LVAL_SEXPR || (branches && i >= 2 && x->type == LVAL_QEXPR)) {
+			LREFS(v)[i] = LREF(lmacro_top(x, n));
+		}
+	}
+
+	return v;
+}
+
+/*
+ * Run the call v to the macro m, taking v, by expanding it there and then.
+ * That's left to happen for code that's run without having been made into a
+ * lambda or a top level form first, like what's given to eval.
+ */
+static lval_t *lmacro_eval(lenv_t *e, lval_t *m, lval_t *v, int tail)
+{
+	if (!lmacro_fits(m, v)) {
+		lval_t *err = lval_err("Macro passed wrong number of arguments. Got %i, Expected %i.",
+			v->count - 1, m->lambda->formals->count);
+		lval_del(v);
+		return err;
+	}
+	if (lmacro_active.count >= LMACRO_MAX) {
+		lval_del(v);
+		return lval_err("Macro expanded too many times!");
+	}
+
+	lstats.expanded_late++;
+	int gen;
+	lval_t *x = lmacro_expand(m, v, &gen);
+	lmacro_enter(m->lambda, gen);
+	lval_t *r = lval_eval_cells(e, x, tail);
+	lmacro_leave();
+	lval_del(x);
+
+	return r;
+}
+
+
+/* the comparisons, like the arithmetic, are a function each */
+#define LORD(name, sym, cmp)                                                      \
+	static lval_t *name(lenv_t *e, lval_t *a)                                 \
+	{                                                                         \
+		LASSERT(a, a->count == 2, "Function '%s' wrong number of arguments. Got %i, Expected %i.", sym, a->count, 2); \
+		LASSERT_TYPE(a, sym, LCELL(a, 0)->type, LVAL_NUM);                \
+		LASSERT_TYPE(a, sym, LCELL(a, 1)->type, LVAL_NUM);                \
+                                                                                  \
+		int r = LCELL(a, 0)->num cmp LCELL(a, 1)->num;                    \
+		lval_del(a);                                                      \
+                                                                                  \
+		return lval_num(r);                                               \
+	}
+
+LORD(builtin_gt, ">", >)
+LORD(builtin_lt, "<", <)
+LORD(builtin_ge, ">=", >=)
+LORD(builtin_le, "<=", <=)
+
+/* anything can be compared for equality, though numbers needn't go to lval_eq() */
+#define LEQ(name, sym, want)                                                      \
+	static lval_t *name(lenv_t *e, lval_t *a)                                 \
+	{                                                                         \
+		LASSERT(a, a->count == 2, "Function '%s' wrong number of arguments. Got %d, Expected 2", sym, a->count); \
+                                                                                  \
+		lval_t *x = LCELL(a, 0);                                          \
+		lval_t *y = LCELL(a, 1);                                          \
+		int r = x->type == LVAL_NUM && y->type == LVAL_NUM ?              \
+			x->num == y->num : lval_eq(x, y);                         \
+		lval_del(a);                                                      \
+                                                                                  \
+		return lval_num(r == (want));                                     \
+	}
+
+LEQ(builtin_eq, "==", 1)
+LEQ(builtin_ne, "!=", 0)
+
+static lval_t *builtin_if(lenv_t *e, lval_t *a)
+{
+	LASSERT(a, a->count == 3, "Function 'if' got wrong number of arguments. Got %i, Expected 3.", a->count);
+
+	LASSERT_TYPE(a, "if", LCELL(a, 0)->type, LVAL_NUM);
+	LASSERT_TYPE(a, "if", LCELL(a, 1)->type, LVAL_QEXPR);
+	LASSERT_TYPE(a, "if", LCELL(a, 2)->type, LVAL_QEXPR);
+
+	lval_t *x = lval_eval_cells(e, LCELL(a, LCELL(a, 0)->num ? 1 : 2), 0);
+	lval_del(a);
+
+	return x;
+}
+
+static lval_t *lval_join(lval_t *x, lval_t *y)
+{
+	if (!x->count) {
+		lval_del(x);
+		return y;
+	}
+
+	/* past a leaf's worth of cells, join by concatenating trees */
+	if (y->count && x->count + y->count > LNODE_MAX) {
+		lnode_t *l = lnode_from(x);
+		lnode_t *r = lnode_from(y);
+		lnode_t *n = lnode_concat(l, r);
+
+		lnode_release(l);
+		lnode_release(r);
+
+		if (x->tree) {
+			lnode_release(x->tree);
+		} else {
+			lstore_release(x->store);
+		}
+		x->tree = n;
+		x->cell = NULL;
+		x->store = NULL;
+		x->count += y->count;
+
+		lval_del(y);
+		return x;
+	}
+
+	int n = y->count;
+	if (n) {
+		lval_reserve(x, x->count + n);
+		lref_t *to = &LREFS(x)[x->count];
+
+		if (y->flags & LVAL_INLINE) {
+			memcpy(to, y->small, sizeof(*y->small) * n);
+			y->count = 0;
+		} else if (y->store->refs == 1) {
+			/* nobody else can see y's cells, so move them over */
+			memcpy(to, y->cell, sizeof(*y->cell) * n);
+			memset(y->cell, 0, sizeof(*y->cell) * n);
+		} else {
+			for (int i = 0; i < n; i++) {
+				to[i] = LREF(lval_copy(LPTR(y->cell[i])));
+			}
+		}
+
+		x->count += n;
+		if (!(x->flags & LVAL_INLINE)) {
+			x->store->count += n;
+		}
+	}
+
+	lval_del(y);
+
+	return x;
+}
+
+static lval_t *lval_take(lval_t *v, int i)
+{
+	lval_t *x = lval_pop(v, i);
+	lval_del(v);
+
+	return x;
+}
+
+static lval_t *lval_eval_sexpr(lenv_t *e, lval_t *v)
+{
+	/* results get written back into v */
+	lval_unshare(v);
+
+	for (int i = 0; i < v->count; i++) {
+		/* a macro gets the rest as they're written, if it's called by name */
+		lval_t *m = i == 0 && v->count > 1 ? lmacro_global(LCELL(v, 0)) : NULL;
+		LREFS(v)[i] = LREF(lval_eval_one(e, LCELL(v, i)));
+
+		if (m && lval_is_macro(LCELL(v, 0)) && LCELL(v, 0)->lambda == m->lambda) {
+			return lmacro_eval(e, LCELL(v, 0), v, 0);
+		}
+	}
+
+	return lval_apply(e, v);
+}
+
+/*
+ * Evaluate v without taking it or writing to it, so lambda bodies and if
+ * branches can be run straight from where they are, however many calls are
+ * running them at once.
+ */
+static lval_t *lval_eval_tree(lenv_t *e, lval_t *v)
+{
+	if (v->type == LVAL_SYM) {
+		return lenv_get(e, v);
+	}
+	if (v->type == LVAL_SEXPR) {
+		return lval_eval_cells(e, v, 0);
+	}
+
+	return lval_copy(v);
+}
+
+/*
+ * The cells of v evaluated as an S-Expression, whatever v is, leaving v be.
+ * If they're the tail of a lambda and end up calling another, that call is
+ * left in ltail for lval_call() to make, and this returns NULL.
+ */
+static lval_t *lval_eval_cells(lenv_t *e, lval_t *v, int tail)
+{
+	struct lcursor cur = { NULL, 0, 0 };
+
+	/* lists nested deep enough run out of stack without any calls at all */
+	lval_t *err = ldepth_stack();
+	if (err) {
+		return err;
+	}
+
+	/* a lone cell is just its value, without building a list around it */
+	if (v->count == 1) {
+		lval_t *x = lval_at(v, 0, &cur);
+		return x->type == LVAL_SEXPR ? lval_eval_cells(e, x, tail) : lval_eval_tree(e, x);
+	}
+
+	if (v->count == 0) {
+		return lval_sexpr();
+	}
+
+	lval_t *k = lval_at(v, 0, &cur);
+	lval_t *f = lval_eval_tree(e, k);
+	if (lmacro_named(k, f)) {
+		lval_t *r = lmacro_eval(e, f, lval_copy(v), tail);
+		lval_del(f);
+		return r;
+	}
+
+	int mark = llent.count;
+	lval_t *a = lval_args(f);
+	lval_reserve(a, v->count);
+	a = lval_add(a, f);
+
+	/* an if with quoted branches runs the one it picks right where it is */
+	if (v->count == 4 && f->type == LVAL_FUN && (f->flags & LVAL_BUILTIN) &&
+	    f->builtin == builtin_if && lval_at(v, 2, &cur)->type == LVAL_QEXPR &&
+	    lval_at(v, 3, &cur)->type == LVAL_QEXPR) {
+		lval_t *x = lval_eval_tree(e, lval_at(v, 1, &cur));
+		if (x->type == LVAL_NUM) {
+			lval_t *r = lval_eval_cells(e, lval_at(v, x->num ? 2 : 3, &cur), tail);
+			lval_del(x);
+			lval_del(a);
+			llent.count = mark;
+			return r;
+		}
+		a = lval_add(a, x);
+	}
+
+	for (int i = a->count; i < v->count; i++) {
+		a = lval_add(a, lval_eval_tree(e, lval_at(v, i, &cur)));
+	}
+
+	if (llent.count == mark) {
+		return tail ? lval_apply_tail(e, a) : lval_apply(e, a);
+	}
+
+	lval_t *r = tail ? lval_apply_tail(e, a) : lval_apply(e, a);
+	llent.count = mark;
+	return r;
+}
+
+/*
+ * If the S-Expression a is a call to a lambda with nothing wrong with its
+ * arguments, leave it in ltail and take it. Builtins are just called.
+ */
+static int lval_tailcall(lval_t *a)
+{
+	lval_t *f = LCELL(a, 0);
+	if (f->type != LVAL_FUN || (f->flags & LVAL_BUILTIN)) {
+		return 0;
+	}
+
+	for (int i = 1; i < a->count; i++) {
+		if (LCELL(a, i)->type == LVAL_ERR) {
+			return 0;
+		}
+	}
+
+	ltail.f = lval_pop(a, 0);
+	ltail.a = a;
+
+	return 1;
+}
+
+/*
+ * lval_apply() for the tail of a lambda, where a call to another lambda is
+ * left in ltail, and so is any in the tail of what an if picks or eval is
+ * given, even when they only turn out to be if and eval now.
+ */
+static lval_t *lval_apply_tail(lenv_t *e, lval_t *a)
+{
+	lval_t *f = LCELL(a, 0);
+
+	if (f->type == LVAL_FUN && (f->flags & LVAL_BUILTIN) &&
+	    ((f->builtin == builtin_if && a->count == 4 && LCELL(a, 1)->type == LVAL_NUM &&
+	      LCELL(a, 2)->type == LVAL_QEXPR && LCELL(a, 3)->type == LVAL_QEXPR) ||
+	     (f->builtin == builtin_eval && a->count == 2 && LCELL(a, 1)->type == LVAL_QEXPR))) {
+		int i = f->builtin == builtin_eval ? 1 : LCELL(a, 1)->num ? 2 : 3;
+		lval_t *r = lval_eval_cells(e, LCELL(a, i), 1);
+		lval_del(a);
+		return r;
+	}
+
+	return lval_tailcall(a) ? NULL : lval_apply(e, a);
+}
+
+/* make the call left in ltail, and whatever call that leaves, and so on */
+static lval_t *ltail_run(lenv_t *e)
+{
+	lval_t *r = NULL;
+
+	while (!r) {
+		lval_t *f = ltail.f;
+		lenv_t *from = ltail.env;
+		ltail.env = NULL;
+
+		r = lval_invoke(from ? from : e, f, ltail.a, 1);
+		lval_del(f);
+		if (from) {
+			lenv_del(from);
+		}
+	}
+
+	return r;
+}
+
+/*
+ * What the S-Expression v comes to once its cells have been evaluated:
+ * the first error in it, nothing, a single value, or a call.
+ */
+static lval_t *lval_apply(lenv_t *e, lval_t *v)
+{
+	for (int i = 0; i < v->count; i++) {
+		if (LCELL(v, i)->type == LVAL_ERR) {
+			return lval_take(v, i);
+		}
+	}
+
+	if (v->count == 0) {
+		return v;
+	}
+
+	if (v->count == 1) {
+		return lval_take(v, 0);
+	}
+
+	lval_t *f = lval_pop(v, 0);
+	if (f->type != LVAL_FUN) {
+		lval_t *err =  lval_err("first element is not a function! Got %s, Expected %s",
+				ltype_name(f->type),
+				ltype_name(LVAL_FUN));
+		lval_del(f);
+		lval_del(v);
+
+		return err;
+	}
+
+	lval_t *res = lval_invoke(e, f, v, 1);
+	lval_del(f);
+
+	return res ? res : ltail_run(e);
+}
+
+/*
+ * Bytecode. Each instruction is an opcode followed by its operands, all of
+ * them ints: k is an index into the constant pool and l a place in the code
+ * to jump to.
+ */
+enum {
+	LOP_CONST,    /* k: push a copy of constant k */
+	LOP_LOCAL,    /* slot k: push slot of this frame, which should be symbol k */
+	LOP_GLOBAL,   /* k: push the global symbol k */
+	LOP_LOOKUP,   /* k: push whatever symbol k names from here */
+	LOP_CALL,     /* n: evaluate the S-Expression made of the top n values */
+	LOP_TAILCALL, /* n: the same, as the last thing this call does */
+	LOP_IF,       /* k then else l end: branch on the number on top */
+	LOP_JUMP,     /* l */
+	LOP_RETURN,
+	/* k x y: apply the operator named by symbol k to operands x and y */
+	LOP_ADD,
+	LOP_SUB,
+	LOP_MUL,
+	LOP_DIV,
+	LOP_MOD,
+	LOP_EQ,
+	LOP_NE,
+	LOP_GT,
+	LOP_LT,
+	LOP_GE,
+	LOP_LE
+};
+
+/*
+ * Operands of the arithmetic instructions are a pair of ints. Numbers and
+ * locals are read where they are rather than being copied onto the stack.
+ */
+enum {
+	LARG_STACK, /* 0: pop it */
+	LARG_CONST, /* k: constant k */
+	LARG_LOCAL  /* k: the slot of this frame bound symbol k is in */
+};
+
+/* builtins that get an instruction of their own when given two arguments */
+static const struct {
+	char *name;
+	lbuiltin_t builtin;
+} lops[] = {
+	{ "+",  builtin_add },
+	{ "-",  builtin_sub },
+	{ "*",  builtin_mul },
+	{ "/",  builtin_div },
+	{ "%",  builtin_mod },
+	{ "==", builtin_eq },
+	{ "!=", builtin_ne },
+	{ ">",  builtin_gt },
+	{ "<",  builtin_lt },
+	{ ">=", builtin_ge },
+	{ "<=", builtin_le },
+};
+
+/* a call being run by lvm_run(); fun and env are ours to free, unless fun is NULL */
+struct lvm_frame {
+	lcode_t *code;
+	const int *ip;
+	lenv_t *env;
+	lval_t *fun;
+	int base;
+};
+
+/* the value stack and the calls, shared by every lvm_run() on the C stack */
+static struct {
+	lval_t **stack;
+	int sp;
+	int cap;
+	struct lvm_frame *frame;
+	int depth;
+	int fcap;
+} lvm;
+
+static lcode_t *lcode_new(void)
+{
+	return calloc(1, sizeof(lcode_t));
+}
+
+static void lcode_del(lcode_t *c)
+{
+	for (int i = 0; i < c->nconst; i++) {
+		lval_del(c->consts[i]);
+	}
+
+	free(c->consts);
+	free(c->op);
+	free(c);
+}
+
+/* compile the body of a lambda */
+static lcode_t *lcode_body(lval_t *body)
+{
+	lcode_t *c = lcode_new();
+
+	lcode_sexpr(c, body, 1);
+	lcode_emit(c, LOP_RETURN);
+
+	return c;
+}
+
+/* add x to the end of the code, and say where that was */
+static int lcode_emit(lcode_t *c, int x)
+{
+	if (c->count == c->cap) {
+		c->cap = c->cap ? 2 * c->cap : 16;
+		c->op = realloc(c->op, sizeof(*c->op) * c->cap);
+	}
+
+	c->op[c->count] = x;
+
+	return c->count++;
+}
+
+/* add v to the constant pool, taking it */
+static int lcode_const(lcode_t *c, lval_t *v)
+{
+	c->consts = realloc(c->consts, sizeof(*c->consts) * (c->nconst + 1));
+	c->consts[c->nconst] = v;
+
+	return c->nconst++;
+}
+
+/* the code so far leaves n more values on the stack */
+static void lcode_push(lcode_t *c, int n)
+{
+	c->depth += n;
+	if (c->depth > c->stack) {
+		c->stack = c->depth;
+	}
+}
+
+/* code leaving the value of v on the stack */
+static void lcode_expr(lcode_t *c, lval_t *v, int tail)
+{
+	switch (v->type) {
+	case LVAL_SYM:
+		if ((v->flags & LVAL_BOUND) && v->depth == 0) {
+			lcode_emit(c, LOP_LOCAL);
+			lcode_emit(c, v->count);
+		} else {
+			lcode_emit(c, v->flags & LVAL_GLOBAL ? LOP_GLOBAL : LOP_LOOKUP);
+		}
+		lcode_emit(c, lcode_const(c, lval_copy(v)));
+		lcode_push(c, 1);
+		break;
+	case LVAL_SEXPR:
+		lcode_sexpr(c, v, tail);
+		break;
+	default:
+		lcode_emit(c, LOP_CONST);
+		lcode_emit(c, lcode_const(c, lval_copy(v)));
+		lcode_push(c, 1);
+		break;
+	}
+}
+
+/* an operand for an arithmetic instruction, with code for it if it needs any */
+static void lcode_arg(lcode_t *c, lval_t *v, int *arg)
+{
+	if (v->type == LVAL_NUM) {
+		arg[0] = LARG_CONST;
+		arg[1] = lcode_const(c, lval_copy(v));
+	} else if (v->type == LVAL_SYM && (v->flags & LVAL_BOUND) && v->depth == 0) {
+		arg[0] = LARG_LOCAL;
+		arg[1] = lcode_const(c, lval_copy(v));
+	} else {
+		lcode_expr(c, v, 0);
+		arg[0] = LARG_STACK;
+		arg[1] = 0;
+	}
+}
+
+/*
+ * code leaving the value of the cells of v evaluated as an S-Expression,
+ * whatever v itself is
+ */
+static void lcode_sexpr(lcode_t *c, lval_t *v, int tail)
+{
+	struct lcursor cur = { NULL, 0, 0 };
+
+	if (v->count == 0) {
+		lcode_emit(c, LOP_CONST);
+		lcode_emit(c, lcode_const(c, lval_sexpr()));
+		lcode_push(c, 1);
+		return;
+	}
+
+	if (v->count == 1) {
+		lcode_expr(c, lval_at(v, 0, &cur), tail);
+		return;
+	}
+
+	/*
+	 * Arguments are never builtins, but anything else might turn out to be
+	 * the if or the arithmetic it looks like. They're checked when run.
+	 */
+	lval_t *x = lval_at(v, 0, &cur);
+	if (x->type == LVAL_SYM && !(x->flags & LVAL_BOUND)) {
+		if (v->count == 4 && strcmp(LSYM(x), "if") == 0 &&
+		    lval_at(v, 2, &cur)->type == LVAL_QEXPR &&
+		    lval_at(v, 3, &cur)->type == LVAL_QEXPR) {
+			lcode_if(c, v, tail);
+			return;
+		}
+
+		for (size_t i = 0; v->count == 3 && i < sizeof(lops) / sizeof(*lops); i++) {
+			if (strcmp(LSYM(x), lops[i].name) == 0) {
+				int a[2], b[2];
+				lcode_arg(c, lval_at(v, 1, &cur), a);
+				lcode_arg(c, lval_at(v, 2, &cur), b);
+				lcode_emit(c, LOP_ADD + i);
+				lcode_emit(c, lcode_const(c, lval_copy(x)));
+				lcode_emit(c, a[0]);
+				lcode_emit(c, a[1]);
+				lcode_emit(c, b[0]);
+				lcode_emit(c, b[1]);
+				lcode_push(c, 1 - (a[0] == LARG_STACK) - (b[0] == LARG_STACK));
+				return;
+			}
+		}
+	}
+
+	for (int i = 0; i < v->count; i++) {
+		lcode_expr(c, lval_at(v, i, &cur), 0);
+	}
+
+	lcode_emit(c, tail ? LOP_TAILCALL : LOP_CALL);
+	lcode_emit(c, v->count);
+	lcode_push(c, 1 - v->count);
+}
+
+/* (if cond {then} {else}), with the branches compiled in place */
+static void lcode_if(lcode_t *c, lval_t *v, int tail)
+{
+	struct lcursor cur = { NULL, 0, 0 };
+	lval_t *x = lval_at(v, 0, &cur);
+	lval_t *then = lval_at(v, 2, &cur);
+	lval_t *other = lval_at(v, 3, &cur);
+
+	lcode_expr(c, lval_at(v, 1, &cur), 0);
+	lcode_push(c, -1);
+
+	lcode_emit(c, LOP_IF);
+	lcode_emit(c, lcode_const(c, lval_copy(x)));
+	lcode_emit(c, lcode_const(c, lval_copy(then)));
+	lcode_emit(c, lcode_const(c, lval_copy(other)));
+	int lelse = lcode_emit(c, 0);
+	int lend = lcode_emit(c, 0);
+
+	int depth = c->depth;
+	lcode_sexpr(c, then, tail);
+	lcode_emit(c, LOP_JUMP);
+	int ljump = lcode_emit(c, 0);
+
+	c->op[lelse] = c->count;
+	c->depth = depth;
+	lcode_sexpr(c, other, tail);
+
+	c->op[lend] = c->count;
+	c->op[ljump] = c->count;
+}
+
+/* a frame to call l in from e, with its formals still to be bound */
+static lenv_t *lenv_enter(lenv_t *e, llambda_t *l)
+{
+	lenv_t *frame = l->formals->count <= LENV_FLAT ? lenv_call_frame() : lenv_frame();
+
+	/*
+	 * Closures already know their parent. Otherwise it's either the
+	 * caller under dynamic scoping, or just the globals.
+	 */
+	if (l->env->flags & LENV_CLOSURE) {
+		frame->par = l->env->par;
+		frame->flags |= LENV_CLOSURE;
+		frame->par->refs++;
+	} else {
+		frame->par = l->env->flags & LENV_DYNAMIC ? e : lenv_root(e);
+	}
+
+	return frame;
+}
+
+/*
+ * What evaluating the S-Expression made up of f and the arguments in a comes
+ * to, once they've been evaluated themselves. Takes both.
+ */
+static lval_t *lvm_apply(lenv_t *e, lval_t *f, lval_t *a)
+{
+	if (f->type == LVAL_ERR) {
+		lval_del(a);
+		return f;
+	}
+
+	for (int i = 0; i < a->count; i++) {
+		if (LCELL(a, i)->type == LVAL_ERR) {
+			lval_del(f);
+			return lval_take(a, i);
+		}
+	}
+
+	if (f->type != LVAL_FUN) {
+		lval_t *err = lval_err("first element is not a function! Got %s, Expected %s",
+				ltype_name(f->type),
+				ltype_name(LVAL_FUN));
+		lval_del(f);
+		lval_del(a);
+
+		return err;
+	}
+
+	lval_t *r = lval_invoke(e, f, a, 1);
+	lval_del(f);
+
+	return r ? r : ltail_run(e);
+}
+
+/* the top n values added to the list a, taking them off the stack */
+static lval_t *lvm_list(lval_t *a, int n)
+{
+	lvm.sp -= n;
+	for (int i = 0; i < n; i++) {
+		a = lval_add(a, lvm.stack[lvm.sp + i]);
+	}
+
+	return a;
+}
+
+/*
+ * Can f be called with the n values on top of the stack just by running its
+ * code, rather than going through lval_call()?
+ */
+static int lvm_direct(lval_t *f, int n)
+{
+	if (f->type != LVAL_FUN || (f->flags & (LVAL_BUILTIN | LVAL_PARTIAL)) ||
+	    (f->lambda->flags & LLAMBDA_VARARGS) || !f->lambda->code ||
+	    f->lambda->formals->count != n || n > LENV_FLAT) {
+		return 0;
+	}
+
+	for (int i = lvm.sp - n; i < lvm.sp; i++) {
+		if (lvm.stack[i]->type == LVAL_ERR) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* room for n more values on the stack */
+static void lvm_reserve(int n)
+{
+	if (lvm.sp + n > lvm.cap) {
+		while (lvm.sp + n > lvm.cap) {
+			lvm.cap = lvm.cap ? 2 * lvm.cap : 256;
+		}
+		lvm.stack = realloc(lvm.stack, sizeof(*lvm.stack) * lvm.cap);
+	}
+}
+
+/* start running code in env, with the stack as it is now */
+static void lvm_push(lcode_t *code, lenv_t *env, lval_t *fun)
+{
+	if (lvm.depth == lvm.fcap) {
+		lvm.fcap = lvm.fcap ? 2 * lvm.fcap : 64;
+		lvm.frame = realloc(lvm.frame, sizeof(*lvm.frame) * lvm.fcap);
+	}
+
+	lvm_reserve(code->stack);
+
+	struct lvm_frame *fr = &lvm.frame[lvm.depth++];
+	fr->code = code;
+	fr->ip = code->op;
+	fr->env = env;
+	fr->fun = fun;
+	fr->base = lvm.sp;
+}
+
+/* a frame for f with the n values on top of the stack moved into it */
+static lenv_t *lvm_bind(lenv_t *e, lval_t *f, int n)
+{
+	llambda_t *l = f->lambda;
+	lenv_t *frame = lenv_enter(e, l);
+
+	lvm.sp -= n;
+	for (int i = 0; i < n; i++) {
+		lenv_bind(frame, LCELL(l->formals, i), lvm.stack[lvm.sp + i]);
+	}
+
+	return frame;
+}
+
+#if defined(__GNUC__) && !defined(LVM_SWITCH)
+#define LVM_THREADED
+/* labels as values are a gcc extension, which -Wpedantic knows */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+#ifdef LVM_THREADED
+#define LVM_CASE(x) lop_##x
+#define LVM_NEXT    goto *lvm_labels[*ip++]
+#else
+#define LVM_CASE(x) case LOP_##x
+#define LVM_NEXT    continue
+#endif
+
+/* x first: it might run more code, which can move the stack */
+#define LVM_PUSH(x) do { lval_t *lvm_x = (x); lvm.stack[lvm.sp++] = lvm_x; } while (0)
+#define LVM_POP()   (lvm.stack[--lvm.sp])
+
+/*
+ * Run code in env e, which the caller keeps hold of, and return what it comes
+ * to. Calls to other compiled lambdas are run right here rather than through
+ * lval_call(), and tail calls replace the call making them. If tail is set,
+ * code that ends by calling a lambda it can't run itself leaves the call in
+ * ltail and returns NULL.
+ */
+static lval_t *lvm_run(lenv_t *e, lcode_t *code, int tail)
+{
+	int entry = lvm.depth;
+	lvm_push(code, e, NULL);
+
+	lcode_t *c = code;
+	lenv_t *env = e;
+	const int *ip = c->op;
+	lval_t *r;
+	int n;
+
+#ifdef LVM_THREADED
+	static void *const lvm_labels[] = {
+		&&lop_CONST, &&lop_LOCAL, &&lop_GLOBAL, &&lop_LOOKUP,
+		&&lop_CALL, &&lop_TAILCALL, &&lop_IF, &&lop_JUMP, &&lop_RETURN,
+		&&lop_ADD, &&lop_SUB, &&lop_MUL, &&lop_DIV, &&lop_MOD,
+		&&lop_EQ, &&lop_NE, &&lop_GT, &&lop_LT, &&lop_GE, &&lop_LE,
+	};
+	LVM_NEXT;
+#else
+	for (;;) switch (*ip++) {
+#endif
+
+	LVM_CASE(CONST):
+		LVM_PUSH(lval_copy(c->consts[*ip++]));
+		LVM_NEXT;
+
+	LVM_CASE(LOCAL): {
+		int slot = ip[0];
+		lval_t *k = c->consts[ip[1]];
+		ip += 2;
+
+		if (slot < env->count && env->cap <= LENV_FLAT && env->syms[slot] == k->sym) {
+			LVM_PUSH(lval_copy(LPTR(env->vals[slot])));
+		} else {
+			LVM_PUSH(lenv_get(env, k));
+		}
+		LVM_NEXT;
+	}
+
+	LVM_CASE(GLOBAL): {
+		lval_t *k = c->consts[*ip++];
+		lval_t *x = lglobal(k->sym);
+
+		LVM_PUSH(x ? lval_copy(x) : lenv_get(env, k));
+		LVM_NEXT;
+	}
+
+	LVM_CASE(LOOKUP):
+		LVM_PUSH(lenv_get(env, c->consts[*ip++]));
+		LVM_NEXT;
+
+	LVM_CASE(JUMP):
+		ip = c->op + *ip;
+		LVM_NEXT;
+
+	LVM_CASE(IF): {
+		lval_t *k = c->consts[ip[0]];
+		lval_t *x = LVM_POP();
+
+		if (x->type == LVAL_NUM && lenv_builtin(env, k) == builtin_if) {
+			long cond = x->num;
+			lval_del(x);
+			ip = cond ? ip + 5 : c->op + ip[3];
+			LVM_NEXT;
+		}
+
+		/* not a plain if after all, so just call whatever it is */
+		lval_t *a = lval_add(lval_sexpr(), x);
+		a = lval_add(a, lval_copy(c->consts[ip[1]]));
+		a = lval_add(a, lval_copy(c->consts[ip[2]]));
+		LVM_PUSH(lvm_apply(env, lenv_get(env, k), a));
+		ip = c->op + ip[4];
+		LVM_NEXT;
+	}
+
+	LVM_CASE(ADD):
+	LVM_CASE(SUB):
+	LVM_CASE(MUL):
+	LVM_CASE(DIV):
+	LVM_CASE(MOD):
+	LVM_CASE(EQ):
+	LVM_CASE(NE):
+	LVM_CASE(GT):
+	LVM_CASE(LT):
+	LVM_CASE(GE):
+	LVM_CASE(LE): {
+		int op = ip[-1];
+		lval_t *k = c->consts[ip[0]];
+		int xown, yown;
+		lval_t *y = lvm_arg(env, c, ip + 3, &yown);
+		lval_t *x = lvm_arg(env, c, ip + 1, &xown);
+		long r;
+		ip += 5;
+
+		if (x->type == LVAL_NUM && y->type == LVAL_NUM &&
+		    lenv_builtin(env, k) == lops[op - LOP_ADD].builtin &&
+		    lvm_arith(op, x->num, y->num, &r)) {
+			/* a comparison straight into an if can just branch */
+			if (op >= LOP_EQ && *ip == LOP_IF && lenv_builtin(env, c->consts[ip[1]]) == builtin_if) {
+				if (xown) {
+					lval_del(x);
+				}
+				if (yown) {
+					lval_del(y);
+				}
+				ip = r ? ip + 6 : c->op + ip[4];
+				LVM_NEXT;
+			}
+
+			/* otherwise reuse whichever operand is ours to reuse */
+			if (xown) {
+				x->num = r;
+				if (yown) {
+					lval_del(y);
+				}
+				LVM_PUSH(x);
+			} else if (yown) {
+				y->num = r;
+				LVM_PUSH(y);
+			} else {
+				LVM_PUSH(lval_num(r));
+			}
+			LVM_NEXT;
+		}
+
+		x = xown ? x : lval_copy(x);
+		y = yown ? y : lval_copy(y);
+		lval_t *a = lval_add(lval_add(lval_sexpr(), x), y);
+		LVM_PUSH(lvm_apply(env, lenv_get(env, k), a));
+		LVM_NEXT;
+	}
+
+	LVM_CASE(CALL): {
+		n = *ip++;
+		lval_t *f = lvm.stack[lvm.sp - n];
+
+		if (lvm_direct(f, n - 1)) {
+			/* hot enough to have been compiled to native code? */
+			long x;
+			if (ljit_try(env, f->lambda, lvm.stack + lvm.sp - n + 1, n - 1, &x)) {
+				for (int i = lvm.sp - n; i < lvm.sp; i++) {
+					lval_del(lvm.stack[i]);
+				}
+				lvm.sp -= n;
+				LVM_PUSH(lval_num(x));
+				LVM_NEXT;
+			}
+
+			if (ldepth.calls >= lval_max_depth) {
+				for (int i = lvm.sp - n; i < lvm.sp; i++) {
+					lval_del(lvm.stack[i]);
+				}
+				lvm.sp -= n;
+				LVM_PUSH(lval_err("Calls nested too deep. Got past the maximum depth of %i.", lval_max_depth));
+				LVM_NEXT;
+			}
+			ldepth.calls++;
+
+			lenv_t *frame = lvm_bind(env, f, n - 1);
+			lvm.sp--;
+
+			lvm.frame[lvm.depth - 1].ip = ip;
+			lvm_push(f->lambda->code, frame, f);
+
+			c = f->lambda->code;
+			env = frame;
+			ip = c->op;
+			LVM_NEXT;
+		}
+
+		int mark = llent.count;
+		lval_t *a = lvm_list(lval_args(f), n - 1);
+		lvm.sp--;
+		LVM_PUSH(lvm_apply(env, f, a));
+		llent.count = mark;
+		LVM_NEXT;
+	}
+
+	LVM_CASE(TAILCALL):
+		n = *ip++;
+	tailcall: {
+		lval_t *f = lvm.stack[lvm.sp - n];
+
+		if (lvm_direct(f, n - 1)) {
+			/* hot enough to have been compiled to native code? */
+			long x;
+			if (ljit_try(env, f->lambda, lvm.stack + lvm.sp - n + 1, n - 1, &x)) {
+				for (int i = lvm.sp - n; i < lvm.sp; i++) {
+					lval_del(lvm.stack[i]);
+				}
+				lvm.sp -= n;
+				LVM_PUSH(lval_num(x));
+				goto ret;
+			}
+
+			lenv_t *frame = lvm_bind(env, f, n - 1);
+			lvm.sp--;
+
+			/* nothing in the old call is needed any more */
+			struct lvm_frame *fr = &lvm.frame[lvm.depth - 1];
+			if (fr->fun) {
+				lenv_del(fr->env);
+				lval_del(fr->fun);
+			} else {
+				ldepth.calls++;
+			}
+
+			c = f->lambda->code;
+			env = frame;
+			ip = c->op;
+			lvm_reserve(c->stack);
+
+			fr->code = c;
+			fr->env = env;
+			fr->fun = f;
+			LVM_NEXT;
+		}
+
+		int mark = llent.count;
+		lval_t *a = lvm_list(lval_args(f), n);
+		if (f->type == LVAL_FUN && (f->flags & LVAL_BUILTIN)) {
+			r = lval_apply_tail(env, a);
+			llent.count = mark;
+		} else if (tail && lvm.depth - 1 == entry && lval_tailcall(a)) {
+			/* leave it to lval_call() once this frame's gone */
+			LVM_PUSH(NULL);
+			goto ret;
+		} else {
+			r = lval_apply(env, a);
+		}
+
+		/* the tail of an if or eval left a call, so make it like any other */
+		if (!r) {
+			lvm_reserve(ltail.a->count + 1);
+			LVM_PUSH(ltail.f);
+			for (n = 1; ltail.a->count; n++) {
+				LVM_PUSH(lval_pop(ltail.a, 0));
+			}
+			lval_del(ltail.a);
+			goto tailcall;
+		}
+
+		LVM_PUSH(r);
+		goto ret;
+	}
+
+	LVM_CASE(RETURN):
+	ret: {
+		r = LVM_POP();
+
+		struct lvm_frame *fr = &lvm.frame[--lvm.depth];
+		if (fr->fun) {
+			lenv_del(fr->env);
+			lval_del(fr->fun);
+			ldepth.calls--;
+		}
+		lvm.sp = fr->base;
+
+		if (lvm.depth == entry) {
+			return r;
+		}
+
+		fr = &lvm.frame[lvm.depth - 1];
+		c = fr->code;
+		env = fr->env;
+		ip = fr->ip;
+
+		LVM_PUSH(r);
+		LVM_NEXT;
+	}
+
+#ifndef LVM_THREADED
+	}
+#endif
+}
+
+#ifdef LVM_THREADED
+#pragma GCC diagnostic pop
+#endif
+
+/*
+ * Operand arg of an arithmetic instruction. *own says whether it's ours, or
+ * still belongs to wherever it was read from.
+ */
+static lval_t *lvm_arg(lenv_t *e, lcode_t *c, const int *arg, int *own)
+{
+	lval_t *k;
+
+	switch (arg[0]) {
+	case LARG_CONST:
+		*own = 0;
+		return c->consts[arg[1]];
+	case LARG_LOCAL:
+		k = c->consts[arg[1]];
+		if (k->count < e->count && e->cap <= LENV_FLAT && e->syms[k->count] == k->sym) {
+			*own = 0;
+			return LPTR(e->vals[k->count]);
+		}
+		*own = 1;
+		return lenv_get(e, k);
+	}
+
+	*own = 1;
+	return LVM_POP();
+}
+
+/* the builtin k names in e, or NULL if it's anything else */
+static lbuiltin_t lenv_builtin(lenv_t *e, lval_t *k)
+{
+	if (k->flags & LVAL_GLOBAL) {
+		lval_t *f = lglobal(k->sym);
+		if (!f || f->type != LVAL_FUN || !(f->flags & LVAL_BUILTIN)) {
+			return NULL;
+		}
+		return f->builtin;
+	}
+
+	lval_t *f = lenv_peek(e, k);
+	return f && f->type == LVAL_FUN && (f->flags & LVAL_BUILTIN) ? f->builtin : NULL;
+}
+
+/*
+ * a op b for two numbers, in *r. 0 if there's something the builtin has
+ * to deal with instead, like division by zero or overflow.
+ */
+static int lvm_arith(int op, long a, long b, long *r)
+{
+	switch (op) {
+	case LOP_ADD:
+		return larith_add(a, b, r);
+	case LOP_SUB:
+		return larith_sub(a, b, r);
+	case LOP_MUL:
+		return larith_mul(a, b, r);
+	case LOP_DIV:
+		return b != 0 && larith_div(a, b, r);
+	case LOP_MOD:
+		return b != 0 && larith_mod(a, b, r);
+	case LOP_EQ:
+		*r = a == b;
+		return 1;
+	case LOP_NE:
+		*r = a != b;
+		return 1;
+	case LOP_GT:
+		*r = a > b;
+		return 1;
+	case LOP_LT:
+		*r = a < b;
+		return 1;
+	case LOP_GE:
+		*r = a >= b;
+		return 1;
+	case LOP_LE:
+		*r = a <= b;
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * The JIT. Once a lambda running as bytecode has been called LJIT_HOT times
+ * it's compiled to x86-64 code, if its body only does fixnum arithmetic and
+ * comparisons, if, its own formals and calls to global lambdas. The code works
+ * on plain longs, and whenever something isn't as it assumed (an argument
+ * isn't a number, a builtin's been redefined, a sum overflows) it bails out,
+ * and the call is run again as bytecode from the start. That's fine to do as
+ * nothing it can run has any side effects.
+ */
+#if defined(__x86_64__) && !defined(LVAL_HANDLES) && !defined(LJIT_NONE)
+#define LJIT
+#endif
+
+#define LJIT_HOT   1000
+#define LJIT_BAILS 100   /* give up on a lambda after bailing this often */
+#define LJIT_ARGS  6
+#define LJIT_DEPTH 10000 /* calls deep the native stack goes, before bailing */
+
+#ifdef LJIT
+
+/* code being assembled, and the labels in it */
+struct lasm {
+	unsigned char *buf;
+	int count;
+	int cap;
+	int *label;  /* where each label is, -1 until bound */
+	int nlabel;
+	int *fixup;  /* rel32 to patch, label pairs */
+	int nfixup;
+};
+
+/* a lambda being compiled */
+struct ljit_build {
+	struct lasm a;
+	llambda_t *l;
+	int bail;
+	int out;
+	int body;
+	lval_t *guard[32]; /* symbols that have to be their builtins */
+	lbuiltin_t want[32];
+	int nguard;
+};
+
+static struct {
+	long depth;
+	unsigned char bail;
+	int compiled;
+	long bails;
+	unsigned char *mem;
+	size_t used;
+	size_t cap;
+	struct ljit_hole {
+		unsigned char *at;
+		size_t size;
+	} *hole;           /* code from lambdas since freed, to place more in */
+	int nhole;
+} ljit;
+
+static void lasm_byte(struct lasm *a, int n, ...)
+{
+	va_list va;
+
+	if (a->count + n > a->cap) {
+		a->cap = a->cap ? 2 * a->cap + n : 256;
+		a->buf = realloc(a->buf, a->cap);
+	}
+
+	va_start(va, n);
+	for (int i = 0; i < n; i++) {
+		a->buf[a->count++] = va_arg(va, int);
+	}
+	va_end(va);
+}
+
+static void lasm_imm32(struct lasm *a, long x)
+{
+	lasm_byte(a, 4, (int)(x & 0xff), (int)((x >> 8) & 0xff),
+		  (int)((x >> 16) & 0xff), (int)((x >> 24) & 0xff));
+}
+
+static void lasm_imm64(struct lasm *a, const void *p)
+{
+	unsigned long x = (unsigned long)p;
+	lasm_imm32(a, (long)(x & 0xffffffff));
+	lasm_imm32(a, (long)(x >> 32));
+}
+
+/* movabs reg, x, for rax (0) or rcx (1) */
+static void lasm_movabs(struct lasm *a, int reg, const void *x)
+{
+	lasm_byte(a, 2, 0x48, 0xb8 + reg);
+	lasm_imm64(a, x);
+}
+
+static int lasm_label(struct lasm *a)
+{
+	a->label = realloc(a->label, sizeof(*a->label) * (a->nlabel + 1));
+	a->label[a->nlabel] = -1;
+
+	return a->nlabel++;
+}
+
+static void lasm_bind(struct lasm *a, int label)
+{
+	a->label[label] = a->count;
+}
+
+/* jmp (-1) or jcc (the second opcode byte, 0x80 + cc) to label */
+static void lasm_jump(struct lasm *a, int cc, int label)
+{
+	if (cc < 0) {
+		lasm_byte(a, 1, 0xe9);
+	} else {
+		lasm_byte(a, 2, 0x0f, cc);
+	}
+
+	a->fixup = realloc(a->fixup, sizeof(*a->fixup) * (a->nfixup + 2));
+	a->fixup[a->nfixup++] = a->count;
+	a->fixup[a->nfixup++] = label;
+	lasm_imm32(a, 0);
+}
+
+static void lasm_link(struct lasm *a)
+{
+	for (int i = 0; i < a->nfixup; i += 2) {
+		int at = a->fixup[i];
+		long rel = a->label[a->fixup[i + 1]] - (at + 4);
+		for (int j = 0; j < 4; j++) {
+			a->buf[at + j] = (rel >> (8 * j)) & 0xff;
+		}
+	}
+}
+
+#define LJ_JO  0x80
+#define LJ_JE  0x84
+#define LJ_JNE 0x85
+#define LJ_JLE 0x8e
+#define LJ_JG  0x8f
+
+/* flip the pages n bytes at p are on between writable and runnable */
+static int ljit_protect(unsigned char *p, size_t n, int prot)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t from = (size_t)p & ~(page - 1);
+	size_t to = ((size_t)p + n + page - 1) & ~(page - 1);
+
+	return mprotect((void *)from, to - from, prot);
+}
+
+/*
+ * Copy finished code somewhere it can run: the first hole left by freed code
+ * that it fits in, or else the end of the region we're filling.
+ */
+static void *ljit_place(struct lasm *a, size_t *size)
+{
+	size_t n = (a->count + 15) & ~(size_t)15;
+	unsigned char *p = NULL;
+
+	for (int i = 0; i < ljit.nhole; i++) {
+		if (ljit.hole[i].size >= n) {
+			p = ljit.hole[i].at;
+			ljit.hole[i].at += n;
+			ljit.hole[i].size -= n;
+			if (ljit.hole[i].size == 0) {
+				ljit.hole[i] = ljit.hole[--ljit.nhole];
+			}
+			break;
+		}
+	}
+
+	if (!p) {
+		if (!ljit.mem || ljit.used + n > ljit.cap) {
+			size_t cap = 1 << 16;
+			while (cap < n) {
+				cap *= 2;
+			}
+			void *mem = mmap(NULL, cap, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (mem == MAP_FAILED) {
+				return NULL;
+			}
+			/* what's left of the last region is as good as a hole */
+			if (ljit.mem && ljit.used < ljit.cap) {
+				ljit.hole = realloc(ljit.hole, sizeof(*ljit.hole) * (ljit.nhole + 1));
+				ljit.hole[ljit.nhole].at = ljit.mem + ljit.used;
+				ljit.hole[ljit.nhole++].size = ljit.cap - ljit.used;
+			}
+			ljit.mem = mem;
+			ljit.used = 0;
+			ljit.cap = cap;
+		}
+		p = ljit.mem + ljit.used;
+		ljit.used += n;
+	}
+
+	if (ljit_protect(p, n, PROT_READ | PROT_WRITE)) {
+		return NULL;
+	}
+	memcpy(p, a->buf, a->count);
+	if (ljit_protect(p, n, PROT_READ | PROT_EXEC)) {
+		return NULL;
+	}
+
+	*size = n;
+	return p;
+}
+
+/* give j's code back to be placed over, once its lambda won't run it again */
+static void ljit_free(ljit_t *j)
+{
+	if (!j) {
+		return;
+	}
+
+	/* run it into a hole either side of it, so holes don't just get smaller */
+	unsigned char *at = j->code;
+	size_t size = j->size;
+	free(j);
+	for (int i = 0; i < ljit.nhole; i++) {
+		if (ljit.hole[i].at + ljit.hole[i].size == at || at + size == ljit.hole[i].at) {
+			at = at < ljit.hole[i].at ? at : ljit.hole[i].at;
+			size += ljit.hole[i].size;
+			ljit.hole[i--] = ljit.hole[--ljit.nhole];
+		}
+	}
+
+	ljit.hole = realloc(ljit.hole, sizeof(*ljit.hole) * (ljit.nhole + 1));
+	ljit.hole[ljit.nhole].at = at;
+	ljit.hole[ljit.nhole++].size = size;
+}
+
+/* rax = the lval in the global cell of symbol k, bailing if it's empty */
+static void ljit_load_global(struct ljit_build *b, lval_t *k)
+{
+	struct lasm *a = &b->a;
+	int id = k->sym->id;
+
+	lasm_movabs(a, 0, &lroot);
+	lasm_byte(a, 3, 0x48, 0x8b, 0x00);             /* mov rax, [rax] */
+	lasm_byte(a, 3, 0x81, 0x78, (int)offsetof(lenv_t, nglobal));
+	lasm_imm32(a, id);                             /* cmp dword [rax+nglobal], id */
+	lasm_jump(a, LJ_JLE, b->bail);
+	lasm_byte(a, 4, 0x48, 0x8b, 0x40, (int)offsetof(lenv_t, global));
+	lasm_byte(a, 3, 0x48, 0x8b, 0x80);
+	lasm_imm32(a, (long)sizeof(lref_t) * id);      /* mov rax, [rax+8*id] */
+	lasm_byte(a, 3, 0x48, 0x85, 0xc0);             /* test rax, rax */
+	lasm_jump(a, LJ_JE, b->bail);
+	lasm_byte(a, 4, 0x80, 0x78, (int)offsetof(lval_t, type), LVAL_FUN);
+	lasm_jump(a, LJ_JNE, b->bail);                 /* cmp byte [rax+type], FUN */
+}
+
+/* symbol k has to be builtin f whenever the code is run */
+static int ljit_guard(struct ljit_build *b, lval_t *k, lbuiltin_t f)
+{
+	for (int i = 0; i < b->nguard; i++) {
+		if (b->guard[i]->sym == k->sym) {
+			return b->want[i] == f;
+		}
+	}
+
+	if (b->nguard == 32) {
+		return 0;
+	}
+
+	b->guard[b->nguard] = k;
+	b->want[b->nguard++] = f;
+
+	return 1;
+}
+
+/* is v the local in slot i, where its formal will be? */
+static int ljit_local(struct ljit_build *b, lval_t *v)
+{
+	return v->type == LVAL_SYM && (v->flags & LVAL_BOUND) && v->depth == 0 &&
+		v->count < b->l->formals->count && LCELL(b->l->formals, v->count)->sym == v->sym;
+}
+
+/* rcx = v, for numbers and locals, without touching rax */
+static int ljit_operand(struct ljit_build *b, lval_t *v)
+{
+	if (v->type == LVAL_NUM) {
+		lasm_byte(&b->a, 2, 0x48, 0xb9);
+		lasm_imm32(&b->a, v->num & 0xffffffff);
+		lasm_imm32(&b->a, (long)((unsigned long)v->num >> 32));
+		return 1;
+	}
+
+	if (ljit_local(b, v)) {
+		lasm_byte(&b->a, 4, 0x48, 0x8b, 0x4b, 8 * v->count); /* mov rcx, [rbx+8i] */
+		return 1;
+	}
+
+	return 0;
+}
+
+static int ljit_expr(struct ljit_build *b, lval_t *v, int tail);
+static int ljit_cells(struct ljit_build *b, lval_t *v, int tail);
+
+/* code leaving v in rax */
+static int ljit_expr(struct ljit_build *b, lval_t *v, int tail)
+{
+	if (v->type == LVAL_NUM || ljit_local(b, v)) {
+		ljit_operand(b, v);
+		lasm_byte(&b->a, 3, 0x48, 0x89, 0xc8);             /* mov rax, rcx */
+		return 1;
+	}
+
+	if (v->type == LVAL_SEXPR) {
+		return ljit_cells(b, v, tail);
+	}
+
+	return 0;
+}
+
+static int ljit_if(struct ljit_build *b, lval_t *v, int tail)
+{
+	struct lcursor cur = { NULL, 0, 0 };
+	struct lasm *a = &b->a;
+	int other = lasm_label(a);
+	int end = lasm_label(a);
+
+	if (!ljit_guard(b, lval_at(v, 0, &cur), builtin_if) ||
+	    !ljit_expr(b, lval_at(v, 1, &cur), 0)) {
+		return 0;
+	}
+
+	lasm_byte(a, 3, 0x48, 0x85, 0xc0);                      /* test rax, rax */
+	lasm_jump(a, LJ_JE, other);
+	if (!ljit_cells(b, lval_at(v, 2, &cur), tail)) {
+		return 0;
+	}
+	lasm_jump(a, -1, end);
+	lasm_bind(a, other);
+	if (!ljit_cells(b, lval_at(v, 3, &cur), tail)) {
+		return 0;
+	}
+	lasm_bind(a, end);
+
+	return 1;
+}
+
+static int ljit_op(struct ljit_build *b, lval_t *v, int op)
+{
+	struct lcursor cur = { NULL, 0, 0 };
+	struct lasm *a = &b->a;
+	lval_t *y = lval_at(v, 2, &cur);
+
+	if (!ljit_guard(b, lval_at(v, 0, &cur), lops[op - LOP_ADD].builtin) ||
+	    !ljit_expr(b, lval_at(v, 1, &cur), 0)) {
+		return 0;
+	}
+
+	/* numbers and locals go straight into rcx, anything else via the stack */
+	if (y->type != LVAL_NUM && !ljit_local(b, y)) {
+		lasm_byte(a, 1, 0x50);                               /* push rax */
+		if (!ljit_expr(b, y, 0)) {
+			return 0;
+		}
+		lasm_byte(a, 3, 0x48, 0x89, 0xc1);                   /* mov rcx, rax */
+		lasm_byte(a, 1, 0x58);                               /* pop rax */
+	} else {
+		ljit_operand(b, y);
+	}
+
+	switch (op) {
+	case LOP_ADD:
+		lasm_byte(a, 3, 0x48, 0x01, 0xc8);                   /* add rax, rcx */
+		lasm_jump(a, LJ_JO, b->bail);
+		return 1;
+	case LOP_SUB:
+		lasm_byte(a, 3, 0x48, 0x29, 0xc8);                   /* sub rax, rcx */
+		lasm_jump(a, LJ_JO, b->bail);
+		return 1;
+	case LOP_MUL:
+		lasm_byte(a, 4, 0x48, 0x0f, 0xaf, 0xc1);             /* imul rax, rcx */
+		lasm_jump(a, LJ_JO, b->bail);
+		return 1;
+	case LOP_DIV:
+	case LOP_MOD:
+		/* zero is an error, and -1 might trap, so leave those to the builtin */
+		lasm_byte(a, 3, 0x48, 0x85, 0xc9);                   /* test rcx, rcx */
+		lasm_jump(a, LJ_JE, b->bail);
+		lasm_byte(a, 4, 0x48, 0x83, 0xf9, 0xff);             /* cmp rcx, -1 */
+		lasm_jump(a, LJ_JE, b->bail);
+		lasm_byte(a, 2, 0x48, 0x99);                         /* cqo */
+		lasm_byte(a, 3, 0x48, 0xf7, 0xf9);                   /* idiv rcx */
+		if (op == LOP_MOD) {
+			lasm_byte(a, 3, 0x48, 0x89, 0xd0);           /* mov rax, rdx */
+		}
+		return 1;
+	}
+
+	/* comparisons: setcc al, then zero extend */
+	static const int cc[] = { 0x94, 0x95, 0x9f, 0x9c, 0x9d, 0x9e };
+	lasm_byte(a, 3, 0x48, 0x39, 0xc8);                           /* cmp rax, rcx */
+	lasm_byte(a, 3, 0x0f, cc[op - LOP_EQ], 0xc0);
+	lasm_byte(a, 4, 0x48, 0x0f, 0xb6, 0xc0);                     /* movzx rax, al */
+
+	return 1;
+}
+
+/* a call to the global lambda named by the head of v */
+static int ljit_call(struct ljit_build *b, lval_t *v, int tail)
+{
+	struct lcursor cur = { NULL, 0, 0 };
+	struct lasm *a = &b->a;
+	int n = v->count - 1;
+
+	/* builtins other than the ones above have side effects, or make lists */
+	lval_t *f = lval_at(v, 0, &cur);
+	lval_t *g = lglobal(f->sym);
+	if (n > LJIT_ARGS || (g && g->type == LVAL_FUN && (g->flags & LVAL_BUILTIN))) {
+		return 0;
+	}
+
+	/* arguments go on the stack last first, so they end up in order */
+	for (int i = n - 1; i >= 0; i--) {
+		if (!ljit_expr(b, lval_at(v, i + 1, &cur), 0)) {
+			return 0;
+		}
+		lasm_byte(a, 1, 0x50);                                   /* push rax */
+	}
+
+	/* lambdas that take '&' are never compiled, so bail on having no jit */
+	ljit_load_global(b, f);
+	lasm_byte(a, 4, 0xf6, 0x40, (int)offsetof(lval_t, flags), LVAL_BUILTIN | LVAL_PARTIAL);
+	lasm_jump(a, LJ_JNE, b->bail);
+	lasm_byte(a, 4, 0x48, 0x8b, 0x40, (int)offsetof(lval_t, lambda)); /* mov rax, [rax+lambda] */
+
+	/* calling ourselves last thing can just go round again */
+	int self = lasm_label(a);
+	int done = lasm_label(a);
+	if (tail && n == b->l->formals->count) {
+		lasm_movabs(a, 1, b->l);
+		lasm_byte(a, 3, 0x48, 0x39, 0xc8);                       /* cmp rax, rcx */
+		lasm_jump(a, LJ_JE, self);
+	}
+
+	lasm_byte(a, 4, 0x48, 0x8b, 0x40, (int)offsetof(llambda_t, jit));
+	lasm_byte(a, 3, 0x48, 0x85, 0xc0);                           /* test rax, rax */
+	lasm_jump(a, LJ_JE, b->bail);
+	lasm_byte(a, 3, 0x81, 0x78, (int)offsetof(ljit_t, arity));
+	lasm_imm32(a, n);                                            /* cmp dword [rax+arity], n */
+	lasm_jump(a, LJ_JNE, b->bail);
+	lasm_byte(a, 4, 0x48, 0x8b, 0x40, (int)offsetof(ljit_t, code));
+	lasm_byte(a, 3, 0x48, 0x89, 0xe7);                           /* mov rdi, rsp */
+	lasm_byte(a, 2, 0xff, 0xd0);                                 /* call rax */
+	if (n) {
+		lasm_byte(a, 3, 0x48, 0x81, 0xc4);
+		lasm_imm32(a, 8 * n);                                /* add rsp, 8n */
+	}
+	lasm_movabs(a, 1, &ljit.bail);
+	lasm_byte(a, 3, 0x80, 0x39, 0x00);                           /* cmp byte [rcx], 0 */
+	lasm_jump(a, LJ_JNE, b->out);
+	lasm_jump(a, -1, done);
+
+	lasm_bind(a, self);
+	for (int i = 0; i < n; i++) {
+		lasm_byte(a, 1, 0x59);                                   /* pop rcx */
+		lasm_byte(a, 4, 0x48, 0x89, 0x4b, 8 * i);                /* mov [rbx+8i], rcx */
+	}
+	lasm_jump(a, -1, b->body);
+	lasm_bind(a, done);
+
+	return 1;
+}
+
+/* code leaving the value of the cells of v, as an S-Expression, in rax */
+static int ljit_cells(struct ljit_build *b, lval_t *v, int tail)
+{
+	struct lcursor cur = { NULL, 0, 0 };
+
+	if (v->count == 1) {
+		return ljit_expr(b, lval_at(v, 0, &cur), tail);
+	}
+
+	lval_t *f = lval_at(v, 0, &cur);
+	if (v->count < 2 || f->type != LVAL_SYM || !(f->flags & LVAL_GLOBAL)) {
+		return 0;
+	}
+
+	if (v->count == 4 && strcmp(LSYM(f), "if") == 0) {
+		return lval_at(v, 2, &cur)->type == LVAL_QEXPR &&
+			lval_at(v, 3, &cur)->type == LVAL_QEXPR && ljit_if(b, v, tail);
+	}
+
+	for (size_t i = 0; i < sizeof(lops) / sizeof(*lops); i++) {
+		if (strcmp(LSYM(f), lops[i].name) == 0) {
+			return v->count == 3 && ljit_op(b, v, LOP_ADD + i);
+		}
+	}
+
+	return ljit_call(b, v, tail);
+}
+
+/* a global l is bound to, to tell perf what it is; only looked for with --perf-map */
+static lsym_t *ljit_name(llambda_t *l)
+{
+	for (int i = 0; i < lsyms.cap; i++) {
+		lsym_t *sym = lsyms.sym[i];
+		lval_t *f = sym ? lglobal(sym) : NULL;
+		if (f && f->type == LVAL_FUN && !(f->flags & (LVAL_BUILTIN | LVAL_PARTIAL)) &&
+		    f->lambda == l) {
+			return sym;
+		}
+	}
+
+	return NULL;
+}
+
+/* native code for l, or NULL if there's something in it we can't do */
+static ljit_t *ljit_compile(lenv_t *e, llambda_t *l)
+{
+	struct ljit_build b = { .l = l };
+	struct lasm *a = &b.a;
+
+	if (l->formals->count > LJIT_ARGS) {
+		return NULL;
+	}
+	for (int i = 0; i < l->formals->count; i++) {
+		lsym_t *sym = LCELL(l->formals, i)->sym;
+		if (sym->name[0] == '&') {
+			return NULL;
+		}
+		/* formals have to be the slots of the same number */
+		for (int j = 0; j < i; j++) {
+			if (LCELL(l->formals, j)->sym == sym) {
+				return NULL;
+			}
+		}
+	}
+
+	b.bail = lasm_label(a);
+	b.out = lasm_label(a);
+	b.body = lasm_label(a);
+	int guards = lasm_label(a);
+
+	lasm_byte(a, 2, 0x53, 0x55);                         /* push rbx; push rbp */
+	lasm_byte(a, 3, 0x48, 0x89, 0xe5);                   /* mov rbp, rsp */
+	lasm_byte(a, 3, 0x48, 0x89, 0xfb);                   /* mov rbx, rdi */
+	lasm_movabs(a, 0, &ljit.depth);
+	lasm_byte(a, 3, 0x48, 0xff, 0x00);                   /* inc qword [rax] */
+	lasm_byte(a, 3, 0x48, 0x81, 0x38);
+	lasm_imm32(a, LJIT_DEPTH);                           /* cmp qword [rax], depth */
+	lasm_jump(a, LJ_JG, b.bail);
+	lasm_jump(a, -1, guards);
+
+	lasm_bind(a, b.body);
+	int ok = ljit_cells(&b, llambda_body(l), 1);
+
+	lasm_bind(a, b.out);
+	lasm_movabs(a, 1, &ljit.depth);
+	lasm_byte(a, 3, 0x48, 0xff, 0x09);                   /* dec qword [rcx] */
+	lasm_byte(a, 3, 0x48, 0x89, 0xec);                   /* mov rsp, rbp */
+	lasm_byte(a, 3, 0x5d, 0x5b, 0xc3);                   /* pop rbp; pop rbx; ret */
+
+	lasm_bind(a, b.bail);
+	lasm_movabs(a, 1, &ljit.bail);
+	lasm_byte(a, 3, 0xc6, 0x01, 0x01);                   /* mov byte [rcx], 1 */
+	lasm_jump(a, -1, b.out);
+
+	/* every builtin it uses is checked once on the way in */
+	lasm_bind(a, guards);
+	for (int i = 0; i < b.nguard; i++) {
+		ljit_load_global(&b, b.guard[i]);
+		lasm_byte(a, 4, 0xf6, 0x40, (int)offsetof(lval_t, flags), LVAL_BUILTIN);
+		lasm_jump(a, LJ_JE, b.bail);
+		lasm_movabs(a, 1, (void *)(size_t)b.want[i]);
+		lasm_byte(a, 4, 0x48, 0x39, 0x48, (int)offsetof(lval_t, builtin));
+		lasm_jump(a, LJ_JNE, b.bail);                /* cmp [rax+builtin], rcx */
+	}
+	lasm_jump(a, -1, b.body);
+
+	ljit_t *j = NULL;
+	size_t size;
+	void *code = ok ? (lasm_link(a), ljit_place(a, &size)) : NULL;
+	if (code) {
+		j = malloc(sizeof(ljit_t));
+		j->code = code;
+		j->size = size;
+		j->arity = l->formals->count;
+		j->bails = 0;
+		ljit.compiled++;
+
+		if (lenv_root(e)->flags & LENV_PERFMAP) {
+			char path[64];
+			snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+			FILE *f = fopen(path, "a");
+			if (f) {
+				lsym_t *name = ljit_name(l);
+				if (name) {
+					fprintf(f, "%lx %x meowlisp_%s\n", (unsigned long)code, a->count, name->name);
+				} else {
+					fprintf(f, "%lx %x meowlisp_lambda_%d\n",
+						(unsigned long)code, a->count, ljit.compiled);
+				}
+				fclose(f);
+			}
+		}
+	}
+
+	free(a->buf);
+	free(a->label);
+	free(a->fixup);
+
+	return j;
+}
+
+/*
+ * Run l natively on the n arguments in v, leaving the answer in r, if it's
+ * hot enough and they're all numbers. 0 if it has to be run as bytecode.
+ */
+static int ljit_try(lenv_t *e, llambda_t *l, lval_t **v, int n, long *r)
+{
+	if (!l->jit) {
+		if (l->calls < 0 || ++l->calls < LJIT_HOT) {
+			return 0;
+		}
+		if ((lenv_root(e)->flags & LENV_NOJIT) || !(l->jit = ljit_compile(e, l))) {
+			l->calls = -1;
+			return 0;
+		}
+	}
+
+	/* the native code might go all of LJIT_DEPTH calls deep */
+	long args[LJIT_ARGS];
+	if (n != l->jit->arity || !ldepth_room(LJIT_DEPTH * 128)) {
+		return 0;
+	}
+	for (int i = 0; i < n; i++) {
+		if (v[i]->type != LVAL_NUM) {
+			return 0;
+		}
+		args[i] = v[i]->num;
+	}
+
+	union {
+		void *p;
+		long (*fn)(const long *);
+	} code = { l->jit->code };
+
+	ljit.bail = 0;
+	ljit.depth = 0;
+	*r = code.fn(args);
+	if (!ljit.bail) {
+		return 1;
+	}
+
+	ljit.bails++;
+	if (++l->jit->bails == LJIT_BAILS) {
+		ljit_free(l->jit);
+		l->jit = NULL;
+		l->calls = -1;
+	}
+
+	return 0;
+}
+
+static void ljit_stats(void)
+{
+	fprintf(stderr, "jit: %i lambdas compiled, %li bails\n", ljit.compiled, ljit.bails);
+}
+
+#else
+
+static int ljit_try(lenv_t *e, llambda_t *l, lval_t **v, int n, long *r)
+{
+	(void)e;
+	(void)l;
+	(void)v;
+	(void)n;
+	(void)r;
+	return 0;
+}
+
+static void ljit_stats(void)
+{
+}
+
+static void ljit_free(ljit_t *j)
+{
+	free(j);
+}
+
+#endif
+
+/*
+ * Evaluate a top level form however we've been told to: compiled to bytecode,
+ * to closures, or just by walking the tree.
+ */
+static lval_t *lval_eval_top(lenv_t *e, lval_t *v)
+{
+	int flags = lenv_root(e)->flags;
+	lval_t *r;
+
+	if (v->type == LVAL_SEXPR) {
+		int n = 0;
+		v = lmacro_top(v, &n);
+	}
+
+	if (flags & LENV_TREE) {
+		return lval_eval_one(e, v);
+	}
+
+	if (flags & LENV_CLOSURES) {
+		lexpr_t *x = lexpr_compile(v);
+		lval_del(v);
+		r = x->run(x, e);
+		lexpr_del(x);
+		return r;
+	}
+
+	lcode_t *c = lcode_new();
+	lcode_expr(c, v, 1);
+	lcode_emit(c, LOP_RETURN);
+	lval_del(v);
+
+	r = lvm_run(e, c, 0);
+	lcode_del(c);
+
+	return r;
+}
+
+/*
+ * Closure compilation. Rather than bytecode, every expression in a body is
+ * turned into an lexpr whose run function does only what that kind of
+ * expression needs, and evaluating is just calling down the tree.
+ */
+static lexpr_t *lexpr_new(lval_t *(*run)(lexpr_t *, lenv_t *), lval_t *val, int count)
+{
+	lexpr_t *x = malloc(sizeof(lexpr_t));
+	x->run = run;
+	x->val = val;
+	x->count = count;
+	x->arg = count ? malloc(sizeof(*x->arg) * count) : NULL;
+	x->num = NULL;
+
+	return x;
+}
+
+static void lexpr_del(lexpr_t *x)
+{
+	for (int i = 0; i < x->count; i++) {
+		lexpr_del(x->arg[i]);
+	}
+	if (x->val) {
+		lval_del(x->val);
+	}
+	if (x->num) {
+		lnum_del(x->num);
+	}
+
+	free(x->arg);
+	free(x);
+}
+
+static lexpr_t *lexpr_compile(lval_t *v)
+{
+	switch (v->type) {
+	case LVAL_SYM:
+		if ((v->flags & LVAL_BOUND) && v->depth == 0) {
+			return lexpr_new(lexpr_local, lval_copy(v), 0);
+		}
+		return lexpr_new(v->flags & LVAL_GLOBAL ? lexpr_global : lexpr_lookup, lval_copy(v), 0);
+	case LVAL_SEXPR:
+		return lexpr_cells(v, 0);
+	}
+
+	return lexpr_new(lexpr_const, lval_copy(v), 0);
+}
+
+/*
+ * Compile the cells of v as an S-Expression, whatever v is. In the tail of a
+ * lambda calls leave what they call in ltail rather than calling it.
+ */
+static lexpr_t *lexpr_cells(lval_t *v, int tail)
+{
+	struct lcursor cur = { NULL, 0, 0 };
+	lexpr_t *x;
+
+	if (v->count == 0) {
+		return lexpr_new(lexpr_const, lval_sexpr(), 0);
+	}
+
+	if (v->count == 1) {
+		lval_t *x = lval_at(v, 0, &cur);
+		return x->type == LVAL_SEXPR ? lexpr_cells(x, tail) : lexpr_compile(x);
+	}
+
+	/* arithmetic gets worked out on longs, the rest of this being for when it can't be */
+	x = lexpr_form(v, tail);
+	lnum_t *n = lnum_cells(v, x);
+	if (n) {
+		lexpr_t *y = lexpr_new(lexpr_num, NULL, 1);
+		y->num = n;
+		y->arg[0] = x;
+		return y;
+	}
+
+	return x;
+}
+
+/* the same for an S-Expression of more than one cell */
+static lexpr_t *lexpr_form(lval_t *v, int tail)
+{
+	struct lcursor cur = { NULL, 0, 0 };
+	lexpr_t *x;
+	lval_t *f = lval_at(v, 0, &cur);
+	if (v->count == 4 && f->type == LVAL_SYM && !(f->flags & LVAL_BOUND) &&
+	    strcmp(LSYM(f), "if") == 0 && lval_at(v, 2, &cur)->type == LVAL_QEXPR &&
+	    lval_at(v, 3, &cur)->type == LVAL_QEXPR) {
+		x = lexpr_new(lexpr_if, lval_copy(v), 3);
+		x->arg[0] = lexpr_compile(lval_at(v, 1, &cur));
+		x->arg[1] = lexpr_cells(lval_at(v, 2, &cur), tail);
+		x->arg[2] = lexpr_cells(lval_at(v, 3, &cur), tail);
+		return x;
+	}
+
+	/* a global we're calling can be used right where it is */
+	if (f->type == LVAL_SYM && (f->flags & LVAL_GLOBAL) && !tail) {
+		x = lexpr_new(lexpr_call_global, lval_copy(f), v->count - 1);
+		for (int i = 1; i < v->count; i++) {
+			x->arg[i - 1] = lexpr_compile(lval_at(v, i, &cur));
+		}
+		return x;
+	}
+
+	x = lexpr_new(tail ? lexpr_tailcall : lexpr_call, NULL, v->count);
+	for (int i = 0; i < v->count; i++) {
+		x->arg[i] = lexpr_compile(lval_at(v, i, &cur));
+	}
+
+	return x;
+}
+
+static lval_t *lexpr_const(lexpr_t *x, lenv_t *e)
+{
+	return lval_copy(x->val);
+}
+
+static lval_t *lexpr_local(lexpr_t *x, lenv_t *e)
+{
+	int slot = x->val->count;
+
+	if (slot < e->count && e->cap <= LENV_FLAT && e->syms[slot] == x->val->sym) {
+		return lval_copy(LPTR(e->vals[slot]));
+	}
+
+	return lenv_get(e, x->val);
+}
+
+static lval_t *lexpr_global(lexpr_t *x, lenv_t *e)
+{
+	lval_t *v = lglobal(x->val->sym);
+
+	return v ? lval_copy(v) : lenv_get(e, x->val);
+}
+
+static lval_t *lexpr_lookup(lexpr_t *x, lenv_t *e)
+{
+	return lenv_get(e, x->val);
+}
+
+/* (if cond {then} {else}), running the branch without copying it out */
+static lval_t *lexpr_if(lexpr_t *x, lenv_t *e)
+{
+	struct lcursor cur = { NULL, 0, 0 };
+	lval_t *k = lval_at(x->val, 0, &cur);
+	lexpr_t *p = x->arg[0];
+	long n;
+
+	/* a condition that's only arithmetic needn't be made into a number to test */
+	if (p->num && lnum_run(p->num, e, &n) && lenv_builtin(e, k) == builtin_if) {
+		lexpr_t *b = x->arg[n ? 1 : 2];
+		return b->run(b, e);
+	}
+
+	lval_t *c = p->run(p, e);
+
+	if (c->type == LVAL_NUM && lenv_builtin(e, k) == builtin_if) {
+		lexpr_t *b = x->arg[c->num ? 1 : 2];
+		lval_del(c);
+		return b->run(b, e);
+	}
+
+	/* not a plain if after all, so just call whatever it is */
+	lval_t *a = lval_sexpr();
+	a = lval_add(a, lenv_get(e, k));
+	a = lval_add(a, c);
+	a = lval_add(a, lval_copy(lval_at(x->val, 2, &cur)));
+	a = lval_add(a, lval_copy(lval_at(x->val, 3, &cur)));
+
+	return lval_apply(e, a);
+}
+
+static lval_t *lexpr_call(lexpr_t *x, lenv_t *e)
+{
+	lval_t *f = x->arg[0]->run(x->arg[0], e);
+
+	return lexpr_apply(e, f, x->arg + 1, x->count - 1);
+}
+
+/* a call in tail position, which is left in ltail if it's to a lambda */
+static lval_t *lexpr_tailcall(lexpr_t *x, lenv_t *e)
+{
+	lval_t *f = x->arg[0]->run(x->arg[0], e);
+	if (f->type != LVAL_FUN || ((f->flags & LVAL_BUILTIN) &&
+				    f->builtin != builtin_if && f->builtin != builtin_eval)) {
+		return lexpr_apply(e, f, x->arg + 1, x->count - 1);
+	}
+
+	lval_t *a = lval_sexpr();
+	lval_reserve(a, x->count);
+	a = lval_add(a, f);
+	for (int i = 1; i < x->count; i++) {
+		a = lval_add(a, x->arg[i]->run(x->arg[i], e));
+	}
+
+	return lval_apply_tail(e, a);
+}
+
+/* builtins don't need copying out of the global, just their function */
+static lval_t *lexpr_call_global(lexpr_t *x, lenv_t *e)
+{
+	lval_t *v = lglobal(x->val->sym);
+	if (!v || v->type != LVAL_FUN || !(v->flags & LVAL_BUILTIN)) {
+		return lexpr_apply(e, lexpr_global(x, e), x->arg, x->count);
+	}
+
+	lbuiltin_t b = v->builtin;
+	int mark = llent.count;
+	lval_t *a = lval_args(LPTR(v));
+	lval_reserve(a, x->count);
+	for (int i = 0; i < x->count; i++) {
+		a = lval_add(a, x->arg[i]->run(x->arg[i], e));
+	}
+
+	lval_t *r = NULL;
+	for (int i = 0; !r && i < a->count; i++) {
+		if (LCELL(a, i)->type == LVAL_ERR) {
+			r = lval_take(a, i);
+		}
+	}
+
+	r = r ? r : b(e, a);
+	llent.count = mark;
+	return r;
+}
+
+/* arithmetic done on longs, or if that doesn't work out the ordinary way */
+static lval_t *lexpr_num(lexpr_t *x, lenv_t *e)
+{
+	long r;
+
+	if (lnum_run(x->num, e, &r)) {
+		return lval_num(r);
+	}
+
+	return x->arg[0]->run(x->arg[0], e);
+}
+
+/*
+ * Arithmetic worked out on longs. An expression made of nothing but numbers,
+ * symbols, ifs and the builtins in lops is compiled to an lnum as well as an
+ * lexpr, so none of the numbers along the way have to be made. What it takes
+ * for granted is checked as it runs: that the symbols hold numbers and the
+ * operators are still the builtins they were. If they aren't, or it comes to
+ * anything the builtin would have to deal with, like division by zero or
+ * overflow, lnum_run() gives up and the lexpr runs instead. Nothing in one
+ * can have any side effects, so starting it again is fine.
+ */
+enum {
+	LNUM_CONST, /* num */
+	LNUM_SYM,   /* whatever sym is bound to */
+	LNUM_IF,    /* arg[0] ? arg[1] : arg[2], if sym is still if */
+	LNUM_OP     /* LNUM_OP + i: lops[i] applied to arg, if that's what sym is */
+};
+
+static lnum_t *lnum_new(int op, lval_t *sym, int count)
+{
+	lnum_t *n = malloc(sizeof(lnum_t));
+	n->op = op;
+	n->num = 0;
+	n->sym = sym ? lval_copy(sym) : NULL;
+	n->count = count;
+	n->arg = count ? calloc(count, sizeof(*n->arg)) : NULL;
+
+	return n;
+}
+
+static void lnum_del(lnum_t *n)
+{
+	for (int i = 0; i < n->count; i++) {
+		if (n->arg[i]) {
+			lnum_del(n->arg[i]);
+		}
+	}
+	if (n->sym) {
+		lval_del(n->sym);
+	}
+
+	free(n->arg);
+	free(n);
+}
+
+/*
+ * The cells of v as arithmetic, made out of what x, the lexpr v was compiled
+ * to, has for its parts: an if with arithmetic for its condition and both
+ * branches, or one of lops given arguments that are all arithmetic too.
+ * Parts that had arithmetic of their own give it up to v's, as they're only
+ * run once that's given up, so building it is never more than each part once.
+ */
+static lnum_t *lnum_cells(lval_t *v, lexpr_t *x)
+{
+	struct lcursor cur = { NULL, 0, 0 };
+	lval_t *f = lval_at(v, 0, &cur);
+	lexpr_t **arg = x->arg;
+	int op = -1;
+
+	if (f->type != LVAL_SYM || (f->flags & LVAL_BOUND)) {
+		return NULL;
+	}
+
+	if (x->run == lexpr_if) {
+		op = LNUM_IF;
+	} else {
+		for (size_t i = 0; i < sizeof(lops) / sizeof(lops[0]); i++) {
+			/* comparisons only take two */
+			if (strcmp(LSYM(f), lops[i].name) == 0 && (i < LOP_EQ - LOP_ADD || v->count == 3)) {
+				op = LNUM_OP + i;
+				break;
+			}
+		}
+		/* calls to globals leave out the function */
+		arg += x->run != lexpr_call_global;
+	}
+
+	for (int i = 0; op >= 0 && i < v->count - 1; i++) {
+		if (!lnum_can(arg[i])) {
+			return NULL;
+		}
+	}
+	if (op < 0) {
+		return NULL;
+	}
+
+	lnum_t *n = lnum_new(op, f, v->count - 1);
+	for (int i = 0; i < n->count; i++) {
+		n->arg[i] = lnum_take(&arg[i]);
+	}
+
+	return n;
+}
+
+/* can what x works out be worked out on longs */
+static int lnum_can(lexpr_t *x)
+{
+	return x->num || x->run == lexpr_local || x->run == lexpr_global || x->run == lexpr_lookup ||
+		(x->run == lexpr_const && x->val->type == LVAL_NUM);
+}
+
+/* the arithmetic for *x, which lnum_can(), taking it out of *x if it had its own */
+static lnum_t *lnum_take(lexpr_t **x)
+{
+	lexpr_t *y = *x;
+	lnum_t *n;
+
+	if (y->num) {
+		n = y->num;
+		*x = y->arg[0];
+		y->num = NULL;
+		y->count = 0;
+		lexpr_del(y);
+	} else if (y->run == lexpr_const) {
+		n = lnum_new(LNUM_CONST, NULL, 0);
+		n->num = y->val->num;
+	} else {
+		n = lnum_new(LNUM_SYM, y->val, 0);
+	}
+
+	return n;
+}
+
+/* n worked out in e, into *r, or 0 if it has to be left to the lexpr */
+static int lnum_run(lnum_t *n, lenv_t *e, long *r)
+{
+	lval_t *v;
+	long y;
+
+	switch (n->op) {
+	case LNUM_CONST:
+		*r = n->num;
+		return 1;
+	case LNUM_SYM:
+		v = lenv_peek(e, n->sym);
+		if (!v || v->type != LVAL_NUM) {
+			return 0;
+		}
+		*r = v->num;
+		return 1;
+	case LNUM_IF:
+		if (!lnum_run(n->arg[0], e, r) || lenv_builtin(e, n->sym) != builtin_if) {
+			return 0;
+		}
+		return lnum_run(n->arg[*r ? 1 : 2], e, r);
+	}
 
-	while (v->count > 1) {
-		lval_del(lval_pop(v, 1));
+	int op = n->op - LNUM_OP;
+	if (lenv_builtin(e, n->sym) != lops[op].builtin || !lnum_run(n->arg[0], e, r)) {
+		return 0;
+	}
+	if (n->count == 1 && op == LOP_SUB - LOP_ADD) {
+		return larith_sub(0, *r, r);
+	}
+	for (int i = 1; i < n->count; i++) {
+		if (!lnum_run(n->arg[i], e, &y) || !lvm_arith(LOP_ADD + op, *r, y, r)) {
+			return 0;
+		}
 	}
 
-	return v;
+	return 1;
 }
 
-static lval_t *builtin_tail(lenv_t *e, lval_t *a)
+/*
+ * Call f, which we take, with the n arguments in arg. Closure compiled
+ * lambdas with the right number of formals get their arguments bound
+ * straight into a frame, everything else goes through lval_apply().
+ */
+static lval_t *lexpr_apply(lenv_t *e, lval_t *f, lexpr_t **arg, int n)
 {
-	LASSERT(a, (a->count == 1), "Function 'tail' passed too many arguments! Got %i, Expected %i", a->count, 1);
-	LASSERT_TYPE(a, "tail", a->cell[0]->type, LVAL_QEXPR);
-	LASSERT(a, (a->cell[0]->count != 0), "Function 'tail' passed {}!");
-
-	lval_t *v = lval_take(a, 0);
+	if (f->type != LVAL_FUN || (f->flags & (LVAL_BUILTIN | LVAL_PARTIAL)) ||
+	    (f->lambda->flags & LLAMBDA_VARARGS) || !f->lambda->expr || f->lambda->formals->count != n) {
+		int mark = llent.count;
+		lval_t *a = lval_args(f);
+		lval_reserve(a, n + 1);
+		a = lval_add(a, f);
+		for (int i = 0; i < n; i++) {
+			a = lval_add(a, arg[i]->run(arg[i], e));
+		}
 
-	lval_del(lval_pop(v, 0));
+		lval_t *r = lval_apply(e, a);
+		llent.count = mark;
+		return r;
+	}
 
-	return v;
-}
+	lval_t *r = ldepth_enter();
+	if (r) {
+		lval_del(f);
+		return r;
+	}
 
-static lval_t *builtin_list(lenv_t *e, lval_t *a)
-{
-	a->type = LVAL_QEXPR;
+	llambda_t *l = f->lambda;
+	lenv_t *frame = lenv_enter(e, l);
 
-	return a;
-}
+	for (int i = 0; i < n; i++) {
+		lval_t *x = arg[i]->run(arg[i], e);
 
-static lval_t *builtin_eval(lenv_t *e, lval_t *a)
-{
-	LASSERT(a, (a->count == 1), "Function 'eval' passed too many arguments! Got %i, Expected %i", a->count, 1);
-	LASSERT_TYPE(a, "eval", a->cell[0]->type, LVAL_QEXPR);
+		/* the first error is the answer, but the rest still get run */
+		if (r || x->type == LVAL_ERR) {
+			if (r) {
+				lval_del(x);
+			} else {
+				r = x;
+			}
+			continue;
+		}
 
-	lval_t *x = lval_take(a, 0);
-	x->type = LVAL_SEXPR;
+		lenv_bind(frame, LCELL(l->formals, i), x);
+	}
 
-	return lval_eval(e, x);
-}
+	if (!r) {
+		r = l->expr->run(l->expr, frame);
+	}
+	lenv_del(frame);
+	lval_del(f);
+	ldepth.calls--;
 
-static lval_t *builtin_add(lenv_t *e,lval_t *v)
-{
-	return builtin_op(e, v, "+");
+	return r ? r : ltail_run(e);
 }
 
-static lval_t *builtin_sub(lenv_t *e,lval_t *v)
+/*
+ * Compiling a program to C, for meowlisp --emit-c. Top level definitions of
+ * lambdas that only do fixnum arithmetic and comparisons, if, and call their
+ * formals and each other become C functions on plain longs that call each
+ * other directly, and are put in as builtins in place of the lambdas. A
+ * definition is either (def {name} (\ {formals} {body})) or, if fun is the
+ * usual one from the prelude, (fun {name formals} {body}).
+ *
+ * The program is still run in order by the interpreter, and each function is
+ * only put in once its definition has run and left the lambda we compiled
+ * bound to its name. Like the JIT, the builtins check on every call that
+ * everything they count on is still what it was, and that the arguments are
+ * numbers; while running they bail if a sum overflows or they go too deep.
+ * Either way the call is made again on the lambda by the interpreter.
+ *
+ * A function the program defines more than once, or that shares a name with
+ * if or an operator the program defines, isn't compiled at all.
+ */
+struct lemit_fn {
+	lsym_t *name;
+	lval_t *form;    /* the top level form defining it */
+	lval_t *formals;
+	lval_t *body;
+	int fun;         /* defined with fun, so formals were made for it */
+	int defs;        /* how often the program defines the name */
+	int ok;
+};
+
+struct lemit {
+	struct lemit_fn *fn;
+	int count;
+	int builtins;   /* redefines if or an operator */
+	int fun;        /* fun is defined once, as in the prelude */
+};
+
+/* what the guards of compiled functions check along with them */
+#define LEMIT_IF     (int)(sizeof(lops) / sizeof(*lops))
+#define LEMIT_LAMBDA (LEMIT_IF + 1)
+#define LEMIT_EQ     (LOP_EQ - LOP_ADD)
+#define LEMIT_SYMS   (LEMIT_LAMBDA + 1)
+
+static lval_t *lemit_at(lval_t *v, int i)
 {
-	return builtin_op(e, v, "-");
+	struct lcursor c = { NULL, 0, 0 };
+	return lval_at(v, i, &c);
 }
 
-static lval_t *builtin_mul(lenv_t *e,lval_t *v)
+static int lemit_is(lval_t *v, const char *name)
 {
-	return builtin_op(e, v, "*");
+	return v->type == LVAL_SYM && strcmp(LSYM(v), name) == 0;
 }
 
-static lval_t *builtin_div(lenv_t *e,lval_t *v)
+/* index into lops, or -1 */
+static int lemit_op(lval_t *v)
 {
-	return builtin_op(e, v, "/");
-}
+	for (size_t i = 0; v->type == LVAL_SYM && i < sizeof(lops) / sizeof(*lops); i++) {
+		if (strcmp(LSYM(v), lops[i].name) == 0) {
+			return i;
+		}
+	}
 
-static lval_t *builtin_mod(lenv_t *e,lval_t *v)
-{
-	return builtin_op(e, v, "%");
+	return -1;
 }
 
-static lval_t *builtin_join(lenv_t *e, lval_t *a)
+static struct lemit_fn *lemit_find(struct lemit *m, lval_t *v)
 {
-	for (int i = 0; i < a->count; i++) {
-		LASSERT_TYPE(a, "join", a->cell[i]->type, LVAL_QEXPR);
+	for (int i = 0; v->type == LVAL_SYM && i < m->count; i++) {
+		if (m->fn[i].name == v->sym) {
+			return &m->fn[i];
+		}
 	}
 
-	lval_t *x = lval_pop(a, 0);
+	return NULL;
+}
 
-	while (a->count) {
-		x = lval_join(x, lval_pop(a, 0));
+/* which formal of f v is, or -1 */
+static int lemit_formal(struct lemit_fn *f, lval_t *v)
+{
+	for (int i = 0; v->type == LVAL_SYM && i < f->formals->count; i++) {
+		if (lemit_at(f->formals, i)->sym == v->sym) {
+			return i;
+		}
 	}
 
-	lval_del(a);
-	return x;
+	return -1;
 }
 
-static lval_t *builtin_def(lenv_t *e, lval_t *a)
+/* are the cells of formals from first on formals we can handle? */
+static int lemit_formals_ok(lval_t *formals, int first)
 {
-	return builtin_var(e, a, "def");
-}
+	/* calling one with no arguments doesn't call it, so leave those be */
+	if (formals->count == first) {
+		return 0;
+	}
 
-static lval_t *builtin_put(lenv_t *e, lval_t *a)
-{
-	return builtin_var(e, a, "=");
+	for (int i = first; i < formals->count; i++) {
+		lval_t *k = lemit_at(formals, i);
+		if (k->type != LVAL_SYM || strcmp(LSYM(k), "&") == 0 ||
+		    lemit_is(k, "if") || lemit_op(k) >= 0) {
+			return 0;
+		}
+		for (int j = first; j < i; j++) {
+			if (lemit_at(formals, j)->sym == k->sym) {
+				return 0;
+			}
+		}
+	}
+
+	return 1;
 }
 
-static lval_t *builtin_var(lenv_t *e, lval_t *a, char *func)
+/*
+ * is v (def {name} (\ {formals} {body})), or (fun {name formals} {body}) with
+ * the usual fun, with formals we can handle? If so, fill in f from it
+ */
+static int lemit_candidate(struct lemit *m, lval_t *v, struct lemit_fn *f)
 {
-	LASSERT_TYPE(a, "def", a->cell[0]->type, LVAL_QEXPR);
-	lval_t *syms = a->cell[0];
+	if (v->type != LVAL_SEXPR || v->count != 3) {
+		return 0;
+	}
 
-	for (int i = 0; i < syms->count; i++) {
-		LASSERT_TYPE(a, "def arg0", syms->cell[i]->type, LVAL_SYM);
+	lval_t *names = lemit_at(v, 1);
+	lval_t *l = lemit_at(v, 2);
+	if (names->type != LVAL_QEXPR || names->count == 0 || lemit_at(names, 0)->type != LVAL_SYM) {
+		return 0;
 	}
 
-	LASSERT(a, (syms->count == a->count - 1), "Function 'def' cannot define number of values to symbols");
+	/*
+	 * fun's lambdas are made in its frame, where args and body would be
+	 * found before the globals of those names
+	 */
+	if (m->fun && lemit_is(lemit_at(v, 0), "fun")) {
+		lval_t *k = lemit_at(names, 0);
+		if (l->type != LVAL_QEXPR || lemit_is(k, "args") || lemit_is(k, "body") ||
+		    !lemit_formals_ok(names, 1)) {
+			return 0;
+		}
 
-	for (int i = 0; i < syms->count; i++) {
-		if (strcmp(func, "def") == 0) {
-			lenv_def(e, syms->cell[i], a->cell[i + 1]);
+		f->formals = lval_qexpr();
+		for (int i = 1; i < names->count; i++) {
+			f->formals = lval_add(f->formals, lval_copy(lemit_at(names, i)));
 		}
-		if (strcmp(func, "=") == 0) {
-			lenv_put(e, syms->cell[i], a->cell[i + 1]);
+		f->body = l;
+		f->fun = 1;
+	} else if (lemit_is(lemit_at(v, 0), "def")) {
+		if (names->count != 1 || l->type != LVAL_SEXPR || l->count != 3 ||
+		    !lemit_is(lemit_at(l, 0), "\\") ||
+		    lemit_at(l, 1)->type != LVAL_QEXPR || lemit_at(l, 2)->type != LVAL_QEXPR ||
+		    !lemit_formals_ok(lemit_at(l, 1), 0)) {
+			return 0;
 		}
+
+		f->formals = lemit_at(l, 1);
+		f->body = lemit_at(l, 2);
+		f->fun = 0;
+	} else {
+		return 0;
 	}
 
-	lval_del(a);
+	f->name = lemit_at(names, 0)->sym;
+	f->form = v;
+	f->defs = 0;
 
-	return lval_sexpr();
+	return 1;
 }
 
-static lval_t *builtin_lambda(lenv_t *e, lval_t *a)
+/* count the defs of each name anywhere in v, and of fun */
+static void lemit_scan(struct lemit *m, lval_t *v, int *fun)
 {
-	LASSERT(a, (a->count == 2), "Function '\\' passed invalid number of arguments. Got %i, Expected 2", a->count);
-	LASSERT_TYPE(a, "\\", a->cell[0]->type, LVAL_QEXPR);
-	LASSERT_TYPE(a, "\\", a->cell[1]->type, LVAL_QEXPR);
+	if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) {
+		return;
+	}
 
-	for (int i = 0; i < a->cell[0]->count; i++) {
-		LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
-			"Cannot define non-symbol. Got %s Expected %s.",
-			ltype_name(a->cell[0]->cell[i]->type),
-			ltype_name(LVAL_SYM));
+	if (v->count >= 2 && (lemit_is(lemit_at(v, 0), "def") || lemit_is(lemit_at(v, 0), "=") ||
+	    lemit_is(lemit_at(v, 0), "fun")) && lemit_at(v, 1)->type == LVAL_QEXPR) {
+		lval_t *names = lemit_at(v, 1);
+		/* fun only defines the first of its names */
+		int n = lemit_is(lemit_at(v, 0), "fun") ? names->count > 0 : names->count;
+		for (int i = 0; i < n; i++) {
+			lval_t *k = lemit_at(names, i);
+			struct lemit_fn *f = lemit_find(m, k);
+			if (f) {
+				f->defs++;
+			}
+			if (lemit_is(k, "if") || lemit_op(k) >= 0) {
+				m->builtins = 1;
+			}
+			*fun += lemit_is(k, "fun");
+		}
 	}
 
-	lval_t *formals = lval_pop(a, 0);
-	lval_t *body = lval_pop(a, 0);
+	for (int i = 0; i < v->count; i++) {
+		lemit_scan(m, lemit_at(v, i), fun);
+	}
+}
 
-	lval_del(a);
+static int lemit_check_cells(struct lemit *m, struct lemit_fn *f, lval_t *v);
+
+static int lemit_check(struct lemit *m, struct lemit_fn *f, lval_t *v)
+{
+	switch (v->type) {
+	case LVAL_NUM:
+		return 1;
+	case LVAL_SYM:
+		return lemit_formal(f, v) >= 0;
+	case LVAL_SEXPR:
+		return lemit_check_cells(m, f, v);
+	}
 
-	return lval_lambda(formals, body);
+	return 0;
 }
 
-static lval_t *builtin_ord(lenv_t *e, lval_t *a, char *op)
+/* can the cells of v, evaluated as an S-Expression, be done in C? */
+static int lemit_check_cells(struct lemit *m, struct lemit_fn *f, lval_t *v)
 {
-	LASSERT(a, a->count == 2, "Function '%s' wrong number of arguments. Got %i, Expected %i.", op, a->count, 2);
+	if (v->count == 1) {
+		return lemit_check(m, f, lemit_at(v, 0));
+	}
 
-	LASSERT_TYPE(a, op, a->cell[0]->type, LVAL_NUM);
-	LASSERT_TYPE(a, op, a->cell[1]->type, LVAL_NUM);
+	if (v->count == 0) {
+		return 0;
+	}
 
-	lval_t *l = lval_pop(a, 0);
-	lval_t *r = lval_pop(a, 0);
+	lval_t *k = lemit_at(v, 0);
+	if (k->type != LVAL_SYM || lemit_formal(f, k) >= 0) {
+		return 0;
+	}
 
-	int res = 0;
+	if (lemit_is(k, "if")) {
+		return v->count == 4 && lemit_check(m, f, lemit_at(v, 1)) &&
+			lemit_at(v, 2)->type == LVAL_QEXPR && lemit_check_cells(m, f, lemit_at(v, 2)) &&
+			lemit_at(v, 3)->type == LVAL_QEXPR && lemit_check_cells(m, f, lemit_at(v, 3));
+	}
 
-	if (strcmp(op, ">") == 0) {
-		res = l->num > r->num;
-	} else if (strcmp(op, "<") == 0) {
-		res = l->num < r->num;
-	} else if (strcmp(op, ">=") == 0) {
-		res = l->num >= r->num;
-	} else if (strcmp(op, "<=") == 0) {
-		res = l->num <= r->num;
+	struct lemit_fn *g = lemit_find(m, k);
+	if (lemit_op(k) >= 0 ? v->count != 3 :
+	    !g || !g->ok || g->formals->count != v->count - 1) {
+		return 0;
 	}
 
-	lval_del(l);
-	lval_del(r);
-	lval_del(a);
+	for (int i = 1; i < v->count; i++) {
+		if (!lemit_check(m, f, lemit_at(v, i))) {
+			return 0;
+		}
+	}
 
-	return lval_num(res);
+	return 1;
 }
 
-static lval_t *builtin_eqneq(lenv_t *e, lval_t *a, char *op)
+/* a C identifier for a symbol */
+static void lemit_name(FILE *out, const char *prefix, lsym_t *sym)
 {
-	LASSERT(a, a->count == 2, "Function '==' wrong number of arguments. Got %d, Expected 2", a->count);
-
-	lval_t *left  = lval_pop(a, 0);
-	lval_t *right = lval_pop(a, 0);
-
-	int res = lval_eq(left, right);
-
-	lval_del(left);
-	lval_del(right);
-	lval_del(a);
-
-	if (strcmp(op, "!=") == 0) {
-		res = !res;
+	fputs(prefix, out);
+	for (const char *c = sym->name; *c; c++) {
+		if ((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9')) {
+			fputc(*c, out);
+		} else {
+			fprintf(out, "_%02x", (unsigned char)*c);
+		}
 	}
-
-	return lval_num(res);
 }
 
-static lval_t *builtin_eq(lenv_t *e, lval_t *a)
+/* s escaped to go in a C string */
+static void lemit_string(FILE *out, const char *s)
 {
-	return builtin_eqneq(e, a, "==");
+	for (; *s; s++) {
+		if (*s == '\\' || *s == '"') {
+			fputc('\\', out);
+		}
+		fputc(*s, out);
+	}
 }
 
-static lval_t *builtin_ne(lenv_t *e, lval_t *a)
+static void lemit_indent(FILE *out, int depth)
 {
-	return builtin_eqneq(e, a, "!=");
+	for (int i = 0; i < depth; i++) {
+		fputc('\t', out);
+	}
 }
 
-static lval_t *builtin_gt(lenv_t *e, lval_t *a)
+/* v as source, escaped to go in a C string */
+static void lemit_source(FILE *out, lval_t *v)
 {
-	return builtin_ord(e, a, ">");
+	switch (v->type) {
+	case LVAL_NUM:
+		fprintf(out, "%li", v->num);
+		break;
+	case LVAL_SYM:
+		lemit_string(out, LSYM(v));
+		break;
+	case LVAL_SEXPR:
+	case LVAL_QEXPR:
+		fputc(v->type == LVAL_SEXPR ? '(' : '{', out);
+		for (int i = 0; i < v->count; i++) {
+			if (i) {
+				fputc(' ', out);
+			}
+			lemit_source(out, lemit_at(v, i));
+		}
+		fputc(v->type == LVAL_SEXPR ? ')' : '}', out);
+		break;
+	}
 }
 
-static lval_t *builtin_lt(lenv_t *e, lval_t *a)
+static void lemit_cells(struct lemit *m, struct lemit_fn *f, lval_t *v, FILE *out);
+
+static void lemit_expr(struct lemit *m, struct lemit_fn *f, lval_t *v, FILE *out)
 {
-	return builtin_ord(e, a, "<");
+	if (v->type == LVAL_NUM) {
+		if (v->num == LONG_MIN) {
+			fputs("LONG_MIN", out);
+		} else {
+			fprintf(out, "%liL", v->num);
+		}
+	} else if (v->type == LVAL_SYM) {
+		fprintf(out, "a%i", lemit_formal(f, v));
+	} else {
+		lemit_cells(m, f, v, out);
+	}
 }
 
-static lval_t *builtin_ge(lenv_t *e, lval_t *a)
+/* the cells of v as a C expression */
+static void lemit_cells(struct lemit *m, struct lemit_fn *f, lval_t *v, FILE *out)
 {
-	return builtin_ord(e, a, ">=");
+	static const char *arith[] = { "ml_add", "ml_sub", "ml_mul", "ml_div", "ml_mod" };
+
+	if (v->count == 1) {
+		lemit_expr(m, f, lemit_at(v, 0), out);
+		return;
+	}
+
+	lval_t *k = lemit_at(v, 0);
+	int op = lemit_op(k);
+
+	if (lemit_is(k, "if")) {
+		fputs("(", out);
+		lemit_expr(m, f, lemit_at(v, 1), out);
+		fputs(" ? ", out);
+		lemit_cells(m, f, lemit_at(v, 2), out);
+		fputs(" : ", out);
+		lemit_cells(m, f, lemit_at(v, 3), out);
+		fputs(")", out);
+	} else if (op >= LOP_EQ - LOP_ADD) {
+		/* the comparisons are spelled just like C's */
+		fputs("(long)(", out);
+		lemit_expr(m, f, lemit_at(v, 1), out);
+		fprintf(out, " %s ", lops[op].name);
+		lemit_expr(m, f, lemit_at(v, 2), out);
+		fputs(")", out);
+	} else {
+		if (op >= 0) {
+			fprintf(out, "%s(", arith[op]);
+		} else {
+			lemit_name(out, "mlf_", k->sym);
+			fputs("(", out);
+		}
+		for (int i = 1; i < v->count; i++) {
+			lemit_expr(m, f, lemit_at(v, i), out);
+			fputs(i + 1 < v->count ? ", " : "", out);
+		}
+		fputs(")", out);
+	}
 }
 
-static lval_t *builtin_le(lenv_t *e, lval_t *a)
+/* is a call in tail position of v a call to f itself? */
+static int lemit_loops(struct lemit_fn *f, lval_t *v)
 {
-	return builtin_ord(e, a, "<=");
+	if (v->count == 1) {
+		lval_t *x = lemit_at(v, 0);
+		return x->type == LVAL_SEXPR && lemit_loops(f, x);
+	}
+
+	lval_t *k = lemit_at(v, 0);
+	if (lemit_is(k, "if")) {
+		return lemit_loops(f, lemit_at(v, 2)) || lemit_loops(f, lemit_at(v, 3));
+	}
+
+	return k->sym == f->name;
 }
 
-static lval_t *builtin_if(lenv_t *e, lval_t *a)
+/* statements setting r to the cells of v, where they're the result of f */
+static void lemit_tail(struct lemit *m, struct lemit_fn *f, lval_t *v, int depth, FILE *out)
 {
-	LASSERT(a, a->count == 3, "Function 'if' got wrong number of arguments. Got %i, Expected 3.", a->count);
-
-	LASSERT_TYPE(a, "if", a->cell[0]->type, LVAL_NUM);
-	LASSERT_TYPE(a, "if", a->cell[1]->type, LVAL_QEXPR);
-	LASSERT_TYPE(a, "if", a->cell[2]->type, LVAL_QEXPR);
+	if (v->count == 1 && lemit_at(v, 0)->type == LVAL_SEXPR) {
+		lemit_tail(m, f, lemit_at(v, 0), depth, out);
+		return;
+	}
 
-	lval_t *x;
-	/* mark both as S-Expressions to make them evaluabl */
-	a->cell[1]->type = LVAL_SEXPR;
-	a->cell[2]->type = LVAL_SEXPR;
+	lval_t *k = v->count == 1 ? NULL : lemit_at(v, 0);
+
+	if (k && lemit_is(k, "if")) {
+		lemit_indent(out, depth);
+		fputs("if (", out);
+		lemit_expr(m, f, lemit_at(v, 1), out);
+		fputs(") {\n", out);
+		lemit_tail(m, f, lemit_at(v, 2), depth + 1, out);
+		lemit_indent(out, depth);
+		fputs("} else {\n", out);
+		lemit_tail(m, f, lemit_at(v, 3), depth + 1, out);
+		lemit_indent(out, depth);
+		fputs("}\n", out);
+		return;
+	}
 
-	if (a->cell[0]->num) {
-		x = lval_eval(e, lval_pop(a, 1));
-	} else {
-		x = lval_eval(e, lval_pop(a, 2));
+	/* calling ourselves is just going round again */
+	if (k && k->sym == f->name) {
+		for (int i = 1; i < v->count; i++) {
+			lemit_indent(out, depth);
+			fprintf(out, "long t%i = ", i - 1);
+			lemit_expr(m, f, lemit_at(v, i), out);
+			fputs(";\n", out);
+		}
+		for (int i = 1; i < v->count; i++) {
+			lemit_indent(out, depth);
+			fprintf(out, "a%i = t%i;\n", i - 1, i - 1);
+		}
+		lemit_indent(out, depth);
+		fputs("goto top;\n", out);
+		return;
 	}
 
-	lval_del(a);
+	lemit_indent(out, depth);
+	fputs("r = ", out);
+	lemit_cells(m, f, v, out);
+	fputs(";\n", out);
+	lemit_indent(out, depth);
+	fputs("goto out;\n", out);
+}
 
-	return x;
+static void lemit_formals(struct lemit_fn *f, FILE *out)
+{
+	int n = f->formals->count;
+
+	fputs("(", out);
+	for (int i = 0; i < n; i++) {
+		fprintf(out, "long a%i%s", i, i + 1 < n ? ", " : "");
+	}
+	fputs(n ? ")" : "void)", out);
 }
 
-static lval_t *lval_join(lval_t *x, lval_t *y)
+/*
+ * mark in seen what the code for v in f counts on: the functions it calls,
+ * and what they call in turn, then if and the operators past those
+ */
+static void lemit_deps(struct lemit *m, struct lemit_fn *f, lval_t *v, char *seen)
 {
-	while (y->count) {
-		x = lval_add(x, lval_pop(y, 0));
+	if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) {
+		return;
 	}
 
-	lval_del(y);
+	lval_t *k = v->count > 1 ? lemit_at(v, 0) : NULL;
+	struct lemit_fn *g = k ? lemit_find(m, k) : NULL;
+	if (k && lemit_is(k, "if")) {
+		seen[m->count + LEMIT_IF] = 1;
+	} else if (k && lemit_op(k) >= 0) {
+		seen[m->count + lemit_op(k)] = 1;
+	} else if (g && !seen[g - m->fn]) {
+		seen[g - m->fn] = 1;
+		lemit_deps(m, g, g->body, seen);
+	}
 
-	return x;
+	for (int i = 0; i < v->count; i++) {
+		lemit_deps(m, f, lemit_at(v, i), seen);
+	}
 }
 
-static lval_t *lval_take(lval_t *v, int i)
+/* the lambda f is compiled from, as source escaped to go in a C string */
+static void lemit_lambda(struct lemit_fn *f, FILE *out)
 {
-	lval_t *x = lval_pop(v, i);
-	lval_del(v);
+	lemit_string(out, "(\\ ");
+	lemit_source(out, f->formals);
+	fputc(' ', out);
+	lemit_source(out, f->body);
+	fputc(')', out);
+}
 
-	return x;
+static void lemit_fn(struct lemit *m, struct lemit_fn *f, FILE *out)
+{
+	int n = f->formals->count;
+
+	fputs("static long ", out);
+	lemit_name(out, "mlf_", f->name);
+	lemit_formals(f, out);
+	fputs("\n{\n\tlong r;\n\n\tml_depth++;\n", out);
+	if (lemit_loops(f, f->body)) {
+		fputs("top:\n", out);
+	}
+	fputs("\tif (ml_bail || ml_depth > ML_DEPTH) {\n"
+	      "\t\tml_bail = 1;\n"
+	      "\t\tr = 0;\n"
+	      "\t\tgoto out;\n"
+	      "\t}\n\n", out);
+	lemit_tail(m, f, f->body, 1, out);
+	fputs("out:\n\tml_depth--;\n\treturn r;\n}\n\n", out);
+
+	/* whether all it counts on is still bound to what it was */
+	char *seen = calloc(m->count + LEMIT_SYMS, 1);
+	seen[f - m->fn] = 1;
+	lemit_deps(m, f, f->body, seen);
+
+	fputs("static int ", out);
+	lemit_name(out, "mlg_", f->name);
+	fputs("(lenv_t *e)\n{\n\treturn ", out);
+	for (int i = 0, first = 1; i < m->count + LEMIT_SYMS; i++) {
+		if (!seen[i]) {
+			continue;
+		}
+		fputs(first ? "" : " &&\n\t\t", out);
+		first = 0;
+		if (i < m->count) {
+			fputs("ml_is(e, ", out);
+			lemit_name(out, "mls_", m->fn[i].name);
+			fputs(", ", out);
+			lemit_name(out, "mlb_", m->fn[i].name);
+			fputs(")", out);
+		} else {
+			fprintf(out, "ml_is(e, ml_sym[%i], ml_builtin[%i])", i - m->count, i - m->count);
+		}
+	}
+	fputs(";\n}\n\n", out);
+	free(seen);
+
+	/* and the builtin that calls it, or failing that the lambda */
+	fputs("static lval_t *", out);
+	lemit_name(out, "mlb_", f->name);
+	fprintf(out, "(lenv_t *e, lval_t *a)\n{\n\tlong x[%i];\n\n\tif (", n ? n : 1);
+	lemit_name(out, "mlg_", f->name);
+	fprintf(out, "(e) && lval_nums(a, x, %i)) {\n\t\tml_bail = 0;\n\t\tml_depth = 0;\n\t\tlong r = ", n);
+	lemit_name(out, "mlf_", f->name);
+	fputs("(", out);
+	for (int i = 0; i < n; i++) {
+		fprintf(out, "x[%i]%s", i, i + 1 < n ? ", " : "");
+	}
+	fputs(");\n\t\tif (!ml_bail) {\n\t\t\tlval_del(a);\n\t\t\treturn lval_num(r);\n\t\t}\n\t}\n\n"
+	      "\treturn lval_call(e, ", out);
+	lemit_name(out, "mll_", f->name);
+	fputs(", a);\n}\n\n", out);
+
+	/*
+	 * and what puts it in, once its definition has been run, if that left
+	 * the lambda we compiled bound to the name
+	 */
+	fputs("static void ", out);
+	lemit_name(out, "mld_", f->name);
+	fputs("(lenv_t *e)\n{\n"
+	      "\tif (!ml_is(e, ml_sym[ML_EQ], ml_builtin[ML_EQ]) ||\n"
+	      "\t    !ml_is(e, ml_sym[ML_LAMBDA], ml_builtin[ML_LAMBDA])) {\n"
+	      "\t\treturn;\n\t}\n\n"
+	      "\tlval_t *v = lval_run(e, \"(== ", out);
+	lemit_string(out, f->name->name);
+	fputc(' ', out);
+	lemit_lambda(f, out);
+	fputs(")\");\n\tif (v->type == LVAL_NUM && v->num) {\n\t\t", out);
+	lemit_name(out, "mll_", f->name);
+	fputs(" = lval_run(e, \"", out);
+	lemit_string(out, f->name->name);
+	fputs("\");\n\t\tlenv_add_builtin(e, \"", out);
+	lemit_string(out, f->name->name);
+	fputs("\", ", out);
+	lemit_name(out, "mlb_", f->name);
+	fputs(");\n\t}\n\tlval_del(v);\n}\n\n", out);
 }
 
-static lval_t *lval_eval_sexpr(lenv_t *e, lval_t *v)
+/* the top level forms from first up to last, as one string for the interpreter */
+static void lemit_step(lval_t *exprs, int first, int last, struct lemit_fn *f, FILE *out)
 {
-	for (int i = 0; i < v->count; i++) {
-		v->cell[i] = lval_eval(e, v->cell[i]);
+	fputs("\t{ \"", out);
+	for (int i = first; i < last; i++) {
+		fputs(i > first ? "\n\t  \"" : "", out);
+		lemit_source(out, lemit_at(exprs, i));
+		fputs("\\n\"", out);
+	}
+	fputs(first == last ? "\", " : ", ", out);
+	if (f) {
+		lemit_name(out, "mld_", f->name);
+	} else {
+		fputs("NULL", out);
 	}
+	fputs(" },\n", out);
+}
 
-	for (int i = 0; i < v->count; i++) {
-		if (v->cell[i]->type == LVAL_ERR) {
-			return lval_take(v, i);
+/*
+ * Write out a C program that does what the one in the file at path does.
+ * Returns NULL, or an error if the file couldn't be read.
+ */
+lval_t *lval_emit_c(const char *path, FILE *out)
+{
+	char *input = lfile_read(path);
+	if (input == NULL) {
+		return lval_err("Could not load file '%s'", path);
+	}
+
+	lval_t *exprs = lval_read(input);
+	free(input);
+	if (exprs->type == LVAL_ERR) {
+		return exprs;
+	}
+
+	/* only fun as it's usually defined can be trusted with definitions */
+	struct lemit m = { NULL, 0, 0, 0 };
+	int funs = 0;
+	lemit_scan(&m, exprs, &funs);
+
+	lval_t *prelude = lval_read("(def {fun} (\\ {args body} {def (head args) (\\ (tail args) body)}))");
+	for (int i = 0; funs == 1 && i < exprs->count; i++) {
+		m.fun |= lval_eq(lemit_at(exprs, i), lemit_at(prelude, 0));
+	}
+	lval_del(prelude);
+
+	m.fn = malloc(sizeof(struct lemit_fn) * (exprs->count + 1));
+	for (int i = 0; i < exprs->count; i++) {
+		m.count += lemit_candidate(&m, lemit_at(exprs, i), &m.fn[m.count]);
+	}
+
+	m.builtins = 0;
+	lemit_scan(&m, exprs, &funs);
+
+	/* knock out anything that can't be compiled, until nothing changes */
+	for (int i = 0; i < m.count; i++) {
+		m.fn[i].ok = m.fn[i].defs == 1 && !m.builtins;
+	}
+	for (int changed = 1; changed;) {
+		changed = 0;
+		for (int i = 0; i < m.count; i++) {
+			if (m.fn[i].ok && !lemit_check_cells(&m, &m.fn[i], m.fn[i].body)) {
+				m.fn[i].ok = 0;
+				changed = 1;
+			}
 		}
 	}
 
-	if (v->count == 0) {
-		return v;
+	int any = 0;
+	for (int i = 0; i < m.count; i++) {
+		any |= m.fn[i].ok;
 	}
 
-	if (v->count == 1) {
-		return lval_take(v, 0);
+	fprintf(out, "/* compiled from %s by meowlisp --emit-c */\n\n", path);
+	fputs("#include <limits.h>\n#include \"meowlisp.h\"\n\n", out);
+	if (any) {
+		fputs("#define ML_DEPTH 10000\n\n"
+		      "static int ml_bail;\n"
+		      "static long ml_depth;\n\n", out);
+
+		/* the builtins the compiled code stands in for, as they were to start with */
+		fprintf(out, "#define ML_EQ     %i\n#define ML_LAMBDA %i\n\n", LEMIT_EQ, LEMIT_LAMBDA);
+		fputs("static const char *ml_name[] = {", out);
+		for (int i = 0; i < LEMIT_SYMS; i++) {
+			fputs(i % 8 ? " \"" : "\n\t\"", out);
+			lemit_string(out, i == LEMIT_IF ? "if" : i == LEMIT_LAMBDA ? "\\" : lops[i].name);
+			fputs("\",", out);
+		}
+		fprintf(out, "\n};\n\nstatic lsym_t *ml_sym[%i];\nstatic lbuiltin_t ml_builtin[%i];\n\n",
+			LEMIT_SYMS, LEMIT_SYMS);
+		fputs("static int ml_is(lenv_t *e, lsym_t *sym, lbuiltin_t builtin)\n{\n"
+		      "\tlval_t *v = lenv_global(e, sym);\n\n"
+		      "\treturn v && v->type == LVAL_FUN && (v->flags & LVAL_BUILTIN) && v->builtin == builtin;\n"
+		      "}\n\n", out);
 	}
 
-	lval_t *f = lval_pop(v, 0);
-	if (f->type != LVAL_FUN) {
-		lval_t *err =  lval_err("first element is not a function! Got %s, Expected %s",
-				ltype_name(f->type),
-				ltype_name(LVAL_FUN));
-		lval_del(f);
-		lval_del(v);
+	static const char *arith[] = { "add", "sub", "mul" };
+	for (int i = 0; any && i < 3; i++) {
+		fprintf(out, "static inline long ml_%s(long a, long b)\n{\n\tlong r;\n\n"
+			"\tif (__builtin_%s_overflow(a, b, &r)) {\n\t\tml_bail = 1;\n\t}\n\n"
+			"\treturn r;\n}\n\n", arith[i], arith[i]);
+	}
+	for (int i = 0; any && i < 2; i++) {
+		fprintf(out, "static inline long ml_%s(long a, long b)\n{\n"
+			"\tif (b == 0 || (b == -1 && a == LONG_MIN)) {\n\t\tml_bail = 1;\n\t\treturn 0;\n\t}\n\n"
+			"\treturn a %c b;\n}\n\n", i ? "mod" : "div", i ? '%' : '/');
+	}
 
-		return err;
+	for (int i = 0; i < m.count; i++) {
+		if (m.fn[i].ok) {
+			fputs("static lsym_t *", out);
+			lemit_name(out, "mls_", m.fn[i].name);
+			fputs(";\nstatic lval_t *", out);
+			lemit_name(out, "mll_", m.fn[i].name);
+			fputs(";\nstatic lval_t *", out);
+			lemit_name(out, "mlb_", m.fn[i].name);
+			fputs("(lenv_t *e, lval_t *a);\nstatic long ", out);
+			lemit_name(out, "mlf_", m.fn[i].name);
+			lemit_formals(&m.fn[i], out);
+			fputs(";\n\n", out);
+		}
 	}
 
-	lval_t *res = lval_call(e, f, v);
-	lval_del(f);
+	for (int i = 0; i < m.count; i++) {
+		if (m.fn[i].ok) {
+			lemit_fn(&m, &m.fn[i], out);
+		}
+	}
+
+	/*
+	 * the program, in steps that end with a compiled function's
+	 * definition, so it can be put in then
+	 */
+	fputs("static const struct {\n\tconst char *src;\n\tvoid (*defined)(lenv_t *e);\n} ml_program[] = {\n", out);
+	int first = 0;
+	for (int i = 0, f = 0; i < exprs->count; i++) {
+		for (; f < m.count && m.fn[f].form != lemit_at(exprs, i); f++);
+		if (f < m.count && m.fn[f].ok) {
+			lemit_step(exprs, first, i + 1, &m.fn[f], out);
+			first = i + 1;
+		}
+	}
+	if (first < exprs->count || first == 0) {
+		lemit_step(exprs, first, exprs->count, NULL, out);
+	}
+	fputs("};\n\n", out);
+
+	fputs("int main(void)\n{\n\tlenv_t *e = lenv_new();\n\tlenv_add_builtins(e);\n\n", out);
+	if (any) {
+		fputs("\tfor (int i = 0; i < (int)(sizeof(ml_sym) / sizeof(*ml_sym)); i++) {\n"
+		      "\t\tml_sym[i] = lsym_intern(ml_name[i]);\n"
+		      "\t\tml_builtin[i] = lenv_global(e, ml_sym[i])->builtin;\n\t}\n", out);
+	}
+	for (int i = 0; i < m.count; i++) {
+		if (m.fn[i].ok) {
+			fputs("\t", out);
+			lemit_name(out, "mls_", m.fn[i].name);
+			fputs(" = lsym_intern(\"", out);
+			lemit_string(out, m.fn[i].name->name);
+			fputs("\");\n", out);
+		}
+	}
+	fputs("\n\tlval_t *v = NULL;\n"
+	      "\tfor (size_t i = 0; i < sizeof(ml_program) / sizeof(*ml_program); i++) {\n"
+	      "\t\tif (v) {\n\t\t\tlval_del(v);\n\t\t}\n"
+	      "\t\tv = lval_run(e, ml_program[i].src);\n"
+	      "\t\tif (v->type == LVAL_ERR) {\n\t\t\tbreak;\n\t\t}\n"
+	      "\t\tif (ml_program[i].defined) {\n\t\t\tml_program[i].defined(e);\n\t\t}\n\t}\n"
+	      "\tlval_println(v);\n\tlval_del(v);\n\n"
+	      "\treturn 0;\n}\n", out);
+
+	for (int i = 0; i < m.count; i++) {
+		if (m.fn[i].fun) {
+			lval_del(m.fn[i].formals);
+		}
+	}
+	free(m.fn);
+	lval_del(exprs);
 
-	return res;
+	return NULL;
 }
 
 static char *ltype_name(int t)
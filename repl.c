@@ -1,5 +1,7 @@
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <histedit.h>
 
 #include "mpc.h"
@@ -17,6 +19,84 @@ int main(int argc, char **argv)
 	lenv_t *e = lenv_new();
 	lenv_add_builtins(e);
 
+	/*
+	 * --stats reports how much memory went on lvals once we're done,
+	 * --dynamic has lambdas look up names in their caller like they used to,
+	 * --tree sticks to the tree-walking evaluator instead of bytecode,
+	 * --closures compiles to trees of closures instead,
+	 * --no-jit never compiles hot lambdas to native code,
+	 * --perf-map lists what it does compile in /tmp/perf-<pid>.map for perf,
+	 * --emit-c writes out the file as a C program rather than running it,
+	 * --max-depth N makes calls nested more than N deep an error
+	 */
+	int stats = 0;
+	int emit = 0;
+	int i = 1;
+	for (; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+		if (strcmp(argv[i], "--stats") == 0) {
+			stats = 1;
+		} else if (strcmp(argv[i], "--dynamic") == 0) {
+			e->flags |= LENV_DYNAMIC;
+		} else if (strcmp(argv[i], "--tree") == 0) {
+			e->flags |= LENV_TREE;
+		} else if (strcmp(argv[i], "--closures") == 0) {
+			e->flags |= LENV_CLOSURES;
+		} else if (strcmp(argv[i], "--no-jit") == 0) {
+			e->flags |= LENV_NOJIT;
+		} else if (strcmp(argv[i], "--perf-map") == 0) {
+			e->flags |= LENV_PERFMAP;
+		} else if (strcmp(argv[i], "--emit-c") == 0) {
+			emit = 1;
+		} else if (strcmp(argv[i], "--max-depth") == 0) {
+			if (i + 1 == argc) {
+				fprintf(stderr, "--max-depth needs a depth\n");
+				return 1;
+			}
+			char *end;
+			long n = strtol(argv[++i], &end, 10);
+			if (end == argv[i] || *end != '\0' || n <= 0 || n > INT_MAX) {
+				fprintf(stderr, "--max-depth takes a whole number above 0, not '%s'\n", argv[i]);
+				return 1;
+			}
+			lval_max_depth = (int)n;
+		} else {
+			fprintf(stderr, "unknown option '%s'\n", argv[i]);
+			return 1;
+		}
+	}
+
+	if (emit) {
+		if (i + 1 != argc) {
+			fprintf(stderr, "--emit-c takes just the one file\n");
+			return 1;
+		}
+
+		lval_t *err = lval_emit_c(argv[i], stdout);
+		lenv_del(e);
+		if (err) {
+			lval_println(err);
+			lval_del(err);
+			return 1;
+		}
+
+		return 0;
+	}
+
+	/* run any files we were given instead of starting up the REPL */
+	if (i < argc) {
+		for (; i < argc; i++) {
+			lval_t *v = lval_load(e, argv[i]);
+			lval_println(v);
+			lval_del(v);
+		}
+		if (stats) {
+			lstats_print();
+		}
+		lenv_del(e);
+
+		return 0;
+	}
+
 	History *h =  history_init();
 	HistEvent ev;
 